@@ -0,0 +1,211 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Recognizing files by their signatures.
+ *
+ * libmodplug tries every loader in turn, after the whole file has been
+ * read. This looks at a few kilobytes from each end of the file first,
+ * so other files in the same folder are turned away cheaply. Every
+ * format libmodplug loads has a signature, except 15-sample MODs that
+ * are checked for a plausible header instead.
+ */
+#include "classify.h"
+#include "input.h"
+
+
+/**
+ * A signature, matched against the start or the end of the file.
+**/
+struct signature {
+	enum mod_class cls;
+	enum mod_format format;
+
+	/// The offset of the magic bytes. Negative offsets count from the end.
+	long offset;
+	const char *magic;
+	size_t len;
+
+	/// An additional test of the start of the file, may be NULL.
+	spbool (*check)(const unsigned char *head, size_t len);
+};
+
+
+static spbool isMod31(const unsigned char *head, size_t len)
+{
+	return len >= 1084 && get_mod_signature_channels(head + 1080);
+}
+
+/**
+ * Return non-zero if the bytes are text, padded with zeros.
+**/
+static spbool isText(const unsigned char *p, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (p[i] && (p[i] < 0x20 || p[i] == 0x7F)) return spfalse;
+	}
+
+	return sptrue;
+}
+
+/**
+ * Check the header of a 15-sample MOD, which has no signature.
+**/
+static spbool isMod15(const unsigned char *head, size_t len)
+{
+	if (len < 600 || !isText(head, 20)) return spfalse;
+
+	for (unsigned int i = 0; i < 15; ++i) {
+		const unsigned char *sample = head + 20 + 30 * i;
+
+		if (!isText(sample, 22) || sample[24] > 15 || sample[25] > 64)
+			return spfalse;
+	}
+
+	if (!head[470] || head[470] > 128) return spfalse;
+
+	for (unsigned int i = 0; i < 128; ++i) {
+		if (head[472 + i] >= 64) return spfalse;
+	}
+
+	return sptrue;
+}
+
+static spbool isRiff(const unsigned char *head, size_t len)
+{
+	return len >= 4 && !memcmp(head, "RIFF", 4);
+}
+
+static spbool isMpegAudio(const unsigned char *head, size_t len)
+{
+	return len >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0;
+}
+
+static const struct signature SIGNATURES[] = {
+	// Modules
+	{ MOD_CLASS_MODULE, MOD_FORMAT_IT, 0, "IMPM", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_XM, 0, "Extended Module: ", 17, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_S3M, 44, "SCRM", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MOD, 0, NULL, 0, isMod31 },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_669, 0, "if", 2, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_669, 0, "JN", 2, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_AMF, 0, "AMF", 3, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_AMF, 0, "ASYLUM Music Format", 19, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_AMS, 0, "Extreme", 7, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_AMS, 0, "AMShdr\x1A", 7, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_DBM, 0, "DBM0", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_DMF, 0, "DDMF", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_DSM, 0, "DSMF", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_DSM, 8, "DSMF", 4, isRiff },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_FAR, 0, "FAR\xFE", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MDL, 0, "DMDL", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MED, 0, "MMD", 3, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MTM, 0, "MTM", 3, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_OKT, 0, "OKTASONG", 8, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_PTM, 44, "PTMF", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_STM, 28, "\x1A\x02", 2, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_ULT, 0, "MAS_UTrack_V00", 14, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_UMX, 0, "\xC1\x83\x2A\x9E", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MT2, 0, "MT20", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_PSM, 0, "PSM ", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_PSM, 0, "PSM\xFE", 4, NULL },
+	{ MOD_CLASS_MODULE, MOD_FORMAT_WAV, 8, "WAVE", 4, isRiff },
+
+	// Packers handled by libmodplug
+	{ MOD_CLASS_PACKED, MOD_FORMAT_UNKNOWN, 0, "ziRCONia", 8, NULL },
+	{ MOD_CLASS_PACKED, MOD_FORMAT_UNKNOWN, 0, "PP20", 4, NULL },
+
+	// Archives
+	{ MOD_CLASS_ARCHIVE, MOD_FORMAT_UNKNOWN, 0, "PK\x03\x04", 4, NULL },
+
+	// Other audio found in music folders
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, "ID3", 3, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, "fLaC", 4, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, "OggS", 4, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, "MAC ", 4, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, "wvpk", 4, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 4, "ftyp", 4, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, 0, NULL, 0, isMpegAudio },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, -128, "TAG", 3, NULL },
+	{ MOD_CLASS_REJECTED, MOD_FORMAT_UNKNOWN, -32, "APETAGEX", 8, NULL },
+
+	// Last, since it has no signature.
+	{ MOD_CLASS_MODULE, MOD_FORMAT_MOD, 0, NULL, 0, isMod15 },
+};
+
+
+static spbool matchSignature(const struct signature *sig, const unsigned char *head, size_t head_len, const unsigned char *tail, size_t tail_len)
+{
+	if (sig->magic) {
+		const unsigned char *p;
+
+		if (sig->offset >= 0) {
+			if (sig->offset + sig->len > head_len) return spfalse;
+
+			p = head + sig->offset;
+		} else {
+			if ((size_t) -sig->offset > tail_len || !tail) return spfalse;
+
+			p = tail + tail_len + sig->offset;
+		}
+
+		if (memcmp(p, sig->magic, sig->len)) return spfalse;
+	}
+
+	return !sig->check || sig->check(head, head_len);
+}
+
+enum mod_class classify_data(const void *head, size_t head_len, const void *tail, size_t tail_len, enum mod_format *format)
+{
+	if (head_len > CLASSIFY_HEAD_SIZE) head_len = CLASSIFY_HEAD_SIZE;
+
+	for (size_t i = 0; i < sizeof(SIGNATURES) / sizeof(*SIGNATURES); ++i) {
+		const struct signature *sig = &SIGNATURES[i];
+
+		if (matchSignature(sig, head, head_len, tail, tail_len)) {
+			*format = sig->format;
+			return sig->cls;
+		}
+	}
+
+	*format = MOD_FORMAT_UNKNOWN;
+
+	return MOD_CLASS_REJECTED;
+}
+
+enum mod_class classify_input(struct sppb_byte_input *input, enum mod_format *format)
+{
+	unsigned char head[CLASSIFY_HEAD_SIZE];
+	unsigned char tail[CLASSIFY_TAIL_SIZE];
+	size_t tail_len = 0;
+
+	*format = MOD_FORMAT_UNKNOWN;
+
+	if (!input->seek) return MOD_CLASS_MODULE;
+
+	long head_len = read_input_at(input, 0, head, sizeof(head));
+
+	if (head_len < 0) return MOD_CLASS_MODULE;
+
+	if (input->get_length) {
+		sppb_offset length = input->get_length(input);
+
+		// Short files are all in the head already.
+		if (length > head_len) {
+			tail_len = length - head_len < (sppb_offset) sizeof(tail) ? (size_t) (length - head_len) : sizeof(tail);
+
+			if (read_input_at(input, length - tail_len, tail, tail_len) != (long) tail_len)
+				tail_len = 0;
+		} else {
+			tail_len = head_len < (long) sizeof(tail) ? (size_t) head_len : sizeof(tail);
+			memcpy(tail, head + head_len - tail_len, tail_len);
+		}
+	}
+
+	(void) input->seek(input, 0, SPPB_START);
+
+	enum mod_class cls = classify_data(head, head_len, tail_len ? tail : NULL, tail_len, format);
+
+	MPSP_DPRINTF("classify: class %d, format %s\n", cls, get_mod_format_name(*format));
+
+	return cls;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Recognizing files by their signatures.
+ */
+#ifndef __MODPLUG_SPOTIFY_CLASSIFY_H__
+#define __MODPLUG_SPOTIFY_CLASSIFY_H__
+
+#include "common.h"
+#include "header.h"
+
+
+// --- Constants ---
+/**
+ * The number of bytes looked at in the start of a file.
+**/
+#define CLASSIFY_HEAD_SIZE 2048
+
+/**
+ * The number of bytes looked at in the end of a file.
+**/
+#define CLASSIFY_TAIL_SIZE 128
+
+
+// --- Types ---
+/**
+ * What a file is, as far as we can tell from its signature.
+**/
+enum mod_class {
+	/// Not something libmodplug can load.
+	MOD_CLASS_REJECTED,
+
+	/// A module, of the given format.
+	MOD_CLASS_MODULE,
+
+	/// A module packed in a way libmodplug unpacks itself.
+	MOD_CLASS_PACKED,
+
+	/// A ZIP archive that may contain modules.
+	MOD_CLASS_ARCHIVE,
+};
+
+
+// --- Functions ---
+/**
+ * Classify a file from its first and last bytes.
+ *
+ * @param head the start of the file.
+ * @param head_len the size of head, at most CLASSIFY_HEAD_SIZE bytes are used.
+ * @param tail the end of the file, may be NULL.
+ * @param tail_len the size of tail.
+ * @param format set to the module format, if recognized.
+ * @return the class of the file.
+**/
+extern enum mod_class classify_data(const void *head, size_t head_len, const void *tail, size_t tail_len, enum mod_format *format);
+
+/**
+ * Classify an input, reading only its first and last few kilobytes.
+ *
+ * Inputs that can't seek can't be rewound, and are assumed to be
+ * modules of unknown format.
+ *
+ * @param input the input to classify.
+ * @param format set to the module format, if recognized.
+ * @return the class of the file.
+**/
+extern enum mod_class classify_input(struct sppb_byte_input *input, enum mod_format *format);
+
+#endif /* __MODPLUG_SPOTIFY_CLASSIFY_H__ */
@@ -3,94 +3,50 @@
  *
  * Common routines for the ModPlug Spotify plugin.
  */
-#include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/stat.h>
-#if MPSP_HAVE_LIBZIP
-#	include <zip.h>
+#include <time.h>
+#ifdef __GLIBC__
+#	include <malloc.h>
+#	if __GLIBC_PREREQ(2, 33)
+#		define HAVE_MALLINFO2 1
+#	endif
 #endif
 #include "common.h"
+#include "settings.h"
+#include "stats.h"
 
 
-#if MPSP_HAVE_LIBZIP
 /**
- * Read the contents of the first file of the ZIP file and load
- * it into a ModPlugFile.
+ * Return the number of bytes allocated from the heap, or zero if unknown.
 **/
-static ModPlugFile* loadZipFile(const char *path)
+static size_t getHeapSize(void)
 {
-	ModPlugFile *self_ = NULL;
-	int err = 0;
-	struct zip *zf = zip_open(path, 0, &err);
+#if HAVE_MALLINFO2
+	struct mallinfo2 mi = mallinfo2();
 
-	if (!zf) return NULL;
-
-	struct zip_stat sb;
-
-	// FIXME: Assumes the first file is the mod-file
-	if (zip_stat_index(zf, 0, 0, &sb)) {
-		MPSP_EPRINTF("failed to stat ZIP member: %s\n", zip_strerror(zf));
-		goto exit1;
-	}
-
-	// FIXME: Assumes the first file is the mod-file
-	struct zip_file *file = zip_fopen_index(zf, 0, 0);
-
-	if (!file) {
-		MPSP_EPRINTF("failed to open ZIP member: %s\n", zip_strerror(zf));
-		goto exit1;
-	}
-
-	void *data = malloc(sb.size);
-
-	if (!data) {
-		MPSP_EPRINTF("failed to allocate memory: %s\n", strerror(errno));
-		goto exit2;
-	}
-
-	if (zip_fread(file, data, sb.size) != sb.size) {
-		MPSP_EPRINTF("failed to read ZIP member: %s\n", zip_file_strerror(file));
-		goto exit3;
-	}
-
-	self_ = ModPlug_Load(data, sb.size);
-
-exit3:
-	free(data);
-
-exit2:
-	(void) zip_fclose(file);
-
-exit1:
-	(void) zip_close(zf);
-
-	return self_;
-}
+	// Large blocks are mapped separately, and not counted as in use.
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
 #endif
+}
 
-ModPlugFile* load_mod_plug(struct sppb_byte_input *input)
+/**
+ * Call ModPlug_Load(), with libmodplug in use by us.
+**/
+static ModPlugFile* loadModPlug(const void *data, size_t len, size_t *loaded)
 {
 	ModPlugFile *self_;
-
-	if (!input->get_length || !input->seek)
-		return NULL;
-
-	ssize_t len = input->get_length(input);
-
-	if (len < 0) return NULL;
-
-	void *data = malloc(len);
-
-	if (!data) return NULL;
-
-	if (input->read(input, data, len) != len) {
-		MPSP_EPRINTF("failed to read from input\n");
-		free(data);
-		return NULL;
-	}
-
+	size_t heap = getHeapSize();
+	uint64_t start = get_time_ns();
 	self_ = ModPlug_Load(data, len);
+	add_stats_time(NULL, STATS_LOAD, start);
+	size_t used = getHeapSize() - heap;
+
+	// Other threads may have freed memory meanwhile.
+	*loaded = heap && used < SIZE_MAX / 2 ? used : len;
 
 	if (self_) {
 		// The default volume of 127 is lower than the GMES
@@ -100,18 +56,40 @@ ModPlugFile* load_mod_plug(struct sppb_byte_input *input)
 		MPSP_EPRINTF("failed to load file\n");
 	}
 
-	free(data);
+	return self_;
+}
+
+ModPlugFile* load_mod_plug_data(const void *data, size_t len, const struct render_settings *settings, size_t *loaded)
+{
+	if (len > INT_MAX) {
+		MPSP_EPRINTF("file too large\n");
+		return NULL;
+	}
+
+	begin_render(settings);
+	ModPlugFile *self_ = loadModPlug(data, len, loaded);
+	end_render();
+
+	return self_;
+}
+
+ModPlugFile* load_mod_plug_shared(const void *data, size_t len, const struct render_settings *settings, size_t *loaded)
+{
+	if (len > INT_MAX || !begin_shared_load(settings)) return NULL;
+
+	ModPlugFile *self_ = loadModPlug(data, len, loaded);
+	end_shared_load();
 
 	return self_;
 }
 
-int get_sampling_rate(void)
+uint64_t get_time_ns(void)
 {
-	ModPlug_Settings settings;
+	struct timespec ts;
 
-	ModPlug_GetSettings(&settings);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return settings.mFrequency;
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 spbool copy_string(const char *src, char *dest, size_t *length)
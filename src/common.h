@@ -6,6 +6,7 @@
 #ifndef __MODPLUG_SPOTIFY_COMMON_H__
 #define __MODPLUG_SPOTIFY_COMMON_H__
 
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <libmodplug/modplug.h>
@@ -28,27 +29,58 @@
 #define MPSP_EPRINTF(...) fprintf(stderr, "MODPLUG: " __VA_ARGS__)
 
 /**
- * Simple casting of the context argument present in most functions
- * below to the correct type for us.
+ * Export a function from the plugin.
+ *
+ * Everything else is built with hidden visibility, so the plugin can't
+ * be interposed by, or interpose, another copy of the code.
 **/
-#define self ((ModPlugFile*) (context))
+#define MPSP_EXPORT __attribute__((visibility("default")))
 
 
 // --- Functions ---
+struct render_settings;
+
+/**
+ * Entry point for the plugin, see modplug-spotify.c.
+ *
+ * The tools link the plugin in, and call this instead of loading it.
+**/
+extern MPSP_EXPORT struct sppb_plugin_description* CreateSpotifyPlaybackPlugin(void);
+
 /**
- * Load a MOD from the named file.
+ * Load a MOD from memory.
  *
- * @param path a valid file name.
+ * The memory allocated by libmodplug is measured on glibc, where the
+ * heap can be inspected. Elsewhere, and if other threads freed more
+ * than was allocated meanwhile, it is estimated as the size of the
+ * file.
+ *
+ * @param data the file contents, only used during the call.
+ * @param len the length of data, in bytes.
+ * @param settings the settings to load with.
+ * @param loaded set to the memory used by the loaded module, in bytes.
  * @return NULL on error, a valid pointer on success.
 **/
-extern ModPlugFile* load_mod_plug(struct sppb_byte_input *input);
+extern ModPlugFile* load_mod_plug_data(const void *data, size_t len, const struct render_settings *settings, size_t *loaded);
+
+/**
+ * Like load_mod_plug_data(), but without stopping other contexts from
+ * rendering meanwhile, see begin_shared_load().
+ *
+ * For loading in the background, since ModPlug_Load() decompresses all
+ * samples, and takes long enough to hold up playback.
+ *
+ * @return NULL on error, or if libmodplug uses other settings, a valid
+ *         pointer on success.
+**/
+extern ModPlugFile* load_mod_plug_shared(const void *data, size_t len, const struct render_settings *settings, size_t *loaded);
 
 /**
- * Return the sampling rate as reported by libmodplug.
+ * Return a monotonic timestamp.
  *
- * @return the sampling rate, in samples per second.
+ * @return the time, in nanoseconds, from some unspecified point.
 **/
-extern int get_sampling_rate(void);
+extern uint64_t get_time_ns(void);
 
 /**
  * Copy the string from src to dest, updating length aftwards.
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Sample format conversion.
+ */
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define MPSP_HAVE_X86 1
+#	include <immintrin.h>
+#endif
+
+
+/**
+ * The scale from a full scale 32-bit integer to a float.
+**/
+#define S32_SCALE (1.0f / 2147483648.0f)
+
+
+typedef void (*convert_func)(void *buf, size_t count);
+
+
+static void convertScalar(void *buf, size_t count)
+{
+	int32_t *in = buf;
+	float *out = buf;
+
+	for (size_t i = 0; i < count; ++i) {
+		float f = in[i] * S32_SCALE;
+
+		if (f > 1.0f) f = 1.0f;
+		else if (f < -1.0f) f = -1.0f;
+
+		out[i] = f;
+	}
+}
+
+#if MPSP_HAVE_X86
+__attribute__((target("sse2")))
+static void convertSse2(void *buf, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	const __m128 hi = _mm_set1_ps(1.0f);
+	const __m128 lo = _mm_set1_ps(-1.0f);
+	char *p = buf;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 f = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (p + 4 * i)));
+
+		f = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f, scale), lo), hi);
+		_mm_storeu_ps((float*) (p + 4 * i), f);
+	}
+
+	convertScalar(p + 4 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void convertAvx2(void *buf, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	const __m256 hi = _mm256_set1_ps(1.0f);
+	const __m256 lo = _mm256_set1_ps(-1.0f);
+	char *p = buf;
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 f = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (p + 4 * i)));
+
+		f = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(f, scale), lo), hi);
+		_mm256_storeu_ps((float*) (p + 4 * i), f);
+	}
+
+	convertSse2(p + 4 * i, count - i);
+}
+#endif
+
+static convert_func pickConvert(void)
+{
+#if MPSP_HAVE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) return convertAvx2;
+	if (__builtin_cpu_supports("sse2")) return convertSse2;
+#endif
+
+	return convertScalar;
+}
+
+void convert_s32_to_float(void *buf, size_t count)
+{
+	static convert_func convert;
+
+	// Benign race: all threads pick the same function.
+	if (!convert) convert = pickConvert();
+
+	convert(buf, count);
+}
+
+static int64_t clampSample(int64_t x, int64_t lo, int64_t hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+void apply_gain(void *buf, size_t count, unsigned int bits, unsigned int gain)
+{
+	switch (bits) {
+	case 8: {
+		uint8_t *p = buf;
+
+		for (size_t i = 0; i < count; ++i)
+			p[i] = clampSample((((int64_t) p[i] - 128) * gain >> 16) + 128, 0, UINT8_MAX);
+
+		break;
+	}
+
+	case 16: {
+		int16_t *p = buf;
+
+		for (size_t i = 0; i < count; ++i)
+			p[i] = clampSample((int64_t) p[i] * gain >> 16, INT16_MIN, INT16_MAX);
+
+		break;
+	}
+
+	case 32: {
+		int32_t *p = buf;
+
+		for (size_t i = 0; i < count; ++i)
+			p[i] = clampSample((int64_t) p[i] * gain >> 16, INT32_MIN, INT32_MAX);
+
+		break;
+	}
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Sample format conversion.
+ */
+#ifndef __MODPLUG_SPOTIFY_CONVERT_H__
+#define __MODPLUG_SPOTIFY_CONVERT_H__
+
+#include <stdint.h>
+#include "common.h"
+
+
+// --- Functions ---
+/**
+ * Convert 32-bit integer samples to IEEE floats, in place.
+ *
+ * Full scale integers map to [-1, 1], and the result is clipped to
+ * that range. The fastest implementation supported by the CPU is
+ * picked on first use.
+ *
+ * @param buf the samples to convert.
+ * @param count the number of samples in buf.
+**/
+extern void convert_s32_to_float(void *buf, size_t count);
+
+/**
+ * Amplify integer samples, in place, clipping to their range.
+ *
+ * @param buf the samples to amplify.
+ * @param count the number of samples in buf.
+ * @param bits the bits per sample, 8 (unsigned), 16 or 32.
+ * @param gain the gain, in 1/65536ths.
+**/
+extern void apply_gain(void *buf, size_t count, unsigned int bits, unsigned int gain);
+
+#endif /* __MODPLUG_SPOTIFY_CONVERT_H__ */
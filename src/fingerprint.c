@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Content fingerprints of module files.
+ */
+#include "fingerprint.h"
+#include "input.h"
+
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	// 64-bit FNV-1a.
+	if (!hash) hash = 0xCBF29CE484222325ULL;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+spbool get_fingerprint(struct sppb_byte_input *input, struct mod_fingerprint *fp)
+{
+	unsigned char buf[FINGERPRINT_EDGE_SIZE];
+
+	if (!input->get_length || !input->seek)
+		return spfalse;
+
+	sppb_offset len = input->get_length(input);
+
+	if (len <= 0) return spfalse;
+
+	size_t head = len < FINGERPRINT_EDGE_SIZE ? len : FINGERPRINT_EDGE_SIZE;
+
+	if (read_input_at(input, 0, buf, head) != (long) head)
+		return spfalse;
+
+	fp->length = len;
+	fp->hash = hash_bytes(hash_bytes(0, &fp->length, sizeof(fp->length)), buf, head);
+
+	if (len > FINGERPRINT_EDGE_SIZE) {
+		sppb_offset tail = len - FINGERPRINT_EDGE_SIZE;
+
+		// Don't hash the same bytes twice for short files.
+		if (tail < FINGERPRINT_EDGE_SIZE) tail = FINGERPRINT_EDGE_SIZE;
+
+		if (read_input_at(input, tail, buf, len - tail) != len - tail)
+			return spfalse;
+
+		fp->hash = hash_bytes(fp->hash, buf, len - tail);
+	}
+
+	return sptrue;
+}
+
+void set_fingerprint_song(struct mod_fingerprint *fp, unsigned int song_index)
+{
+	if (song_index) fp->hash = hash_bytes(fp->hash, &song_index, sizeof(song_index));
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Content fingerprints of module files.
+ */
+#ifndef __MODPLUG_SPOTIFY_FINGERPRINT_H__
+#define __MODPLUG_SPOTIFY_FINGERPRINT_H__
+
+#include <stdint.h>
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The number of bytes hashed from each end of the file.
+**/
+#define FINGERPRINT_EDGE_SIZE 4096
+
+
+// --- Types ---
+/**
+ * Identifies the contents of a file without reading all of it.
+**/
+struct mod_fingerprint {
+	uint64_t length;
+	uint64_t hash;
+};
+
+
+// --- Functions ---
+/**
+ * Compute the fingerprint of the input.
+ *
+ * This is the file length and a hash of the first and last
+ * FINGERPRINT_EDGE_SIZE bytes. The input position is undefined
+ * after the call.
+ *
+ * @param input the input to read from. Must support seeking.
+ * @param fp the fingerprint to fill in.
+ * @return zero if the input could not be read, non-zero otherwise.
+**/
+extern spbool get_fingerprint(struct sppb_byte_input *input, struct mod_fingerprint *fp);
+
+/**
+ * Make a fingerprint identify a song within the file.
+ *
+ * Song 0 keeps the fingerprint of the file, so single song files are
+ * not affected.
+**/
+extern void set_fingerprint_song(struct mod_fingerprint *fp, unsigned int song_index);
+
+/**
+ * Hash a block of memory, continuing from an earlier hash.
+ *
+ * Start with a hash of zero.
+**/
+extern uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+
+#endif /* __MODPLUG_SPOTIFY_FINGERPRINT_H__ */
@@ -0,0 +1,837 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Lightweight parsing of module headers, without libmodplug.
+ *
+ * Only the song header, the order list and the pattern data are read,
+ * which is enough to find the title, channel count and length of the
+ * song. Sample data is never touched.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "header.h"
+#include "input.h"
+
+
+/**
+ * The default number of rows in a pattern.
+**/
+#define DEFAULT_ROWS 64
+
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+static unsigned int bcd(unsigned int param)
+{
+	return (param >> 4) * 10 + (param & 0x0F);
+}
+
+/**
+ * Read exactly len bytes from the given offset.
+**/
+static spbool readAt(struct sppb_byte_input *input, long offset, void *buf, size_t len)
+{
+	return read_input_at(input, offset, buf, len) == (long) len;
+}
+
+/**
+ * Copy a space or zero padded title.
+**/
+static void copyTitle(char *dest, const unsigned char *src, size_t len)
+{
+	size_t n = 0;
+
+	if (len > MOD_TITLE_MAX) len = MOD_TITLE_MAX;
+
+	while (n < len && src[n]) {
+		dest[n] = src[n];
+		++n;
+	}
+
+	while (n && dest[n - 1] == ' ')
+		--n;
+
+	dest[n] = 0;
+}
+
+static spbool addEvent(struct mod_header *h, unsigned int pattern, unsigned int row, unsigned int channel, enum mod_command command, unsigned int param)
+{
+	// The capacity is the next power of two, with a minimum of 16.
+	unsigned int n = h->num_events;
+
+	if (!n || (n >= 16 && !(n & (n - 1)))) {
+		struct mod_event *events = realloc(h->events, (n ? 2 * n : 16) * sizeof(*events));
+
+		if (!events) return spfalse;
+
+		h->events = events;
+	}
+
+	struct mod_event *e = &h->events[h->num_events++];
+
+	e->row = row;
+	e->channel = channel;
+	e->command = command;
+	e->param = param;
+	++h->patterns[pattern].num_events;
+
+	return sptrue;
+}
+
+/**
+ * Add an Exy command of MOD and XM, if it affects timing.
+**/
+static spbool addExtendedEvent(struct mod_header *h, unsigned int pattern, unsigned int row, unsigned int channel, unsigned int param)
+{
+	switch (param >> 4) {
+	case 0x6: return addEvent(h, pattern, row, channel, MOD_CMD_LOOP, param & 0x0F);
+	case 0xE: return addEvent(h, pattern, row, channel, MOD_CMD_DELAY, param & 0x0F);
+	default: return sptrue;
+	}
+}
+
+/**
+ * Add an Sxy command of S3M and IT, if it affects timing.
+**/
+static spbool addSpecialEvent(struct mod_header *h, unsigned int pattern, unsigned int row, unsigned int channel, unsigned int param)
+{
+	switch (param >> 4) {
+	case 0x6: return addEvent(h, pattern, row, channel, MOD_CMD_FINE_DELAY, param & 0x0F);
+	case 0xB: return addEvent(h, pattern, row, channel, MOD_CMD_LOOP, param & 0x0F);
+	case 0xE: return addEvent(h, pattern, row, channel, MOD_CMD_DELAY, param & 0x0F);
+	default: return sptrue;
+	}
+}
+
+/**
+ * Add a Txx command of S3M and IT, which is a slide below 0x20.
+ *
+ * T00 repeats the previous slide, which we don't track.
+**/
+static spbool addTempoEvent(struct mod_header *h, unsigned int pattern, unsigned int row, unsigned int channel, unsigned int param)
+{
+	if (param >= 0x20) return addEvent(h, pattern, row, channel, MOD_CMD_TEMPO, param);
+	if (param & 0x0F) return addEvent(h, pattern, row, channel, MOD_CMD_TEMPO_SLIDE, param);
+
+	return sptrue;
+}
+
+static void beginPattern(struct mod_header *h, unsigned int pattern, unsigned int rows)
+{
+	h->patterns[pattern].rows = rows;
+	h->patterns[pattern].first_event = h->num_events;
+	h->patterns[pattern].num_events = 0;
+}
+
+static spbool allocPatterns(struct mod_header *h, unsigned int num_patterns)
+{
+	h->num_patterns = num_patterns;
+
+	if (!num_patterns) return sptrue;
+
+	h->patterns = calloc(num_patterns, sizeof(*h->patterns));
+
+	return h->patterns != NULL;
+}
+
+unsigned int get_mod_signature_channels(const unsigned char *sig)
+{
+	static const struct {
+		char sig[5];
+		unsigned int channels;
+	} SIGNATURES[] = {
+		{ "M.K.", 4 },
+		{ "M!K!", 4 },
+		{ "M&K!", 4 },
+		{ "N.T.", 4 },
+		{ "FLT4", 4 },
+		{ "FLT8", 8 },
+		{ "CD81", 8 },
+		{ "OKTA", 8 },
+		{ "OCTA", 8 },
+	};
+
+	for (size_t i = 0; i < sizeof(SIGNATURES) / sizeof(*SIGNATURES); ++i) {
+		if (!memcmp(sig, SIGNATURES[i].sig, 4))
+			return SIGNATURES[i].channels;
+	}
+
+	// xCHN
+	if (sig[0] >= '1' && sig[0] <= '9' && !memcmp(sig + 1, "CHN", 3))
+		return sig[0] - '0';
+
+	// xxCH and xxCN
+	if (sig[0] >= '1' && sig[0] <= '9' && sig[1] >= '0' && sig[1] <= '9' && sig[2] == 'C' && (sig[3] == 'H' || sig[3] == 'N'))
+		return (sig[0] - '0') * 10 + sig[1] - '0';
+
+	// TDZx
+	if (!memcmp(sig, "TDZ", 3) && sig[3] >= '1' && sig[3] <= '9')
+		return sig[3] - '0';
+
+	return 0;
+}
+
+static spbool parseMod(struct sppb_byte_input *input, struct mod_header *h, const unsigned char *buf)
+{
+	unsigned int channels = get_mod_signature_channels(buf + 1080);
+	unsigned int num_patterns = 0;
+
+	if (!channels || channels > MOD_MAX_MOD_CHANNELS || !buf[950] || buf[950] > 128)
+		return spfalse;
+
+	copyTitle(h->title, buf, 20);
+	h->format = MOD_FORMAT_MOD;
+	h->channels = channels;
+	h->speed = 6;
+	h->tempo = 125;
+	h->num_orders = buf[950];
+
+	// Like ProTracker, count all orders, not just the played ones.
+	for (unsigned int i = 0; i < 128; ++i) {
+		if (i < h->num_orders) h->orders[i] = buf[952 + i];
+		if (buf[952 + i] >= num_patterns) num_patterns = buf[952 + i] + 1;
+	}
+
+	if (!allocPatterns(h, num_patterns))
+		return spfalse;
+
+	size_t pattern_size = DEFAULT_ROWS * channels * 4;
+	unsigned char *data = malloc(pattern_size);
+
+	if (!data) return spfalse;
+
+	for (unsigned int p = 0; p < num_patterns; ++p) {
+		beginPattern(h, p, DEFAULT_ROWS);
+
+		// Missing patterns in truncated files are played as empty.
+		if (!readAt(input, MOD_PROBE_SIZE + p * pattern_size, data, pattern_size))
+			continue;
+
+		for (unsigned int row = 0; row < DEFAULT_ROWS; ++row) {
+			for (unsigned int ch = 0; ch < channels; ++ch) {
+				const unsigned char *cell = data + (row * channels + ch) * 4;
+				unsigned int param = cell[3];
+				spbool ok = sptrue;
+
+				switch (cell[2] & 0x0F) {
+				case 0x0B: ok = addEvent(h, p, row, ch, MOD_CMD_JUMP, param); break;
+				case 0x0D: ok = addEvent(h, p, row, ch, MOD_CMD_BREAK, bcd(param)); break;
+				case 0x0E: ok = addExtendedEvent(h, p, row, ch, param); break;
+				case 0x0F: ok = addEvent(h, p, row, ch, (param <= 0x20 ? MOD_CMD_SPEED : MOD_CMD_TEMPO), param); break;
+				}
+
+				if (!ok) {
+					free(data);
+					return spfalse;
+				}
+			}
+		}
+	}
+
+	free(data);
+
+	return sptrue;
+}
+
+static spbool parseS3m(struct sppb_byte_input *input, struct mod_header *h, const unsigned char *buf)
+{
+	if (memcmp(buf + 0x2C, "SCRM", 4) || buf[0x1D] != 16)
+		return spfalse;
+
+	unsigned int num_orders = le16(buf + 0x20);
+	unsigned int num_instruments = le16(buf + 0x22);
+	unsigned int num_patterns = le16(buf + 0x24);
+
+	if (num_orders > MOD_MAX_ORDERS || num_patterns > 256)
+		return spfalse;
+
+	copyTitle(h->title, buf, 28);
+	h->format = MOD_FORMAT_S3M;
+	h->speed = buf[0x31];
+	h->tempo = buf[0x32];
+
+	for (unsigned int i = 0; i < 32; ++i) {
+		if (buf[0x40 + i] < 16) ++h->channels;
+	}
+
+	size_t table_size = num_orders + 2 * num_instruments + 2 * num_patterns;
+	unsigned char *table = malloc(table_size);
+
+	if (!table) return spfalse;
+
+	if (!readAt(input, 0x60, table, table_size)) {
+		free(table);
+		return spfalse;
+	}
+
+	h->num_orders = num_orders;
+
+	for (unsigned int i = 0; i < num_orders; ++i) {
+		switch (table[i]) {
+		case 0xFE: h->orders[i] = MOD_ORDER_SKIP; break;
+		case 0xFF: h->orders[i] = MOD_ORDER_END; break;
+		default: h->orders[i] = table[i]; break;
+		}
+	}
+
+	const unsigned char *paras = table + num_orders + 2 * num_instruments;
+	unsigned char *data = NULL;
+	spbool ret = spfalse;
+
+	if (!allocPatterns(h, num_patterns))
+		goto exit;
+
+	for (unsigned int p = 0; p < num_patterns; ++p) {
+		long offset = (long) le16(paras + 2 * p) * 16;
+		unsigned char len_buf[2];
+
+		beginPattern(h, p, DEFAULT_ROWS);
+
+		if (!offset || !readAt(input, offset, len_buf, 2) || le16(len_buf) <= 2)
+			continue;
+
+		unsigned char *tmp = realloc(data, le16(len_buf) - 2);
+
+		if (!tmp) goto exit;
+
+		data = tmp;
+
+		long size = read_input_at(input, offset + 2, data, le16(len_buf) - 2);
+
+		if (size < 0) goto exit;
+
+		for (long pos = 0, row = 0; row < DEFAULT_ROWS && pos < size;) {
+			unsigned int what = data[pos++];
+
+			if (!what) {
+				++row;
+				continue;
+			}
+
+			if (what & 0x20) pos += 2;
+			if (what & 0x40) pos += 1;
+
+			if (what & 0x80) {
+				if (pos + 2 > size) break;
+
+				unsigned int command = data[pos];
+				unsigned int param = data[pos + 1];
+				unsigned int ch = what & 0x1F;
+				spbool ok = sptrue;
+
+				pos += 2;
+
+				switch (command) {
+				case 'A' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_SPEED, param); break;
+				case 'B' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_JUMP, param); break;
+				case 'C' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_BREAK, bcd(param)); break;
+				case 'S' - '@': ok = addSpecialEvent(h, p, row, ch, param); break;
+				case 'T' - '@': ok = addTempoEvent(h, p, row, ch, param); break;
+				}
+
+				if (!ok) goto exit;
+			}
+		}
+	}
+
+	ret = sptrue;
+
+exit:
+	free(data);
+	free(table);
+
+	return ret;
+}
+
+static spbool parseXm(struct sppb_byte_input *input, struct mod_header *h, const unsigned char *buf)
+{
+	if (memcmp(buf, "Extended Module: ", 17) || le16(buf + 58) < 0x0104)
+		return spfalse;
+
+	unsigned int num_orders = le16(buf + 64);
+	unsigned int channels = le16(buf + 68);
+	unsigned int num_patterns = le16(buf + 70);
+
+	if (num_orders > MOD_MAX_ORDERS || !channels || channels > 64 || num_patterns > 256)
+		return spfalse;
+
+	copyTitle(h->title, buf + 17, 20);
+	h->format = MOD_FORMAT_XM;
+	h->channels = channels;
+	h->speed = le16(buf + 76);
+	h->tempo = le16(buf + 78);
+	h->num_orders = num_orders;
+
+	for (unsigned int i = 0; i < num_orders; ++i)
+		h->orders[i] = buf[80 + i];
+
+	if (!allocPatterns(h, num_patterns))
+		return spfalse;
+
+	long offset = 60 + le32(buf + 60);
+	unsigned char *data = NULL;
+	spbool ret = spfalse;
+
+	for (unsigned int p = 0; p < num_patterns; ++p) {
+		unsigned char pattern_header[9];
+
+		if (!readAt(input, offset, pattern_header, sizeof(pattern_header)))
+			break;
+
+		unsigned long header_size = le32(pattern_header);
+		unsigned int rows = le16(pattern_header + 5);
+		size_t size = le16(pattern_header + 7);
+
+		if (!rows) rows = DEFAULT_ROWS;
+		if (rows > 256) break;
+
+		beginPattern(h, p, rows);
+
+		if (size) {
+			unsigned char *tmp = realloc(data, size);
+
+			if (!tmp) goto exit;
+
+			data = tmp;
+
+			if (!readAt(input, offset + header_size, data, size))
+				break;
+		}
+
+		offset += header_size + size;
+
+		for (size_t pos = 0, row = 0; row < rows && pos < size; ++row) {
+			for (unsigned int ch = 0; ch < channels && pos < size; ++ch) {
+				unsigned int what = data[pos++];
+				unsigned int effect = 0, param = 0;
+
+				if (what & 0x80) {
+					if (what & 0x01) ++pos;
+					if (what & 0x02) ++pos;
+					if (what & 0x04) ++pos;
+					if (what & 0x08 && pos < size) effect = data[pos++];
+					if (what & 0x10 && pos < size) param = data[pos++];
+				} else {
+					pos += 2;
+
+					if (pos + 2 > size) break;
+
+					effect = data[pos++];
+					param = data[pos++];
+				}
+
+				spbool ok = sptrue;
+
+				switch (effect) {
+				case 0x0B: ok = addEvent(h, p, row, ch, MOD_CMD_JUMP, param); break;
+				case 0x0D: ok = addEvent(h, p, row, ch, MOD_CMD_BREAK, bcd(param)); break;
+				case 0x0E: ok = addExtendedEvent(h, p, row, ch, param); break;
+				case 0x0F: ok = addEvent(h, p, row, ch, (param < 0x20 ? MOD_CMD_SPEED : MOD_CMD_TEMPO), param); break;
+				}
+
+				if (!ok) goto exit;
+			}
+		}
+	}
+
+	ret = sptrue;
+
+exit:
+	free(data);
+
+	return ret;
+}
+
+static spbool parseIt(struct sppb_byte_input *input, struct mod_header *h, const unsigned char *buf)
+{
+	if (memcmp(buf, "IMPM", 4))
+		return spfalse;
+
+	unsigned int num_orders = le16(buf + 0x20);
+	unsigned int num_instruments = le16(buf + 0x22);
+	unsigned int num_samples = le16(buf + 0x24);
+	unsigned int num_patterns = le16(buf + 0x26);
+
+	if (num_orders > MOD_MAX_ORDERS || num_patterns > 256)
+		return spfalse;
+
+	copyTitle(h->title, buf + 4, 26);
+	h->format = MOD_FORMAT_IT;
+	h->speed = buf[0x32];
+	h->tempo = buf[0x33];
+
+	size_t table_size = num_orders + 4 * (num_instruments + num_samples + num_patterns);
+	unsigned char *table = malloc(table_size);
+
+	if (!table) return spfalse;
+
+	if (!readAt(input, 0xC0, table, table_size)) {
+		free(table);
+		return spfalse;
+	}
+
+	h->num_orders = num_orders;
+
+	for (unsigned int i = 0; i < num_orders; ++i) {
+		switch (table[i]) {
+		case 0xFE: h->orders[i] = MOD_ORDER_SKIP; break;
+		case 0xFF: h->orders[i] = MOD_ORDER_END; break;
+		default: h->orders[i] = table[i]; break;
+		}
+	}
+
+	const unsigned char *offsets = table + num_orders + 4 * (num_instruments + num_samples);
+	unsigned char *data = NULL;
+	spbool ret = spfalse;
+
+	if (!allocPatterns(h, num_patterns))
+		goto exit;
+
+	for (unsigned int p = 0; p < num_patterns; ++p) {
+		long offset = le32(offsets + 4 * p);
+		unsigned char pattern_header[8];
+
+		beginPattern(h, p, DEFAULT_ROWS);
+
+		if (!offset || !readAt(input, offset, pattern_header, sizeof(pattern_header)))
+			continue;
+
+		unsigned int rows = le16(pattern_header + 2);
+
+		if (!rows || rows > 256) continue;
+
+		h->patterns[p].rows = rows;
+
+		unsigned char *tmp = realloc(data, le16(pattern_header) + 1);
+
+		if (!tmp) goto exit;
+
+		data = tmp;
+
+		long size = read_input_at(input, offset + sizeof(pattern_header), data, le16(pattern_header));
+
+		if (size < 0) goto exit;
+
+		unsigned char masks[64] = { 0 };
+		unsigned char commands[64] = { 0 };
+		unsigned char params[64] = { 0 };
+
+		for (long pos = 0, row = 0; row < rows && pos < size;) {
+			unsigned int what = data[pos++];
+
+			if (!what) {
+				++row;
+				continue;
+			}
+
+			unsigned int ch = (what - 1) & 0x3F;
+
+			if (ch >= h->channels) h->channels = ch + 1;
+
+			if (what & 0x80) {
+				if (pos >= size) break;
+
+				masks[ch] = data[pos++];
+			}
+
+			unsigned int mask = masks[ch];
+
+			if (mask & 0x01) ++pos;
+			if (mask & 0x02) ++pos;
+			if (mask & 0x04) ++pos;
+
+			if (mask & 0x08) {
+				if (pos + 2 > size) break;
+
+				commands[ch] = data[pos];
+				params[ch] = data[pos + 1];
+				pos += 2;
+			}
+
+			if (!(mask & 0x88)) continue;
+
+			unsigned int param = params[ch];
+			spbool ok = sptrue;
+
+			switch (commands[ch]) {
+			case 'A' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_SPEED, param); break;
+			case 'B' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_JUMP, param); break;
+			case 'C' - '@': ok = addEvent(h, p, row, ch, MOD_CMD_BREAK, param); break;
+			case 'S' - '@': ok = addSpecialEvent(h, p, row, ch, param); break;
+			case 'T' - '@': ok = addTempoEvent(h, p, row, ch, param); break;
+			}
+
+			if (!ok) goto exit;
+		}
+	}
+
+	ret = sptrue;
+
+exit:
+	free(data);
+	free(table);
+
+	return ret;
+}
+
+/**
+ * Return the index of the first event on the given row of a pattern.
+**/
+static unsigned int findRow(const struct mod_header *h, const struct mod_pattern *pattern, unsigned int row)
+{
+	unsigned int lo = pattern->first_event;
+	unsigned int hi = pattern->first_event + pattern->num_events;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (h->events[mid].row < row) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Return the number of samples in a tick, the way libmodplug does it.
+**/
+static unsigned int getTickSamples(unsigned int rate, unsigned int tempo)
+{
+	return (unsigned long long) rate * 5 * 128 / (tempo << 8);
+}
+
+/**
+ * Return the tempo after a tempo slide on one tick.
+**/
+static unsigned int slideTempo(unsigned int tempo, unsigned int param)
+{
+	if (param & 0xF0) return tempo + (param & 0x0F) > 255 ? 255 : tempo + (param & 0x0F);
+
+	return tempo < 0x20 + (param & 0x0F) ? 0x20 : tempo - (param & 0x0F);
+}
+
+spbool walk_mod_song(const struct mod_header *h, unsigned int rate, mod_row_callback callback, void *opaque, struct mod_length *length)
+{
+	unsigned char (*visited)[256 / 8] = calloc(MOD_MAX_ORDERS, sizeof(*visited));
+	struct mod_position pos = {
+		.speed = h->speed ? h->speed : 6,
+		.tempo = h->tempo >= 0x20 ? h->tempo : 125,
+	};
+	// Pattern loops, per channel.
+	unsigned char loop_row[MOD_MAX_CHANNELS] = { 0 };
+	unsigned char loop_count[MOD_MAX_CHANNELS] = { 0 };
+	unsigned int active_loops = 0;
+	unsigned long rows = 0;
+	spbool loops = spfalse;
+
+	if (!visited) return spfalse;
+
+	while (pos.order < h->num_orders && h->orders[pos.order] != MOD_ORDER_END) {
+		unsigned int pattern = h->orders[pos.order];
+
+		if (pattern >= h->num_patterns) {
+			++pos.order;
+			pos.row = 0;
+			continue;
+		}
+
+		// Breaking to a row beyond the end restarts the pattern.
+		if (pos.row >= h->patterns[pattern].rows)
+			pos.row = 0;
+
+		// Rows are replayed by pattern loops, so only a row visited
+		// twice outside of them means the song loops forever.
+		if (!active_loops && (visited[pos.order][pos.row / 8] & (1 << (pos.row % 8)))) {
+			loops = sptrue;
+			break;
+		}
+
+		// Pathological loops could take forever to walk.
+		if (++rows > MOD_MAX_WALK_ROWS) {
+			loops = sptrue;
+			break;
+		}
+
+		visited[pos.order][pos.row / 8] |= 1 << (pos.row % 8);
+
+		if (callback) callback(opaque, &pos);
+
+		const struct mod_pattern *pat = &h->patterns[pattern];
+		unsigned int next_order = pos.order + 1;
+		unsigned int delay = 0, fine_delay = 0, slide = 0;
+		int jump = -1, next_row = -1, loop_to = -1;
+
+		for (unsigned int i = findRow(h, pat, pos.row); i < pat->first_event + pat->num_events && h->events[i].row == pos.row; ++i) {
+			const struct mod_event *e = &h->events[i];
+
+			switch (e->command) {
+			case MOD_CMD_SPEED: if (e->param) pos.speed = e->param; break;
+			case MOD_CMD_TEMPO: pos.tempo = e->param; break;
+			case MOD_CMD_JUMP: jump = e->param; break;
+			case MOD_CMD_BREAK: next_row = e->param; break;
+			case MOD_CMD_DELAY: if (!delay) delay = e->param; break;
+			case MOD_CMD_FINE_DELAY: fine_delay += e->param; break;
+			case MOD_CMD_TEMPO_SLIDE: slide = e->param; break;
+
+			case MOD_CMD_LOOP:
+				if (e->channel >= MOD_MAX_CHANNELS) {
+					break;
+				} else if (!e->param) {
+					loop_row[e->channel] = pos.row;
+				} else if (!loop_count[e->channel]) {
+					loop_count[e->channel] = e->param;
+					++active_loops;
+					loop_to = loop_row[e->channel];
+				} else if (--loop_count[e->channel]) {
+					loop_to = loop_row[e->channel];
+				} else {
+					--active_loops;
+				}
+				break;
+			}
+		}
+
+		// The first tick of the row is played at the current tempo,
+		// and the slide applies to each of the others.
+		unsigned int ticks = pos.speed * (delay + 1) + fine_delay;
+
+		if (slide) {
+			pos.sample += getTickSamples(rate, pos.tempo);
+
+			for (unsigned int t = 1; t < ticks; ++t) {
+				pos.tempo = slideTempo(pos.tempo, slide);
+				pos.sample += getTickSamples(rate, pos.tempo);
+			}
+		} else {
+			pos.sample += ticks * getTickSamples(rate, pos.tempo);
+		}
+
+		if (loop_to >= 0) {
+			pos.row = loop_to;
+			continue;
+		}
+
+		if (jump >= 0) {
+			pos.order = jump;
+			pos.row = next_row >= 0 ? next_row : 0;
+		} else if (next_row >= 0) {
+			pos.order = next_order;
+			pos.row = next_row;
+		} else if (++pos.row >= pat->rows) {
+			pos.order = next_order;
+			pos.row = 0;
+		} else {
+			continue;
+		}
+
+		// Loops don't carry over to the next pattern.
+		memset(loop_row, 0, sizeof(loop_row));
+		memset(loop_count, 0, sizeof(loop_count));
+		active_loops = 0;
+	}
+
+	free(visited);
+
+	if (length) {
+		length->samples = pos.sample;
+		length->loops = loops;
+	}
+
+	return sptrue;
+}
+
+/**
+ * Compute the song length, in milliseconds.
+**/
+static spbool computeLength(struct mod_header *h)
+{
+	struct mod_length length;
+
+	// Walk in microseconds to keep rounding errors down.
+	if (!walk_mod_song(h, 1000000, NULL, NULL, &length))
+		return spfalse;
+
+	h->length = (length.samples + 500) / 1000;
+	h->loops = length.loops;
+
+	return sptrue;
+}
+
+struct mod_header* read_mod_header(struct sppb_byte_input *input)
+{
+	static spbool (* const PARSERS[])(struct sppb_byte_input*, struct mod_header*, const unsigned char*) = {
+		parseIt,
+		parseXm,
+		parseS3m,
+		parseMod,
+	};
+	unsigned char buf[MOD_PROBE_SIZE];
+
+	if (!input->seek) return NULL;
+
+	long n = read_input_at(input, 0, buf, sizeof(buf));
+
+	if (n < 0) return NULL;
+
+	// All formats fit within the probe size, so pad short files.
+	memset(buf + n, 0, sizeof(buf) - n);
+
+	for (size_t i = 0; i < sizeof(PARSERS) / sizeof(*PARSERS); ++i) {
+		struct mod_header *h = calloc(1, sizeof(*h));
+
+		if (!h) return NULL;
+
+		if (PARSERS[i](input, h, buf) && computeLength(h))
+			return h;
+
+		free_mod_header(h);
+	}
+
+	return NULL;
+}
+
+void free_mod_header(struct mod_header *header)
+{
+	if (!header) return;
+
+	free(header->patterns);
+	free(header->events);
+	free(header);
+}
+
+const char* get_mod_format_name(enum mod_format format)
+{
+	switch (format) {
+	case MOD_FORMAT_MOD: return "mod";
+	case MOD_FORMAT_S3M: return "s3m";
+	case MOD_FORMAT_XM: return "xm";
+	case MOD_FORMAT_IT: return "it";
+	case MOD_FORMAT_669: return "669";
+	case MOD_FORMAT_AMF: return "amf";
+	case MOD_FORMAT_AMS: return "ams";
+	case MOD_FORMAT_DBM: return "dbm";
+	case MOD_FORMAT_DMF: return "dmf";
+	case MOD_FORMAT_DSM: return "dsm";
+	case MOD_FORMAT_FAR: return "far";
+	case MOD_FORMAT_MDL: return "mdl";
+	case MOD_FORMAT_MED: return "med";
+	case MOD_FORMAT_MT2: return "mt2";
+	case MOD_FORMAT_MTM: return "mtm";
+	case MOD_FORMAT_OKT: return "okt";
+	case MOD_FORMAT_PSM: return "psm";
+	case MOD_FORMAT_PTM: return "ptm";
+	case MOD_FORMAT_STM: return "stm";
+	case MOD_FORMAT_ULT: return "ult";
+	case MOD_FORMAT_UMX: return "umx";
+	case MOD_FORMAT_WAV: return "wav";
+	default: return NULL;
+	}
+}
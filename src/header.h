@@ -0,0 +1,241 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Lightweight parsing of module headers, without libmodplug.
+ */
+#ifndef __MODPLUG_SPOTIFY_HEADER_H__
+#define __MODPLUG_SPOTIFY_HEADER_H__
+
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The maximum length of a song title, excluding the terminating zero.
+**/
+#define MOD_TITLE_MAX 32
+
+/**
+ * The maximum number of entries in an order list.
+**/
+#define MOD_MAX_ORDERS 256
+
+/**
+ * The maximum number of channels in a pattern.
+**/
+#define MOD_MAX_CHANNELS 64
+
+/**
+ * The maximum number of channels in a MOD file, as in libmodplug.
+**/
+#define MOD_MAX_MOD_CHANNELS 32
+
+/**
+ * The maximum number of rows walk_mod_song() plays before giving up.
+**/
+#define MOD_MAX_WALK_ROWS (1024 * 1024)
+
+/**
+ * Order list markers, used instead of a pattern number.
+**/
+#define MOD_ORDER_SKIP 0xFFFE
+#define MOD_ORDER_END  0xFFFF
+
+/**
+ * The number of bytes we need to see to recognize any of the formats.
+**/
+#define MOD_PROBE_SIZE 1084
+
+
+// --- Types ---
+/**
+ * Module formats.
+ *
+ * Only the first four are understood by read_mod_header(), the rest are
+ * recognized by classify_data() and loaded by libmodplug.
+**/
+enum mod_format {
+	MOD_FORMAT_UNKNOWN,
+
+	MOD_FORMAT_MOD,
+	MOD_FORMAT_S3M,
+	MOD_FORMAT_XM,
+	MOD_FORMAT_IT,
+
+	MOD_FORMAT_669,
+	MOD_FORMAT_AMF,
+	MOD_FORMAT_AMS,
+	MOD_FORMAT_DBM,
+	MOD_FORMAT_DMF,
+	MOD_FORMAT_DSM,
+	MOD_FORMAT_FAR,
+	MOD_FORMAT_MDL,
+	MOD_FORMAT_MED,
+	MOD_FORMAT_MT2,
+	MOD_FORMAT_MTM,
+	MOD_FORMAT_OKT,
+	MOD_FORMAT_PSM,
+	MOD_FORMAT_PTM,
+	MOD_FORMAT_STM,
+	MOD_FORMAT_ULT,
+	MOD_FORMAT_UMX,
+	MOD_FORMAT_WAV,
+};
+
+/**
+ * Format independent sequencer commands.
+ *
+ * Only the commands affecting song timing are kept.
+**/
+enum mod_command {
+	MOD_CMD_SPEED,
+	MOD_CMD_TEMPO,
+	MOD_CMD_JUMP,
+	MOD_CMD_BREAK,
+
+	/// Set the loop start (zero), or loop back a number of times.
+	MOD_CMD_LOOP,
+
+	/// Repeat the row a number of times.
+	MOD_CMD_DELAY,
+
+	/// Add a number of ticks to the row.
+	MOD_CMD_FINE_DELAY,
+
+	/// Slide the tempo down (0x0y) or up (0x1y) on every tick but the first.
+	MOD_CMD_TEMPO_SLIDE,
+};
+
+/**
+ * A single timing command in a pattern.
+**/
+struct mod_event {
+	unsigned short row;
+	unsigned char channel;
+	unsigned char command;
+	unsigned char param;
+};
+
+/**
+ * A pattern, as a slice of the event list in the header.
+ *
+ * The events are ordered by row.
+**/
+struct mod_pattern {
+	unsigned int rows;
+	unsigned int first_event;
+	unsigned int num_events;
+};
+
+/**
+ * What we know about a module without loading it.
+**/
+struct mod_header {
+	enum mod_format format;
+	char title[MOD_TITLE_MAX + 1];
+	unsigned int channels;
+
+	/// Initial speed (ticks per row) and tempo (BPM).
+	unsigned int speed;
+	unsigned int tempo;
+
+	unsigned int num_orders;
+	unsigned short orders[MOD_MAX_ORDERS];
+
+	unsigned int num_patterns;
+	struct mod_pattern *patterns;
+
+	unsigned int num_events;
+	struct mod_event *events;
+
+	/// The song length, in milliseconds.
+	unsigned int length;
+
+	/// Non-zero if the song loops forever, instead of ending.
+	spbool loops;
+};
+
+/**
+ * A position in the song, while walking it.
+**/
+struct mod_position {
+	unsigned int order;
+	unsigned int row;
+
+	/// The speed and tempo before processing the row.
+	unsigned int speed;
+	unsigned int tempo;
+
+	/// The number of samples played before the row.
+	uint64_t sample;
+};
+
+/**
+ * The result of walking a song.
+**/
+struct mod_length {
+	/// The song length, in samples.
+	uint64_t samples;
+
+	/// Non-zero if the song ended by looping back to a row already played.
+	spbool loops;
+};
+
+/**
+ * Called for each row visited by walk_mod_song().
+**/
+typedef void (*mod_row_callback)(void *opaque, const struct mod_position *pos);
+
+
+// --- Functions ---
+/**
+ * Parse the header and pattern data of a module.
+ *
+ * Only seek() and read() are used on the input, and no sample data
+ * is read. The input position is undefined after the call.
+ *
+ * @param input the input to read from. Must support seeking.
+ * @return NULL if the format is not understood, or on error.
+**/
+extern struct mod_header* read_mod_header(struct sppb_byte_input *input);
+
+/**
+ * Return the number of channels, as indicated by the signature
+ * of a 31-sample MOD file.
+ *
+ * @param sig the four bytes at offset 1080.
+ * @return zero if this is not a known signature.
+**/
+extern unsigned int get_mod_signature_channels(const unsigned char *sig);
+
+/**
+ * Free a header returned by read_mod_header().
+ *
+ * @param header the header to free, may be NULL.
+**/
+extern void free_mod_header(struct mod_header *header);
+
+/**
+ * Walk the song, the way the player would, without rendering it.
+ *
+ * Speed and tempo changes, tempo slides, row delays, pattern loops,
+ * jumps and breaks are followed, and samples are counted tick by tick
+ * the way libmodplug does, so the length is exact. The walk ends when
+ * the order list ends, or when a row is about to be played a second
+ * time outside of a pattern loop.
+ *
+ * @param header the song to walk.
+ * @param rate the sampling rate to count samples in.
+ * @param callback called for each row before it is played, may be NULL.
+ * @param opaque passed to the callback.
+ * @param length if not NULL, set to the song length.
+ * @return zero on error, non-zero otherwise.
+**/
+extern spbool walk_mod_song(const struct mod_header *header, unsigned int rate, mod_row_callback callback, void *opaque, struct mod_length *length);
+
+/**
+ * Return a short name for the format, like the usual file extension.
+**/
+extern const char* get_mod_format_name(enum mod_format format);
+
+#endif /* __MODPLUG_SPOTIFY_HEADER_H__ */
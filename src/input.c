@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Reading from byte inputs.
+ */
+#include <stdlib.h>
+#include "input.h"
+#include "stats.h"
+
+
+/**
+ * Return the block size to use for reads.
+**/
+static size_t getBlockSize(void)
+{
+	static size_t block_size;
+
+	if (!block_size) {
+		const char *env = getenv("MPSP_READ_BLOCK_SIZE");
+		long n = env ? atol(env) : 0;
+
+		block_size = n > 0 ? n : INPUT_DEFAULT_BLOCK_SIZE;
+	}
+
+	return block_size;
+}
+
+/**
+ * Call read() once, keeping statistics.
+**/
+static sppb_ssize readBlock(struct sppb_byte_input *input, void *buf, size_t len, struct input_stats *stats)
+{
+	uint64_t start = get_time_ns();
+	sppb_ssize n = input->read(input, buf, len);
+	uint64_t elapsed = get_time_ns() - start;
+
+	++stats->reads;
+	stats->read_time += elapsed;
+	if (elapsed > stats->max_read_time) stats->max_read_time = elapsed;
+	if (n > 0) {
+		stats->bytes += n;
+		add_stats_input(NULL, n);
+	}
+
+	return n;
+}
+
+void* read_input(struct sppb_byte_input *input, size_t *len, struct input_stats *stats)
+{
+	struct input_stats local_stats;
+	size_t block_size = getBlockSize();
+	sppb_offset expected = -1;
+
+	if (!stats) stats = &local_stats;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (input->get_length) {
+		expected = input->get_length(input);
+
+		if (expected < 0) return NULL;
+	}
+
+	if (input->seek && input->seek(input, 0, SPPB_START)) {
+		MPSP_EPRINTF("failed to seek in input\n");
+		return NULL;
+	}
+
+	size_t capacity = expected >= 0 ? (size_t) expected : INPUT_INITIAL_BUFFER_SIZE;
+	size_t n = 0;
+	unsigned char *data = malloc(capacity ? capacity : 1);
+
+	if (!data) return NULL;
+
+	for (;;) {
+		if (n == capacity) {
+			// The length is known, so don't try to read past the end.
+			if (expected >= 0) break;
+
+			unsigned char *tmp = realloc(data, 2 * capacity);
+
+			if (!tmp) goto error;
+
+			data = tmp;
+			capacity *= 2;
+		}
+
+		size_t want = capacity - n;
+
+		if (want > block_size) want = block_size;
+
+		sppb_ssize got = readBlock(input, data + n, want, stats);
+
+		if (got < 0) {
+			MPSP_EPRINTF("failed to read from input\n");
+			goto error;
+		}
+
+		if (!got) break;
+
+		n += got;
+	}
+
+	if (expected >= 0 && n != (size_t) expected) {
+		MPSP_EPRINTF("input ended after %zu of %ld bytes\n", n, (long) expected);
+		goto error;
+	}
+
+	if (n < capacity) {
+		unsigned char *tmp = realloc(data, n ? n : 1);
+
+		if (tmp) data = tmp;
+	}
+
+	MPSP_DPRINTF("read %zu bytes in %lu reads, %.0f bytes/s, max latency %.3f ms\n",
+		n, stats->reads, get_input_throughput(stats), stats->max_read_time / 1e6);
+
+	*len = n;
+
+	return data;
+
+error:
+	free(data);
+
+	return NULL;
+}
+
+static sppb_ssize readMemory(struct sppb_byte_input *input, void *buf, size_t size);
+
+long read_input_at(struct sppb_byte_input *input, long offset, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+
+	if (input->seek(input, offset, SPPB_START) != offset)
+		return -1;
+
+	while (len) {
+		sppb_ssize n = input->read(input, p, len);
+
+		if (n < 0) return -1;
+		if (!n) break;
+
+		if (input->read != readMemory) add_stats_input(NULL, n);
+
+		p += n;
+		len -= n;
+	}
+
+	return p - (unsigned char*) buf;
+}
+
+static sppb_offset getMemoryLength(struct sppb_byte_input *input)
+{
+	return ((struct memory_input*) input)->len;
+}
+
+static sppb_ssize readMemory(struct sppb_byte_input *input, void *buf, size_t size)
+{
+	struct memory_input *mem = (struct memory_input*) input;
+
+	if (size > mem->len - mem->pos) size = mem->len - mem->pos;
+
+	memcpy(buf, mem->data + mem->pos, size);
+	mem->pos += size;
+
+	return size;
+}
+
+static sppb_offset seekMemory(struct sppb_byte_input *input, sppb_offset offset, enum sppb_whence whence)
+{
+	struct memory_input *mem = (struct memory_input*) input;
+
+	switch (whence) {
+	case SPPB_START: break;
+	case SPPB_CURRENT: offset += mem->pos; break;
+	case SPPB_END: offset += mem->len; break;
+	default: return -1;
+	}
+
+	if (offset < 0 || (size_t) offset > mem->len)
+		return -1;
+
+	mem->pos = offset;
+
+	return offset;
+}
+
+struct sppb_byte_input* init_memory_input(struct memory_input *mem, const void *data, size_t len)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->input.get_length = getMemoryLength;
+	mem->input.read = readMemory;
+	mem->input.seek = seekMemory;
+	mem->data = data;
+	mem->len = len;
+
+	return &mem->input;
+}
+
+double get_input_throughput(const struct input_stats *stats)
+{
+	if (!stats->read_time) return 0;
+
+	return stats->bytes * 1e9 / stats->read_time;
+}
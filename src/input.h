@@ -0,0 +1,95 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Reading from byte inputs.
+ */
+#ifndef __MODPLUG_SPOTIFY_INPUT_H__
+#define __MODPLUG_SPOTIFY_INPUT_H__
+
+#include <stdint.h>
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The default size of a single read() call on the input.
+ *
+ * Can be overridden with the MPSP_READ_BLOCK_SIZE environment variable.
+**/
+#define INPUT_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+/**
+ * The initial buffer size for inputs of unknown length.
+**/
+#define INPUT_INITIAL_BUFFER_SIZE (256 * 1024)
+
+
+// --- Types ---
+/**
+ * Statistics of reading an input.
+**/
+struct input_stats {
+	uint64_t bytes;
+	unsigned long reads;
+
+	/// Total and maximum time spent in read(), in nanoseconds.
+	uint64_t read_time;
+	uint64_t max_read_time;
+};
+
+/**
+ * A byte input reading from memory.
+**/
+struct memory_input {
+	struct sppb_byte_input input;
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+};
+
+
+// --- Functions ---
+/**
+ * Read the entire input into a newly allocated buffer.
+ *
+ * The input is read in blocks, retrying short reads. If the input has
+ * no get_length(), the buffer grows geometrically and is shrunk to
+ * fit afterwards. If the input can seek, reading starts from the
+ * beginning, otherwise from the current position.
+ *
+ * @param input the input to read from.
+ * @param len set to the number of bytes read.
+ * @param stats if not NULL, filled in with statistics.
+ * @return NULL on error, a buffer to free() on success.
+**/
+extern void* read_input(struct sppb_byte_input *input, size_t *len, struct input_stats *stats);
+
+/**
+ * Read up to len bytes from the given offset of the input.
+ *
+ * Short reads are retried until len bytes have been read, or the
+ * end of the input is reached.
+ *
+ * @param input the input to read from. Must support seeking.
+ * @return the number of bytes read, or -1 on error.
+**/
+extern long read_input_at(struct sppb_byte_input *input, long offset, void *buf, size_t len);
+
+/**
+ * Set up a byte input reading from memory.
+ *
+ * The input has no destroy function, and the data must outlive it.
+ *
+ * @param mem the memory input to initialize.
+ * @param data the data to read.
+ * @param len the length of data, in bytes.
+ * @return the byte input of mem.
+**/
+extern struct sppb_byte_input* init_memory_input(struct memory_input *mem, const void *data, size_t len);
+
+/**
+ * Return the read throughput, in bytes per second.
+**/
+extern double get_input_throughput(const struct input_stats *stats);
+
+#endif /* __MODPLUG_SPOTIFY_INPUT_H__ */
@@ -0,0 +1,490 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Loudness analysis of songs, and normalizing gains.
+ *
+ * The integrated loudness follows ITU-R BS.1770: the signal is
+ * K-weighted by a high shelf and a high pass filter, and the mean
+ * square is taken over 400 ms blocks overlapping by 75 %. Blocks below
+ * -70 LUFS, and then blocks 10 LU below the mean of the rest, are
+ * ignored. The true peak is estimated by interpolating three points
+ * between each pair of samples.
+ *
+ * Songs are analyzed on a worker thread, in the format they are played
+ * in, so analysis and playback can take turns rendering without
+ * setting up libmodplug again in between.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loudness.h"
+#include "metacache.h"
+#include "settings.h"
+
+
+/**
+ * The number of samples rendered at a time.
+ *
+ * Playback waits for the render lock meanwhile, so this is kept short.
+**/
+#define ANALYSIS_BUFFER_SAMPLES 2048
+
+/**
+ * The most channels libmodplug mixes.
+**/
+#define ANALYSIS_MAX_CHANNELS 4
+
+/**
+ * The number of songs waiting to be analyzed.
+ *
+ * Each keeps its module in memory, so the oldest is dropped when more
+ * are queued.
+**/
+#define ANALYSIS_QUEUE_SIZE 8
+
+/**
+ * The number of hops in a gating block, and hops per second.
+**/
+#define BLOCK_HOPS 4
+#define HOPS_PER_SECOND 10
+
+/**
+ * A second order IIR filter, in transposed direct form II.
+**/
+struct biquad {
+	double b0, b1, b2;
+	double a1, a2;
+	double z1, z2;
+};
+
+/**
+ * The state of analyzing a song.
+**/
+struct analyzer {
+	unsigned int channels;
+	struct biquad shelf[ANALYSIS_MAX_CHANNELS];
+	struct biquad highpass[ANALYSIS_MAX_CHANNELS];
+
+	/// The sum of squares of each hop in the current block, over all
+	/// channels.
+	double hops[BLOCK_HOPS];
+	unsigned int num_hops;
+	unsigned int hop_fill;
+	unsigned int hop_len;
+
+	/// The mean square of each block.
+	double *blocks;
+	size_t num_blocks;
+	size_t blocks_capacity;
+
+	/// The last four samples of each channel, for interpolating the
+	/// peak.
+	double history[ANALYSIS_MAX_CHANNELS][4];
+	double peak;
+};
+
+/**
+ * A song waiting to be analyzed.
+**/
+struct analysis_request {
+	struct cached_module *module;
+	struct mod_fingerprint fp;
+};
+
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Signalled when a song is queued, or the worker is to stop.
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/// The songs to analyze, oldest first, guarded by queue_lock.
+static struct analysis_request queue[ANALYSIS_QUEUE_SIZE];
+static unsigned int queue_head;
+static unsigned int queue_len;
+
+/// The song being analyzed, to not queue it again meanwhile.
+static struct mod_fingerprint current_fp;
+static spbool analyzing;
+
+static pthread_t worker;
+static spbool worker_started;
+
+/// Set when the plugin is unloaded, read without the lock by
+/// analyze_loudness().
+static spbool stopping;
+
+
+static double filterSample(struct biquad *f, double x)
+{
+	double y = f->b0 * x + f->z1;
+
+	f->z1 = f->b1 * x - f->a1 * y + f->z2;
+	f->z2 = f->b2 * x - f->a2 * y;
+
+	return y;
+}
+
+/**
+ * Set up the K-weighting filters for a sampling rate.
+ *
+ * The filters are derived from their analog prototypes, so any rate
+ * works, not just the 48 kHz the standard gives coefficients for.
+**/
+static void initWeighting(struct analyzer *a, unsigned int rate)
+{
+	struct biquad shelf, highpass;
+	double k = tan(M_PI * 1681.974450955533 / rate);
+	double q = 0.7071752369554196;
+	double vh = pow(10.0, 3.999843853973347 / 20);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1 + k / q + k * k;
+
+	memset(&shelf, 0, sizeof(shelf));
+	shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	shelf.b1 = 2 * (k * k - vh) / a0;
+	shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	shelf.a1 = 2 * (k * k - 1) / a0;
+	shelf.a2 = (1 - k / q + k * k) / a0;
+
+	k = tan(M_PI * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1 + k / q + k * k;
+
+	memset(&highpass, 0, sizeof(highpass));
+	highpass.b0 = 1;
+	highpass.b1 = -2;
+	highpass.b2 = 1;
+	highpass.a1 = 2 * (k * k - 1) / a0;
+	highpass.a2 = (1 - k / q + k * k) / a0;
+
+	for (unsigned int c = 0; c < a->channels; ++c) {
+		a->shelf[c] = shelf;
+		a->highpass[c] = highpass;
+	}
+}
+
+/**
+ * Track the peak of the signal between the two middle samples of the
+ * history, with Catmull-Rom interpolation.
+**/
+static void updatePeak(struct analyzer *a, const double *p)
+{
+	for (unsigned int i = 0; i < 4; ++i) {
+		double t = i / 4.0;
+		double y = p[1] + 0.5 * t * (p[2] - p[0] + t * (2 * p[0] - 5 * p[1] + 4 * p[2] - p[3] + t * (3 * (p[1] - p[2]) + p[3] - p[0])));
+
+		if (fabs(y) > a->peak) a->peak = fabs(y);
+	}
+}
+
+static spbool addBlock(struct analyzer *a, double mean_square)
+{
+	if (a->num_blocks == a->blocks_capacity) {
+		size_t capacity = a->blocks_capacity ? 2 * a->blocks_capacity : 1024;
+		double *blocks = realloc(a->blocks, capacity * sizeof(*blocks));
+
+		if (!blocks) return spfalse;
+
+		a->blocks = blocks;
+		a->blocks_capacity = capacity;
+	}
+
+	a->blocks[a->num_blocks++] = mean_square;
+
+	return sptrue;
+}
+
+/**
+ * Add one sample to each channel.
+ *
+ * BS.1770 sums the power of the front channels, so they are weighted
+ * alike.
+**/
+static spbool addFrame(struct analyzer *a, const double *x)
+{
+	for (unsigned int c = 0; c < a->channels; ++c) {
+		double *history = a->history[c];
+
+		memmove(history, history + 1, 3 * sizeof(*history));
+		history[3] = x[c];
+		updatePeak(a, history);
+
+		double y = filterSample(&a->highpass[c], filterSample(&a->shelf[c], x[c]));
+
+		a->hops[a->num_hops % BLOCK_HOPS] += y * y;
+	}
+
+	if (++a->hop_fill < a->hop_len) return sptrue;
+
+	a->hop_fill = 0;
+
+	if (++a->num_hops >= BLOCK_HOPS) {
+		double sum = 0;
+
+		for (unsigned int i = 0; i < BLOCK_HOPS; ++i)
+			sum += a->hops[i];
+
+		if (!addBlock(a, sum / (BLOCK_HOPS * a->hop_len))) return spfalse;
+	}
+
+	a->hops[a->num_hops % BLOCK_HOPS] = 0;
+
+	return sptrue;
+}
+
+/**
+ * Return a rendered sample as a fraction of full scale.
+**/
+static double getSample(const void *buf, size_t i, unsigned int bits)
+{
+	switch (bits) {
+	case 8: return (((const unsigned char*) buf)[i] - 128) / 128.0;
+	case 16: return ((const int16_t*) buf)[i] / 32768.0;
+	default: return ((const int32_t*) buf)[i] / 2147483648.0;
+	}
+}
+
+static double toLoudness(double mean_square)
+{
+	return -0.691 + 10 * log10(mean_square);
+}
+
+/**
+ * Return the gated mean loudness of the blocks.
+**/
+static double getIntegrated(const struct analyzer *a)
+{
+	double threshold = pow(10, (LOUDNESS_SILENCE + 0.691) / 10);
+	double sum = 0;
+	size_t n = 0;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		sum = 0;
+		n = 0;
+
+		for (size_t i = 0; i < a->num_blocks; ++i) {
+			if (a->blocks[i] > threshold) {
+				sum += a->blocks[i];
+				++n;
+			}
+		}
+
+		if (!n) return LOUDNESS_SILENCE;
+
+		// The relative gate is 10 LU below the absolutely gated mean.
+		threshold = sum / n / 10;
+	}
+
+	return toLoudness(sum / n);
+}
+
+spbool analyze_loudness(struct cached_module *module, struct mod_loudness *loudness)
+{
+	struct render_settings settings;
+	struct analyzer a;
+	int32_t buf[ANALYSIS_BUFFER_SAMPLES];
+	double frame[ANALYSIS_MAX_CHANNELS];
+	spbool ret = spfalse;
+	uint64_t frames = 0;
+
+	// The settings of playback, without normalization or looping.
+	get_default_settings(&settings);
+	settings.loop_count = 0;
+
+	if (settings.channels > ANALYSIS_MAX_CHANNELS) return spfalse;
+
+	// A private copy, since the volume is changed. Without sharing,
+	// something plays in another format, or nothing has played yet.
+	size_t loaded;
+	ModPlugFile *file = load_mod_plug_shared(module->data, module->len, &settings, &loaded);
+
+	if (!file) file = load_mod_plug_data(module->data, module->len, &settings, &loaded);
+
+	if (!file) return spfalse;
+
+	memset(&a, 0, sizeof(a));
+	a.channels = settings.channels;
+	initWeighting(&a, settings.rate);
+	a.hop_len = settings.rate / HOPS_PER_SECOND;
+
+	ModPlug_SetMasterVolume(file, LOUDNESS_ANALYSIS_VOLUME);
+
+	size_t frame_size = get_frame_size(&settings);
+	size_t len = sizeof(buf) / frame_size * frame_size;
+
+	while (frames < (uint64_t) LOUDNESS_MAX_SECONDS * settings.rate) {
+		if (__atomic_load_n(&stopping, __ATOMIC_RELAXED)) goto exit;
+
+		begin_render(&settings);
+		int n = ModPlug_Read(file, buf, len);
+		end_render();
+
+		if (n <= 0) break;
+
+		for (size_t i = 0; i < n / frame_size; ++i) {
+			for (unsigned int c = 0; c < a.channels; ++c)
+				frame[c] = getSample(buf, i * a.channels + c, settings.bits);
+
+			if (!addFrame(&a, frame)) goto exit;
+		}
+
+		frames += n / frame_size;
+	}
+
+	// Played louder by the ratio of the volumes.
+	double gain = 20 * log10((double) LOUDNESS_DEFAULT_VOLUME / LOUDNESS_ANALYSIS_VOLUME);
+
+	loudness->integrated = getIntegrated(&a) + gain;
+	loudness->peak = a.peak > 0 ? 20 * log10(a.peak) + gain : LOUDNESS_SILENCE;
+	ret = sptrue;
+
+	MPSP_DPRINTF("loudness: %.2f LUFS, peak %.2f dBTP over %llu frames\n",
+		loudness->integrated, loudness->peak, (unsigned long long) frames);
+
+exit:
+	ModPlug_Unload(file);
+	free(a.blocks);
+
+	return ret;
+}
+
+/**
+ * Return non-zero if the song is queued or being analyzed.
+ *
+ * Must be called with queue_lock held.
+**/
+static spbool isQueued(const struct mod_fingerprint *fp)
+{
+	if (analyzing && current_fp.length == fp->length && current_fp.hash == fp->hash)
+		return sptrue;
+
+	for (unsigned int i = 0; i < queue_len; ++i) {
+		const struct mod_fingerprint *other = &queue[(queue_head + i) % ANALYSIS_QUEUE_SIZE].fp;
+
+		if (other->length == fp->length && other->hash == fp->hash) return sptrue;
+	}
+
+	return spfalse;
+}
+
+/**
+ * Analyze queued songs, and store the results in the metadata cache.
+**/
+static void* analyzeSongs(void *arg)
+{
+	pthread_mutex_lock(&queue_lock);
+
+	for (;;) {
+		while (!queue_len && !stopping)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+
+		if (stopping) break;
+
+		struct analysis_request req = queue[queue_head];
+
+		queue_head = (queue_head + 1) % ANALYSIS_QUEUE_SIZE;
+		--queue_len;
+		current_fp = req.fp;
+		analyzing = sptrue;
+		pthread_mutex_unlock(&queue_lock);
+
+		struct mod_loudness loudness;
+		struct mod_info info;
+
+		// The parser stored the rest of the metadata before queueing.
+		if (analyze_loudness(req.module, &loudness) && lookup_cached_info(&req.fp, &info)) {
+			info.analyzed = sptrue;
+			info.loudness = lround(loudness.integrated * 100);
+			info.peak = lround(loudness.peak * 100);
+			store_cached_info(&req.fp, &info);
+		}
+
+		release_module(req.module);
+
+		pthread_mutex_lock(&queue_lock);
+		analyzing = spfalse;
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+
+	return NULL;
+}
+
+void queue_loudness_analysis(struct cached_module *module, const struct mod_fingerprint *fp)
+{
+	struct cached_module *dropped = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+
+	if (stopping || isQueued(fp)) goto exit;
+
+	if (!worker_started) {
+		worker_started = !pthread_create(&worker, NULL, analyzeSongs, NULL);
+
+		if (!worker_started) {
+			MPSP_EPRINTF("failed to start the analysis thread\n");
+			goto exit;
+		}
+	}
+
+	// Songs parsed recently are the ones likely to be played.
+	if (queue_len == ANALYSIS_QUEUE_SIZE) {
+		dropped = queue[queue_head].module;
+		queue_head = (queue_head + 1) % ANALYSIS_QUEUE_SIZE;
+		--queue_len;
+	}
+
+	struct analysis_request *req = &queue[(queue_head + queue_len++) % ANALYSIS_QUEUE_SIZE];
+
+	req->module = module;
+	req->fp = *fp;
+	module = NULL;
+	pthread_cond_signal(&queue_cond);
+
+exit:
+	pthread_mutex_unlock(&queue_lock);
+
+	if (dropped) release_module(dropped);
+	if (module) release_module(module);
+}
+
+/**
+ * Stop the worker when the plugin is unloaded, since its code goes
+ * away with it.
+**/
+__attribute__((destructor))
+static void stopAnalysis(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	__atomic_store_n(&stopping, sptrue, __ATOMIC_RELAXED);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	if (worker_started) pthread_join(worker, NULL);
+
+	for (; queue_len; --queue_len) {
+		release_module(queue[queue_head].module);
+		queue_head = (queue_head + 1) % ANALYSIS_QUEUE_SIZE;
+	}
+}
+
+void get_loudness_gain(double target, const struct mod_loudness *loudness, struct loudness_gain *gain)
+{
+	double db = target - loudness->integrated;
+
+	if (db > LOUDNESS_PEAK_CEILING - loudness->peak)
+		db = LOUDNESS_PEAK_CEILING - loudness->peak;
+
+	double g = pow(10, db / 20);
+
+	if (g >= 1) {
+		gain->volume = LOUDNESS_DEFAULT_VOLUME;
+		gain->boost = (unsigned int) (g * 65536 + 0.5);
+	} else {
+		gain->volume = (unsigned int) (g * LOUDNESS_DEFAULT_VOLUME + 0.5);
+		gain->boost = 65536;
+
+		if (!gain->volume) gain->volume = 1;
+	}
+}
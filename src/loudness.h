@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Loudness analysis of songs, and normalizing gains.
+ */
+#ifndef __MODPLUG_SPOTIFY_LOUDNESS_H__
+#define __MODPLUG_SPOTIFY_LOUDNESS_H__
+
+#include "common.h"
+#include "fingerprint.h"
+#include "modcache.h"
+
+
+// --- Constants ---
+/**
+ * The master volume songs are analyzed at.
+ *
+ * A quarter of the playback volume, so loud songs don't clip.
+**/
+#define LOUDNESS_ANALYSIS_VOLUME 128
+
+/**
+ * The master volume songs are played at, without normalization.
+**/
+#define LOUDNESS_DEFAULT_VOLUME 512
+
+/**
+ * The longest part of a song analyzed, in seconds.
+**/
+#define LOUDNESS_MAX_SECONDS 3600
+
+/**
+ * The highest true peak normalization may raise a song to, in dBTP.
+**/
+#define LOUDNESS_PEAK_CEILING -1.0
+
+/**
+ * The loudness reported for songs that are all silence, in LUFS.
+**/
+#define LOUDNESS_SILENCE -70.0
+
+
+// --- Types ---
+/**
+ * The loudness of a song, as played at LOUDNESS_DEFAULT_VOLUME.
+**/
+struct mod_loudness {
+	/// The integrated loudness, in LUFS, gated as in ITU-R BS.1770.
+	double integrated;
+
+	/// An estimate of the true peak, in dBTP.
+	double peak;
+};
+
+/**
+ * The gain to play a song with, split between libmodplug and us.
+**/
+struct loudness_gain {
+	/// The master volume, 1 to LOUDNESS_DEFAULT_VOLUME.
+	unsigned int volume;
+
+	/// The gain applied to the output, in 1/65536ths. Only above unity
+	/// for songs that must be louder than the master volume allows.
+	unsigned int boost;
+};
+
+
+// --- Functions ---
+/**
+ * Measure the loudness of a song.
+ *
+ * The song is rendered with the default settings, which playback uses
+ * too, so the peak is the one of what is heard. It is loaded on its
+ * own for this, so no context reuses the copy.
+ *
+ * @param module the song to analyze.
+ * @param loudness set to the loudness of the song.
+ * @return zero on error, non-zero otherwise.
+**/
+extern spbool analyze_loudness(struct cached_module *module, struct mod_loudness *loudness);
+
+/**
+ * Measure the loudness of a song on a worker thread, and store it in
+ * the metadata cache.
+ *
+ * The metadata of the song must be in the cache already. Songs already
+ * waiting are not queued again, and the oldest waiting song is dropped
+ * if too many are.
+ *
+ * @param module the song to analyze, whose reference is taken over.
+ * @param fp the fingerprint of the song.
+**/
+extern void queue_loudness_analysis(struct cached_module *module, const struct mod_fingerprint *fp);
+
+/**
+ * Return the gain that brings a song to the target loudness.
+ *
+ * The gain is lowered if needed, to keep the true peak below
+ * LOUDNESS_PEAK_CEILING.
+ *
+ * @param target the target loudness, in LUFS.
+ * @param loudness the loudness of the song.
+ * @param gain set to the gain to play with.
+**/
+extern void get_loudness_gain(double target, const struct mod_loudness *loudness, struct loudness_gain *gain);
+
+#endif /* __MODPLUG_SPOTIFY_LOUDNESS_H__ */
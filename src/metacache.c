@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Persistent cache of song metadata.
+ *
+ * The cache is a fixed size open addressing hash table in a file that
+ * is memory mapped by every process using it. Entries are protected
+ * by sequence counters, so readers never block. Writers are serialized
+ * by a lock on the file, and evict the least recently used entry of
+ * the probe sequence when there is no free slot.
+ *
+ * If the file has the wrong version or size, a new file is created
+ * and renamed into place, so processes still using the old file are
+ * not disturbed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metacache.h"
+
+
+/**
+ * Bump this whenever the layout of the file changes.
+**/
+#define CACHE_VERSION 4
+
+#define CACHE_MAGIC "MPSPMETA"
+
+/**
+ * The number of entries in the cache. Must be a power of two.
+**/
+#define CACHE_CAPACITY 16384
+
+/**
+ * The number of slots to look in before evicting an entry.
+**/
+#define CACHE_PROBES 8
+
+/**
+ * The number of times a reader retries an entry being written.
+**/
+#define CACHE_READ_RETRIES 16
+
+#define CACHE_FILE_NAME "metadata.idx"
+
+/**
+ * Entry flags.
+**/
+#define CACHE_FLAG_LOOPS 0x01
+#define CACHE_FLAG_ANALYZED 0x02
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t capacity;
+	uint32_t clock;
+	char reserved[40];
+};
+
+struct cache_entry {
+	/// Odd while the entry is being written.
+	uint32_t seq;
+	uint32_t last_used;
+
+	uint64_t file_length;
+	uint64_t hash;
+
+	uint32_t length;
+	uint32_t samples;
+	uint32_t rate;
+	uint16_t channels;
+	uint8_t format;
+	uint8_t flags;
+	uint16_t songs;
+	/// The trailing silence, in milliseconds, zero if unknown.
+	uint16_t silence;
+	/// The loudness and true peak, in hundredths of LUFS and dBTP, if
+	/// CACHE_FLAG_ANALYZED is set.
+	int16_t loudness;
+	int16_t peak;
+	char title[MOD_TITLE_MAX + 4];
+};
+
+struct cache_file {
+	struct cache_header header;
+	struct cache_entry entries[CACHE_CAPACITY];
+};
+
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_file *cache;
+static int cache_fd = -1;
+
+
+/**
+ * Return the directory to keep the cache in, or NULL if disabled.
+ *
+ * The directory is created if needed.
+**/
+static char* getCacheDir(void)
+{
+	const char *env = getenv("MPSP_CACHE_DIR");
+	char path[PATH_MAX];
+
+	if (env) {
+		// An empty value disables the cache.
+		if (!*env) return NULL;
+
+		snprintf(path, sizeof(path), "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+		snprintf(path, sizeof(path), "%s/modplug-spotify", env);
+	} else if ((env = getenv("HOME")) && *env) {
+		snprintf(path, sizeof(path), "%s/.cache", env);
+		(void) mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/.cache/modplug-spotify", env);
+	} else {
+		return NULL;
+	}
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		MPSP_EPRINTF("failed to create cache directory %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	return strdup(path);
+}
+
+static spbool isValidCache(const struct cache_header *header)
+{
+	return !memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) &&
+		header->version == CACHE_VERSION &&
+		header->entry_size == sizeof(struct cache_entry) &&
+		header->capacity == CACHE_CAPACITY;
+}
+
+/**
+ * Create an empty cache file and atomically replace the one at path.
+**/
+static spbool createCacheFile(const char *path)
+{
+	char tmp[PATH_MAX];
+	struct cache_header header;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp))
+		return spfalse;
+
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0) return spfalse;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.entry_size = sizeof(struct cache_entry);
+	header.capacity = CACHE_CAPACITY;
+
+	if (ftruncate(fd, sizeof(struct cache_file)) ||
+		pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		rename(tmp, path)) {
+		MPSP_EPRINTF("failed to create metadata cache: %s\n", strerror(errno));
+		(void) close(fd);
+		(void) unlink(tmp);
+		return spfalse;
+	}
+
+	(void) close(fd);
+
+	return sptrue;
+}
+
+static void openCache(void)
+{
+	char *dir = getCacheDir();
+	char path[PATH_MAX];
+
+	if (!dir) return;
+
+	snprintf(path, sizeof(path), "%s/" CACHE_FILE_NAME, dir);
+	free(dir);
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		struct stat sb;
+		int fd = open(path, O_RDWR | O_CLOEXEC);
+
+		if (fd >= 0 && !fstat(fd, &sb) && sb.st_size == sizeof(struct cache_file)) {
+			struct cache_file *map = mmap(NULL, sizeof(*map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+			if (map != MAP_FAILED) {
+				if (isValidCache(&map->header)) {
+					cache = map;
+					cache_fd = fd;
+					return;
+				}
+
+				(void) munmap(map, sizeof(*map));
+			}
+		}
+
+		if (fd >= 0) (void) close(fd);
+
+		if (!createCacheFile(path)) return;
+	}
+}
+
+static struct cache_file* getCache(void)
+{
+	(void) pthread_once(&cache_once, openCache);
+
+	return cache;
+}
+
+static struct cache_entry* getSlot(struct cache_file *c, const struct mod_fingerprint *fp, unsigned int probe)
+{
+	return &c->entries[(fp->hash + probe) & (CACHE_CAPACITY - 1)];
+}
+
+static void touchEntry(struct cache_file *c, struct cache_entry *e)
+{
+	__atomic_store_n(&e->last_used, __atomic_add_fetch(&c->header.clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+spbool lookup_cached_info(const struct mod_fingerprint *fp, struct mod_info *info)
+{
+	struct cache_file *c = getCache();
+
+	if (!c) return spfalse;
+
+	for (unsigned int probe = 0; probe < CACHE_PROBES; ++probe) {
+		struct cache_entry *e = getSlot(c, fp, probe);
+		struct cache_entry copy;
+		int retries = CACHE_READ_RETRIES;
+		uint32_t seq;
+
+		do {
+			seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+			memcpy(&copy, e, sizeof(copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (((seq & 1) || seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED)) && --retries);
+
+		if (!retries) continue;
+
+		if (copy.file_length != fp->length || copy.hash != fp->hash)
+			continue;
+
+		memcpy(info->title, copy.title, MOD_TITLE_MAX);
+		info->title[MOD_TITLE_MAX] = 0;
+		info->format = copy.format;
+		info->channels = copy.channels;
+		info->length = copy.length;
+		info->samples = copy.samples;
+		info->rate = copy.rate;
+		info->loops = (copy.flags & CACHE_FLAG_LOOPS) != 0;
+		info->songs = copy.songs;
+		info->silence = copy.silence;
+		info->analyzed = (copy.flags & CACHE_FLAG_ANALYZED) != 0;
+		info->loudness = copy.loudness;
+		info->peak = copy.peak;
+
+		touchEntry(c, e);
+
+		return sptrue;
+	}
+
+	return spfalse;
+}
+
+void store_cached_info(const struct mod_fingerprint *fp, const struct mod_info *info)
+{
+	struct cache_file *c = getCache();
+
+	if (!c) return;
+
+	pthread_mutex_lock(&cache_lock);
+
+	// Serialize against other processes.
+	if (flock(cache_fd, LOCK_EX)) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	struct cache_entry *victim = NULL;
+
+	for (unsigned int probe = 0; probe < CACHE_PROBES; ++probe) {
+		struct cache_entry *e = getSlot(c, fp, probe);
+
+		if ((e->file_length == fp->length && e->hash == fp->hash) || !e->file_length) {
+			victim = e;
+			break;
+		}
+
+		if (!victim || (int32_t) (e->last_used - victim->last_used) < 0)
+			victim = e;
+	}
+
+	__atomic_store_n(&victim->seq, victim->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	victim->file_length = fp->length;
+	victim->hash = fp->hash;
+	victim->length = info->length;
+	victim->samples = info->samples;
+	victim->rate = info->rate;
+	victim->channels = info->channels;
+	victim->format = info->format;
+	victim->flags = (info->loops ? CACHE_FLAG_LOOPS : 0) | (info->analyzed ? CACHE_FLAG_ANALYZED : 0);
+	victim->songs = info->songs;
+	victim->silence = info->silence < UINT16_MAX ? info->silence : UINT16_MAX;
+	victim->loudness = info->analyzed ? info->loudness : 0;
+	victim->peak = info->analyzed ? info->peak : 0;
+	memset(victim->title, 0, sizeof(victim->title));
+	memcpy(victim->title, info->title, strnlen(info->title, MOD_TITLE_MAX));
+	touchEntry(c, victim);
+
+	__atomic_store_n(&victim->seq, victim->seq + 1, __ATOMIC_RELEASE);
+
+	(void) flock(cache_fd, LOCK_UN);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void store_cached_silence(const struct mod_fingerprint *fp, unsigned int silence)
+{
+	struct cache_file *c = getCache();
+
+	if (!c) return;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (flock(cache_fd, LOCK_EX)) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	for (unsigned int probe = 0; probe < CACHE_PROBES; ++probe) {
+		struct cache_entry *e = getSlot(c, fp, probe);
+
+		if (e->file_length != fp->length || e->hash != fp->hash)
+			continue;
+
+		__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		e->silence = silence < UINT16_MAX ? silence : UINT16_MAX;
+		__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+		break;
+	}
+
+	(void) flock(cache_fd, LOCK_UN);
+	pthread_mutex_unlock(&cache_lock);
+}
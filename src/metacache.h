@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Persistent cache of song metadata.
+ */
+#ifndef __MODPLUG_SPOTIFY_METACACHE_H__
+#define __MODPLUG_SPOTIFY_METACACHE_H__
+
+#include "common.h"
+#include "fingerprint.h"
+#include "header.h"
+
+
+// --- Types ---
+/**
+ * The metadata the parser plugin reports for a song.
+**/
+struct mod_info {
+	char title[MOD_TITLE_MAX + 1];
+	enum mod_format format;
+	unsigned int channels;
+
+	/// The song length, in milliseconds.
+	unsigned int length;
+
+	/// The exact song length, in samples at the given rate.
+	unsigned int samples;
+	unsigned int rate;
+
+	/// Non-zero if the song loops forever, instead of ending.
+	spbool loops;
+
+	/// The number of songs in the file.
+	unsigned int songs;
+
+	/// The silence at the end of the song, in milliseconds, zero if
+	/// unknown. Only known once the song has been played to the end.
+	unsigned int silence;
+
+	/// Non-zero if the loudness of the song has been measured, see
+	/// loudness.h.
+	spbool analyzed;
+
+	/// The integrated loudness and true peak, in hundredths of LUFS and
+	/// dBTP.
+	int loudness;
+	int peak;
+};
+
+
+// --- Functions ---
+/**
+ * Look up the metadata of a file in the cache.
+ *
+ * The cache file is opened on first use. It lives in $MPSP_CACHE_DIR,
+ * or in modplug-spotify/ under $XDG_CACHE_HOME or ~/.cache.
+ *
+ * @param fp the fingerprint of the song, see set_fingerprint_song().
+ * @param info the metadata to fill in.
+ * @return zero if the file is not in the cache, non-zero otherwise.
+**/
+extern spbool lookup_cached_info(const struct mod_fingerprint *fp, struct mod_info *info);
+
+/**
+ * Store the metadata of a file in the cache.
+ *
+ * If the cache is full, the least recently used entry that collides
+ * with this one is evicted. Errors are silently ignored.
+ *
+ * @param fp the fingerprint of the song, see set_fingerprint_song().
+ * @param info the metadata to store.
+**/
+extern void store_cached_info(const struct mod_fingerprint *fp, const struct mod_info *info);
+
+/**
+ * Record the trailing silence of a song already in the cache.
+ *
+ * Nothing is stored if the song isn't in the cache.
+ *
+ * @param fp the fingerprint of the song, see set_fingerprint_song().
+ * @param silence the silence at the end of the song, in milliseconds.
+**/
+extern void store_cached_silence(const struct mod_fingerprint *fp, unsigned int silence);
+
+#endif /* __MODPLUG_SPOTIFY_METACACHE_H__ */
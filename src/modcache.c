@@ -0,0 +1,615 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Process wide cache of loaded modules.
+ *
+ * The host usually creates a parser and then a playback context for the
+ * same file, and a track played recently is likely to be played again.
+ * This keeps the file contents, and one idle loaded module per file,
+ * in a reference counted LRU list. Unreferenced entries are evicted,
+ * least recently used first, when the cache grows beyond its budget.
+ *
+ * ModPlug_Load() decompresses all samples up front, which for large IT
+ * files takes long enough to delay the start of playback. Songs can be
+ * preloaded on a worker thread once the parser has seen them, leaving
+ * an idle module for the playback context to pick up. The worker runs
+ * at a lower priority, loads alongside playback when libmodplug's
+ * settings allow, and only keeps modules that don't evict anything.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "classify.h"
+#include "input.h"
+#include "modcache.h"
+#include "stats.h"
+#if MPSP_HAVE_ZIP
+#	include "zip.h"
+#endif
+
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// The LRU list, most recently used first.
+static struct cached_module *cache_head;
+static struct cached_module *cache_tail;
+
+/// The estimated memory use of the cache, in bytes.
+static size_t cache_size;
+
+/// Signalled when a module has been queued for preloading, or the
+/// worker is to stop.
+static pthread_cond_t preload_cond = PTHREAD_COND_INITIALIZER;
+
+/// Signalled when a preload has finished.
+static pthread_cond_t loaded_cond = PTHREAD_COND_INITIALIZER;
+
+/// The module to preload next, with a reference, and its settings.
+static struct cached_module *preload_next;
+static struct render_settings preload_settings;
+static pthread_t preload_thread;
+static spbool preload_started;
+static spbool preload_stopping;
+
+/// The number of modules between load_cached_module() and
+/// unload_cached_module().
+static unsigned int modules_in_use;
+
+
+static size_t getBudget(void)
+{
+	static size_t budget;
+
+	if (!budget) {
+		const char *env = getenv("MPSP_MODULE_CACHE_SIZE");
+
+		budget = env ? strtoul(env, NULL, 0) : MODULE_CACHE_DEFAULT_SIZE;
+
+		if (!budget) budget = 1;
+	}
+
+	return budget;
+}
+
+/**
+ * Return the memory used by a loaded copy of the module.
+ *
+ * This is measured by the first load. Until then, decoded samples are
+ * assumed to take about as much space as the file.
+**/
+static size_t getLoadedSize(const struct cached_module *module)
+{
+	return module->loaded_size ? module->loaded_size : module->len;
+}
+
+/**
+ * Return the estimated memory use of a module.
+**/
+static size_t getCost(const struct cached_module *module)
+{
+	return module->len + (module->idle ? getLoadedSize(module) : 0);
+}
+
+/**
+ * Read the data of a song, decompressing archives.
+ *
+ * The file is classified first, so files that aren't modules are
+ * rejected without reading them in full.
+ *
+ * @param module the module to fill in.
+ * @param input the input to read from.
+ * @param fp the fingerprint of the file, or NULL if unknown.
+ * @param song_index the song to read.
+ * @return zero on error, non-zero otherwise.
+**/
+static spbool readModule(struct cached_module *module, struct sppb_byte_input *input, const struct mod_fingerprint *fp, unsigned int song_index)
+{
+	enum mod_class cls = classify_input(input, &module->format);
+
+	switch (cls) {
+	case MOD_CLASS_REJECTED:
+		MPSP_DPRINTF("modcache: not a module\n");
+		return spfalse;
+
+	case MOD_CLASS_ARCHIVE:
+#if MPSP_HAVE_ZIP
+		if (fp) {
+			struct zip_directory *dir = acquire_zip_directory(input, fp);
+
+			if (!dir) return spfalse;
+
+			const struct zip_member *member = get_zip_song(dir, song_index);
+
+			if (member) {
+				module->data = read_zip_member(input, member);
+				module->len = member->size;
+				module->format = member->format;
+				module->songs = dir->num_songs;
+			}
+
+			release_zip_directory(dir);
+
+			return module->data != NULL;
+		}
+#endif
+		break;
+
+	default:
+		break;
+	}
+
+	// Plain modules have a single song.
+	if (song_index) return spfalse;
+
+	module->data = read_input(input, &module->len, NULL);
+	module->songs = 1;
+
+	return module->data != NULL;
+}
+
+static void freeModule(struct cached_module *module)
+{
+	if (module->idle) {
+		ModPlug_Unload(module->idle);
+		add_stats_module_memory(-(long) getLoadedSize(module));
+	}
+
+	add_stats_module_memory(-(long) module->len);
+	free(module->data);
+	free(module);
+}
+
+static void unlinkModule(struct cached_module *module)
+{
+	if (module->prev) module->prev->next = module->next;
+	else cache_head = module->next;
+
+	if (module->next) module->next->prev = module->prev;
+	else cache_tail = module->prev;
+
+	module->prev = module->next = NULL;
+}
+
+static void linkModule(struct cached_module *module)
+{
+	module->prev = NULL;
+	module->next = cache_head;
+
+	if (cache_head) cache_head->prev = module;
+	else cache_tail = module;
+
+	cache_head = module;
+}
+
+/**
+ * Evict unreferenced modules until the cache is within budget.
+ *
+ * Must be called with the lock held.
+**/
+static void evictModules(void)
+{
+	struct cached_module *module = cache_tail;
+
+	while (module && cache_size > getBudget()) {
+		struct cached_module *prev = module->prev;
+
+		if (!module->refs) {
+			MPSP_DPRINTF("modcache: evicting %p (%zu bytes)\n", module, getCost(module));
+
+			cache_size -= getCost(module);
+			unlinkModule(module);
+			freeModule(module);
+		}
+
+		module = prev;
+	}
+}
+
+/**
+ * Find a module by fingerprint, and take a reference to it.
+ *
+ * Must be called with the lock held.
+**/
+static struct cached_module* findModule(const struct mod_fingerprint *fp)
+{
+	for (struct cached_module *module = cache_head; module; module = module->next) {
+		if (module->fp.length == fp->length && module->fp.hash == fp->hash) {
+			++module->refs;
+			unlinkModule(module);
+			linkModule(module);
+
+			return module;
+		}
+	}
+
+	return NULL;
+}
+
+struct cached_module* acquire_module(struct sppb_byte_input *input, unsigned int song_index)
+{
+	struct mod_fingerprint file_fp, fp;
+	struct cached_module *module;
+	spbool have_fp = get_fingerprint(input, &file_fp);
+
+	fp = file_fp;
+	set_fingerprint_song(&fp, song_index);
+
+	if (have_fp) {
+		pthread_mutex_lock(&cache_lock);
+		module = findModule(&fp);
+		pthread_mutex_unlock(&cache_lock);
+
+		if (module) return module;
+	}
+
+	module = calloc(1, sizeof(*module));
+
+	if (!module) return NULL;
+
+	if (!readModule(module, input, have_fp ? &file_fp : NULL, song_index)) {
+		free(module);
+		return NULL;
+	}
+
+	module->refs = 1;
+	add_stats_module_memory(module->len);
+
+	if (!have_fp) return module;
+
+	pthread_mutex_lock(&cache_lock);
+
+	// Someone else may have read it while we weren't looking.
+	struct cached_module *other = findModule(&fp);
+
+	if (other) {
+		pthread_mutex_unlock(&cache_lock);
+		freeModule(module);
+
+		return other;
+	}
+
+	module->fp = fp;
+	module->cached = sptrue;
+	linkModule(module);
+	cache_size += getCost(module);
+	evictModules();
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return module;
+}
+
+void release_module(struct cached_module *module)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	--module->refs;
+
+	if (!module->cached) {
+		if (!module->refs) freeModule(module);
+	} else {
+		evictModules();
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Return non-zero if the idle module was loaded with settings
+ * compatible with these.
+ *
+ * Must be called with the lock held.
+**/
+static spbool isIdleCompatible(const struct cached_module *module, const struct render_settings *settings)
+{
+	const struct render_settings *idle = &module->idle_settings;
+
+	return module->idle &&
+		idle->rate == settings->rate &&
+		idle->bits == settings->bits &&
+		idle->channels == settings->channels &&
+		idle->loop_count == settings->loop_count;
+}
+
+/**
+ * Account for a module just loaded by libmodplug.
+**/
+static void addLoad(struct cached_module *module, size_t loaded)
+{
+	// The size is fixed by the first load, so accounting stays balanced.
+	pthread_mutex_lock(&cache_lock);
+	if (!module->loaded_size) module->loaded_size = loaded ? loaded : 1;
+	pthread_mutex_unlock(&cache_lock);
+
+	MPSP_DPRINTF("modcache: loaded %zu bytes from a %zu byte file\n", loaded, module->len);
+
+	add_stats_module_load(module->len + loaded, loaded);
+	add_stats_module_memory(getLoadedSize(module));
+}
+
+/**
+ * Load the module with libmodplug, and account for it.
+**/
+static ModPlugFile* loadModule(struct cached_module *module, const struct render_settings *settings)
+{
+	size_t loaded;
+	ModPlugFile *file = load_mod_plug_data(module->data, module->len, settings, &loaded);
+
+	if (file) addLoad(module, loaded);
+
+	return file;
+}
+
+/**
+ * Return true if an idle copy of the module fits without evicting
+ * anything. Must be called with cache_lock held.
+**/
+static spbool fitsBudget(const struct cached_module *module)
+{
+	return cache_size + getLoadedSize(module) <= getBudget();
+}
+
+/**
+ * Give back a module in use.
+**/
+static void endUse(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	--modules_in_use;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+ModPlugFile* load_cached_module(struct cached_module *module, const struct render_settings *settings)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	// Loading it here is no slower than waiting for the worker to start.
+	if (preload_next == module) {
+		preload_next = NULL;
+		--module->refs;
+	}
+
+	// Waiting is cheaper than loading a second copy.
+	while (module->preloading)
+		pthread_cond_wait(&loaded_cond, &cache_lock);
+
+	// The format and loop count are set up by loading.
+	ModPlugFile *file = isIdleCompatible(module, settings) ? module->idle : NULL;
+
+	if (file) {
+		if (module->cached) cache_size -= getLoadedSize(module);
+
+		module->idle = NULL;
+	}
+
+	++modules_in_use;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (!file) file = loadModule(module, settings);
+
+	if (!file) endUse();
+
+	return file;
+}
+
+/**
+ * Keep the file as the idle module, if there is room, or unload it.
+**/
+static void parkModule(struct cached_module *module, ModPlugFile *file, const struct render_settings *settings)
+{
+	// Cheaper than ModPlug_Seek(), which computes the song length.
+	ModPlug_SeekOrder(file, 0);
+
+	pthread_mutex_lock(&cache_lock);
+
+	ModPlugFile *stale = NULL;
+
+	// The latest format is the one likely to be asked for next.
+	if (module->idle && !isIdleCompatible(module, settings)) {
+		stale = module->idle;
+		module->idle = NULL;
+		cache_size -= getLoadedSize(module);
+	}
+
+	if (!module->idle && module->cached) {
+		module->idle = file;
+		module->idle_settings = *settings;
+		file = NULL;
+		cache_size += getLoadedSize(module);
+		evictModules();
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	if (stale) {
+		ModPlug_Unload(stale);
+		add_stats_module_memory(-(long) getLoadedSize(module));
+	}
+
+	if (file) {
+		ModPlug_Unload(file);
+		add_stats_module_memory(-(long) getLoadedSize(module));
+	}
+}
+
+void unload_cached_module(struct cached_module *module, ModPlugFile *file, const struct render_settings *settings)
+{
+	parkModule(module, file, settings);
+	endUse();
+}
+
+/**
+ * Load a module for preloading.
+ *
+ * Taking the render lock would hold up playback until the module is
+ * loaded, so that is only done while no module is in use.
+**/
+static ModPlugFile* loadInBackground(struct cached_module *module, const struct render_settings *settings)
+{
+	size_t loaded;
+	ModPlugFile *file = load_mod_plug_shared(module->data, module->len, settings, &loaded);
+
+	if (!file) {
+		pthread_mutex_lock(&cache_lock);
+		spbool in_use = modules_in_use != 0;
+		pthread_mutex_unlock(&cache_lock);
+
+		if (in_use) return NULL;
+
+		file = load_mod_plug_data(module->data, module->len, settings, &loaded);
+	}
+
+	if (file) addLoad(module, loaded);
+
+	return file;
+}
+
+/**
+ * Load queued modules, and leave them idle in the cache.
+**/
+static void* preloadModules(void *arg)
+{
+#ifdef SYS_gettid
+	// Playback is more urgent than a guess.
+	if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), MODULE_PRELOAD_NICE))
+		MPSP_DPRINTF("modcache: failed to lower the preload priority\n");
+#endif
+
+	pthread_mutex_lock(&cache_lock);
+
+	for (;;) {
+		while (!preload_next && !preload_stopping)
+			pthread_cond_wait(&preload_cond, &cache_lock);
+
+		if (preload_stopping) break;
+
+		struct cached_module *module = preload_next;
+		struct render_settings settings = preload_settings;
+
+		preload_next = NULL;
+
+		// Recently played modules are worth more than a guess.
+		if (!isIdleCompatible(module, &settings) && fitsBudget(module)) {
+			module->preloading = sptrue;
+			pthread_mutex_unlock(&cache_lock);
+
+			ModPlugFile *file = loadInBackground(module, &settings);
+
+			MPSP_DPRINTF("modcache: preloaded %p: %s\n", module, file ? "done" : "skipped");
+
+			pthread_mutex_lock(&cache_lock);
+
+			// The size is only an estimate until the first load.
+			spbool fits = fitsBudget(module);
+
+			pthread_mutex_unlock(&cache_lock);
+
+			if (file && fits) {
+				parkModule(module, file, &settings);
+			} else if (file) {
+				ModPlug_Unload(file);
+				add_stats_module_memory(-(long) getLoadedSize(module));
+			}
+
+			pthread_mutex_lock(&cache_lock);
+			module->preloading = spfalse;
+			pthread_cond_broadcast(&loaded_cond);
+		}
+
+		--module->refs;
+		evictModules();
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return NULL;
+}
+
+void preload_module(struct cached_module *module, const struct render_settings *settings)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	// Uncached modules would be unloaded again right away.
+	if (!module->cached || isIdleCompatible(module, settings) || module->preloading || preload_next == module || preload_stopping)
+		goto exit;
+
+	if (!preload_started) {
+		preload_started = !pthread_create(&preload_thread, NULL, preloadModules, NULL);
+
+		if (!preload_started) {
+			MPSP_EPRINTF("failed to start the preload thread\n");
+			goto exit;
+		}
+	}
+
+	// Only the latest song is worth loading, the host has moved on.
+	if (preload_next) --preload_next->refs;
+
+	++module->refs;
+	preload_next = module;
+	preload_settings = *settings;
+	pthread_cond_signal(&preload_cond);
+	evictModules();
+
+exit:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Stop the preload worker when the plugin is unloaded, since its code
+ * goes away with it.
+**/
+__attribute__((destructor))
+static void stopPreloading(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	preload_stopping = sptrue;
+	pthread_cond_signal(&preload_cond);
+	pthread_mutex_unlock(&cache_lock);
+
+	if (preload_started) pthread_join(preload_thread, NULL);
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (preload_next) --preload_next->refs;
+
+	preload_next = NULL;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+spbool get_module_length(struct cached_module *module, unsigned int rate, struct mod_length *length)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	spbool known = module->length_rate == rate;
+
+	length->samples = module->length_samples;
+	length->loops = module->length_loops;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (known) return length->samples != UINT_MAX;
+
+	struct memory_input mem;
+	struct mod_header *header = read_mod_header(init_memory_input(&mem, module->data, module->len));
+	spbool ok = header && walk_mod_song(header, rate, NULL, NULL, length);
+
+	free_mod_header(header);
+
+	// Failures are remembered too, as UINT_MAX samples.
+	if (!ok) {
+		length->samples = UINT_MAX;
+		length->loops = spfalse;
+	} else if (length->samples >= UINT_MAX) {
+		length->samples = UINT_MAX - 1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	module->length_rate = rate;
+	module->length_samples = length->samples;
+	module->length_loops = length->loops;
+	pthread_mutex_unlock(&cache_lock);
+
+	return ok;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Process wide cache of loaded modules.
+ */
+#ifndef __MODPLUG_SPOTIFY_MODCACHE_H__
+#define __MODPLUG_SPOTIFY_MODCACHE_H__
+
+#include "common.h"
+#include "fingerprint.h"
+#include "header.h"
+#include "settings.h"
+
+
+// --- Constants ---
+/**
+ * The default memory budget of the cache, in bytes.
+ *
+ * Can be overridden with the MPSP_MODULE_CACHE_SIZE environment variable.
+**/
+#define MODULE_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/**
+ * The nice value of the preload worker, relative to the process.
+**/
+#define MODULE_PRELOAD_NICE 10
+
+
+// --- Types ---
+/**
+ * A reference counted module in the cache.
+ *
+ * All fields are read-only for users of the cache.
+**/
+struct cached_module {
+	struct mod_fingerprint fp;
+
+	/// The raw contents of the song, shared by all loads of it.
+	void *data;
+	size_t len;
+
+	/// The format of the song, from its signature.
+	enum mod_format format;
+
+	/// The number of songs in the file.
+	unsigned int songs;
+
+	// Private to the cache.
+	unsigned int length_rate;
+	unsigned int length_samples;
+	spbool length_loops;
+	size_t loaded_size;
+	unsigned int refs;
+	spbool cached;
+	ModPlugFile *idle;
+	struct render_settings idle_settings;
+	spbool preloading;
+	struct cached_module *prev;
+	struct cached_module *next;
+};
+
+
+// --- Functions ---
+/**
+ * Return the cached module for the input, reading it if needed.
+ *
+ * Modules are keyed by fingerprint, so only inputs supporting
+ * get_length() and seek() are shared. Others are read every time.
+ *
+ * Songs of archives are decompressed on their own, and the archive
+ * directory is cached, so other songs of the same archive can be
+ * opened without reading the whole archive.
+ *
+ * @param input the input to read from.
+ * @param song_index the song in the file.
+ * @return NULL on error, or if there is no such song, a reference to
+ *         release_module() on success.
+**/
+extern struct cached_module* acquire_module(struct sppb_byte_input *input, unsigned int song_index);
+
+/**
+ * Release a reference returned by acquire_module().
+ *
+ * The module stays in the cache until it is evicted to keep the cache
+ * within its memory budget.
+**/
+extern void release_module(struct cached_module *module);
+
+/**
+ * Return a libmodplug module, rewound to the start of the song.
+ *
+ * This reuses a previously unloaded module if there is one loaded with
+ * the same format and loop count, and otherwise loads it from the
+ * cached file contents, without copying them.
+ *
+ * @param module the cached module to load.
+ * @param settings the settings to load with.
+ * @return NULL on error, a module to unload_cached_module() on success.
+**/
+extern ModPlugFile* load_cached_module(struct cached_module *module, const struct render_settings *settings);
+
+/**
+ * Give back a module returned by load_cached_module().
+ *
+ * The module is kept for the next load_cached_module() if there is room.
+ *
+ * @param module the cached module the file was loaded from.
+ * @param file the module to give back.
+ * @param settings the settings it was loaded with.
+**/
+extern void unload_cached_module(struct cached_module *module, ModPlugFile *file, const struct render_settings *settings);
+
+/**
+ * Load a module on a worker thread, for a later load_cached_module().
+ *
+ * Only the most recently queued module is kept. It is loaded alongside
+ * playback if libmodplug is set up for the settings already, see
+ * begin_shared_load(), and otherwise only while no module is in use, so
+ * loading never holds up playback. Nothing is done if the module
+ * already has a compatible idle copy, isn't cached, or if keeping it
+ * would evict other modules. Callers of load_cached_module() take over
+ * a queued module, and wait for one being loaded rather than loading
+ * it twice.
+ *
+ * @param module the cached module to load.
+ * @param settings the settings to load with.
+**/
+extern void preload_module(struct cached_module *module, const struct render_settings *settings);
+
+/**
+ * Return the exact length of the song, without loading it.
+ *
+ * The song is walked by walk_mod_song(), and the result is kept with
+ * the module for the last rate asked for.
+ *
+ * @param module the cached module.
+ * @param rate the sampling rate to count samples in.
+ * @param length set to the song length.
+ * @return zero if the format isn't understood, non-zero otherwise.
+**/
+extern spbool get_module_length(struct cached_module *module, unsigned int rate, struct mod_length *length);
+
+#endif /* __MODPLUG_SPOTIFY_MODCACHE_H__ */
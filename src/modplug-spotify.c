@@ -3,7 +3,13 @@
  *
  * Plugin main module.
  */
+#include <stdlib.h>
 #include "common.h"
+#include "loudness.h"
+#include "quality.h"
+#include "settings.h"
+#include "stats.h"
+#include "trace.h"
 
 
 // --- External data ---
@@ -82,18 +88,96 @@ static const char *KNOWN_FILE_EXTENSIONS[] = {
 };
 
 
+/**
+ * Set up the default render settings of new contexts.
+**/
 static void setupModPlug(void)
 {
-	ModPlug_Settings settings;
+	ModPlug_Settings mps;
+	struct render_settings settings;
+
+	ModPlug_GetSettings(&mps);
+
+	settings.rate = mps.mFrequency;
+	settings.channels = mps.mChannels;
+	settings.device_rate = spfalse;
+	settings.flags = MODPLUG_ENABLE_OVERSAMPLING | MODPLUG_ENABLE_NOISE_REDUCTION;
+	settings.resampling = MODPLUG_RESAMPLE_SPLINE;
+	settings.max_resampling = MODPLUG_RESAMPLE_SPLINE;
+	settings.cpu_budget = 0;
+	settings.loop_count = 0;
+
+	// MPSP_IDLE_FAST_PATH=0 renders silent spans like any other.
+	const char *idle = getenv("MPSP_IDLE_FAST_PATH");
+
+	settings.idle_fast_path = !idle || strcmp(idle, "0");
+
+	// MPSP_TRIM_SILENCE=1 cuts silence off the end of songs.
+	const char *trim = getenv("MPSP_TRIM_SILENCE");
+
+	settings.trim_silence = trim && !strcmp(trim, "1");
+
+	// MPSP_PRELOAD=1 loads songs in the background once parsed.
+	const char *preload = getenv("MPSP_PRELOAD");
+
+	settings.preload = preload && !strcmp(preload, "1");
+
+	// MPSP_ANALYZE=1 measures the loudness of parsed songs in the
+	// background, and MPSP_LOUDNESS_TARGET normalizes measured songs to
+	// it, in LUFS.
+	const char *analyze = getenv("MPSP_ANALYZE");
+	const char *target = getenv("MPSP_LOUDNESS_TARGET");
 
-	ModPlug_GetSettings(&settings);
+	settings.analyze = analyze && !strcmp(analyze, "1");
+	settings.loudness_target = target ? strtod(target, NULL) : 0;
+	settings.volume = LOUDNESS_DEFAULT_VOLUME;
+	settings.boost = 65536;
 
-	settings.mFlags = MODPLUG_ENABLE_OVERSAMPLING | MODPLUG_ENABLE_NOISE_REDUCTION;
-	settings.mBits = 16;
-	settings.mResamplingMode = MODPLUG_RESAMPLE_SPLINE;
-	settings.mLoopCount = 0;
+	if (settings.loudness_target > 0) {
+		MPSP_EPRINTF("loudness target %s is above full scale, not normalizing\n", target);
+		settings.loudness_target = 0;
+	}
 
-	ModPlug_SetSettings(&settings);
+	// MPSP_QUALITY selects a resampler, or "adaptive" to pick one
+	// within the CPU budget in MPSP_CPU_BUDGET.
+	const char *quality = getenv("MPSP_QUALITY");
+
+	if (quality && !strcmp(quality, "adaptive")) {
+		const char *budget = getenv("MPSP_CPU_BUDGET");
+
+		settings.max_resampling = MODPLUG_RESAMPLE_FIR;
+		settings.cpu_budget = budget ? strtoul(budget, NULL, 10) : QUALITY_DEFAULT_CPU_BUDGET;
+
+		if (!settings.cpu_budget) settings.cpu_budget = QUALITY_DEFAULT_CPU_BUDGET;
+	} else if (quality) {
+		if (!parse_quality_tier(quality, &settings.resampling))
+			MPSP_EPRINTF("unknown quality %s, using %s\n", quality, get_quality_tier_name(settings.resampling));
+
+		settings.max_resampling = settings.resampling;
+	}
+
+	// MPSP_OUTPUT_RATE selects the sampling rate, or "device" to
+	// render at the rate of the playback device.
+	const char *rate = getenv("MPSP_OUTPUT_RATE");
+
+	if (rate && !strcmp(rate, "device")) {
+		settings.device_rate = sptrue;
+	} else if (rate) {
+		unsigned long n = strtoul(rate, NULL, 10);
+
+		if (n >= SETTINGS_MIN_RATE && n <= SETTINGS_MAX_RATE)
+			settings.rate = n;
+		else
+			MPSP_EPRINTF("unsupported output rate %s, using %u\n", rate, settings.rate);
+	}
+
+	// MPSP_OUTPUT_FORMAT selects float or 8/16-bit integer output.
+	const char *format = getenv("MPSP_OUTPUT_FORMAT");
+
+	settings.float_output = format && !strcmp(format, "float");
+	settings.bits = settings.float_output ? 32 : (format && !strcmp(format, "8") ? 8 : 16);
+
+	set_default_settings(&settings);
 }
 
 /**
@@ -101,13 +185,14 @@ static void setupModPlug(void)
  *
  * This function is called by Spotify while initializing the plugin.
 **/
-struct sppb_plugin_description* CreateSpotifyPlaybackPlugin()
+MPSP_EXPORT struct sppb_plugin_description* CreateSpotifyPlaybackPlugin(void)
 {
 	struct sppb_plugin_description *ret = calloc(1, sizeof(*ret));
 
 	MPSP_DPRINTF("SpotifyLocalFilePlaybackPluginCreate\n");
 
 	setupModPlug();
+	setup_stats();
 
 	ret->api_version = SPPB_API_VERSION;
 	ret->plugin_name = "ModPlug";
@@ -117,5 +202,7 @@ struct sppb_plugin_description* CreateSpotifyPlaybackPlugin()
 	ret->playback = MODPLUG_PLAYBACK_PLUGIN;
 	ret->parser = MODPLUG_PARSER_PLUGIN;
 
+	setup_trace(ret);
+
 	return ret;
 }
@@ -4,40 +4,272 @@
  * Module handling metadata parsing of the MOD files through libmodplug.
  */
 #include <limits.h>
+#include <stdlib.h>
+#include "classify.h"
 #include "common.h"
+#include "header.h"
+#include "input.h"
+#include "loudness.h"
+#include "metacache.h"
+#include "modcache.h"
+#include "settings.h"
+#include "stats.h"
 
 
+/**
+ * Simple casting of the context argument present in most functions
+ * below to the correct type for us.
+**/
+#define self ((struct mod_info*) (context))
+
+/**
+ * The shortest time between parses that are taken as a hint that the
+ * song is about to be played, in milliseconds. Library scans parse
+ * songs back to back, and preloading those would only get in the way.
+**/
+#define PRELOAD_MIN_INTERVAL_MS 1000
+
+/// When the last song was parsed, from get_time_ns().
+static uint64_t last_parse;
+
+
+/**
+ * Set the length in samples from the length in milliseconds.
+**/
+static void setApproximateSamples(struct mod_info *info, unsigned int rate)
+{
+	uint64_t samples = (uint64_t) info->length * rate / 1000;
+
+	info->samples = samples < UINT_MAX ? samples : UINT_MAX;
+	info->rate = rate;
+}
+
+static void setHeaderInfo(struct mod_info *info, const struct mod_header *header)
+{
+	struct render_settings settings;
+	struct mod_length length;
+
+	strcpy(info->title, header->title);
+	info->format = header->format;
+	info->channels = header->channels;
+	info->length = header->length;
+	info->loops = header->loops;
+
+	get_default_settings(&settings);
+
+	// The sequencer is walked tick by tick, so this is sample exact.
+	if (walk_mod_song(header, settings.rate, NULL, NULL, &length) && length.samples < UINT_MAX) {
+		info->samples = length.samples;
+		info->rate = settings.rate;
+	} else {
+		setApproximateSamples(info, settings.rate);
+	}
+}
+
+/**
+ * Return non-zero if read_mod_header() may understand the format.
+**/
+static spbool isHeaderFormat(enum mod_format format)
+{
+	return format >= MOD_FORMAT_MOD && format <= MOD_FORMAT_IT;
+}
+
+/**
+ * Read the metadata from the input.
+ *
+ * Files that aren't modules are rejected by their signature. Formats
+ * we can parse ourselves are read without libmodplug, and all others
+ * are loaded in full.
+**/
+static spbool readInfo(struct sppb_byte_input *input, int song_index, struct mod_info *info)
+{
+	enum mod_format format;
+	enum mod_class cls = classify_input(input, &format);
+	struct mod_header *header = NULL;
+	struct memory_input mem;
+
+	if (cls == MOD_CLASS_REJECTED) return spfalse;
+
+	if (!song_index && isHeaderFormat(format))
+		header = read_mod_header(input);
+
+	if (header) {
+		setHeaderInfo(info, header);
+		info->songs = 1;
+		free_mod_header(header);
+
+		return sptrue;
+	}
+
+	// Go through the cache, since playback is likely to follow.
+	struct cached_module *module = acquire_module(input, song_index);
+
+	if (!module) return spfalse;
+
+	info->songs = module->songs;
+
+	// Songs in archives are only readable once decompressed.
+	if (isHeaderFormat(module->format))
+		header = read_mod_header(init_memory_input(&mem, module->data, module->len));
+
+	if (header) {
+		setHeaderInfo(info, header);
+		free_mod_header(header);
+		release_module(module);
+
+		return sptrue;
+	}
+
+	struct render_settings settings;
+
+	get_default_settings(&settings);
+
+	ModPlugFile *file = load_cached_module(module, &settings);
+	size_t title_length = MOD_TITLE_MAX;
+
+	if (!file) {
+		release_module(module);
+		return spfalse;
+	}
+
+	copy_string(ModPlug_GetName(file), info->title, &title_length);
+	info->format = module->format;
+	info->channels = ModPlug_NumChannels(file);
+	uint64_t start = get_time_ns();
+	info->length = ModPlug_GetLength(file);
+	add_stats_time(NULL, STATS_GET_LENGTH, start);
+	setApproximateSamples(info, settings.rate);
+	unload_cached_module(module, file, &settings);
+	release_module(module);
+
+	return sptrue;
+}
+
+/**
+ * Convert the length to the rate new contexts play at.
+ *
+ * The rate may follow the playback device, so it is fixed here, once
+ * per context, to keep the rate and length reported consistent. The
+ * cache keeps the length at the rate it was found for.
+**/
+static void setContextRate(struct mod_info *info)
+{
+	struct render_settings settings;
+
+	get_default_settings(&settings);
+
+	if (info->rate == settings.rate) return;
+
+	uint64_t samples = info->rate ?
+		(uint64_t) info->samples * settings.rate / info->rate :
+		(uint64_t) info->length * settings.rate / 1000;
+
+	info->samples = samples < UINT_MAX ? samples : UINT_MAX;
+	info->rate = settings.rate;
+}
+
+/**
+ * Queue the song for measuring its loudness, if enabled and not known
+ * yet. Its metadata must be in the cache.
+**/
+static void analyzeSong(struct sppb_byte_input *input, int song_index, const struct mod_fingerprint *fp, const struct mod_info *info)
+{
+	struct render_settings settings;
+
+	get_default_settings(&settings);
+
+	if (!settings.analyze || info->analyzed) return;
+
+	struct cached_module *module = acquire_module(input, song_index);
+
+	if (module) queue_loudness_analysis(module, fp);
+}
+
+/**
+ * Start loading the song for playback, if enabled.
+ *
+ * Reading the file is left to the parser thread, since the input is
+ * only valid during create().
+**/
+static void preloadSong(struct sppb_byte_input *input, int song_index)
+{
+	struct render_settings settings;
+	uint64_t now = get_time_ns();
+	uint64_t prev = __atomic_exchange_n(&last_parse, now, __ATOMIC_RELAXED);
+
+	get_default_settings(&settings);
+
+	if (!settings.preload || now - prev < PRELOAD_MIN_INTERVAL_MS * 1000000ULL) return;
+
+	struct cached_module *module = acquire_module(input, song_index);
+
+	if (!module) return;
+
+	preload_module(module, &settings);
+	release_module(module);
+}
+
 static void* create(struct sppb_plugin_description *plugin, struct sppb_byte_input *input, int song_index)
 {
 	MPSP_DPRINTF("parser: create(%p, %d)\n", input, song_index);
 
-	// We only support a single song.
-	if (song_index) return NULL;
+	if (song_index < 0) return NULL;
+
+	struct mod_info *info = calloc(1, sizeof(*info));
+	struct mod_fingerprint fp;
+
+	if (!info) return NULL;
 
-	return load_mod_plug(input);
+	spbool have_fp = get_fingerprint(input, &fp);
+
+	set_fingerprint_song(&fp, song_index);
+
+	if (have_fp && lookup_cached_info(&fp, info)) {
+		analyzeSong(input, song_index, &fp, info);
+		preloadSong(input, song_index);
+		setContextRate(info);
+
+		return info;
+	}
+
+	if (!readInfo(input, song_index, info)) {
+		free(info);
+		return NULL;
+	}
+
+	// Without a fingerprint, there is nowhere to keep the results.
+	if (have_fp) {
+		store_cached_info(&fp, info);
+		analyzeSong(input, song_index, &fp, info);
+		preloadSong(input, song_index);
+	}
+
+	setContextRate(info);
+
+	return info;
 }
 
 static void destroy(struct sppb_plugin_description *plugin, void *context)
 {
 	MPSP_DPRINTF("parser: destroy(%p)\n", context);
 
-	ModPlug_Unload(self);
+	free(self);
 }
 
 static unsigned int get_song_count(struct sppb_plugin_description *plugin, void *context)
 {
-	return 1;
+	return self->songs;
 }
 
 static enum sppb_channel_format get_channel_format(struct sppb_plugin_description *plugin, void *context)
 {
-	ModPlug_Settings settings;
+	struct render_settings settings;
 
-	ModPlug_GetSettings(&settings);
+	get_default_settings(&settings);
 
-	MPSP_DPRINTF("parser: get_channel_format(): %d\n", settings.mChannels);
+	MPSP_DPRINTF("parser: get_channel_format(): %u\n", settings.channels);
 
-	switch (settings.mChannels) {
+	switch (settings.channels) {
 	case 1: return SPPB_CHANNEL_FORMAT_MONO;
 	case 2: return SPPB_CHANNEL_FORMAT_STEREO;
 	default: return SPPB_CHANNEL_FORMAT_INVALID;
@@ -46,20 +278,28 @@ static enum sppb_channel_format get_channel_format(struct sppb_plugin_descriptio
 
 static unsigned int get_sample_rate(struct sppb_plugin_description *plugin, void *context)
 {
-	ModPlug_Settings settings;
-
-	ModPlug_GetSettings(&settings);
-
-	MPSP_DPRINTF("parser: get_sample_rate(): %d\n", settings.mFrequency);
+	MPSP_DPRINTF("parser: get_sample_rate(): %u\n", self->rate);
 
-	return settings.mFrequency;
+	return self->rate;
 }
 
 static unsigned int get_length_in_samples(struct sppb_plugin_description *plugin, void *context)
 {
-	MPSP_DPRINTF("parser: get_length_in_samples(): %u\n", (ModPlug_GetLength(self) + 500) / 1000 * getSamplingRate());
+	struct render_settings settings;
+
+	get_default_settings(&settings);
+
+	unsigned int samples = self->samples;
+
+	if (settings.trim_silence) {
+		uint64_t silence = (uint64_t) self->silence * self->rate / 1000;
+
+		samples = samples > silence ? samples - silence : 0;
+	}
+
+	MPSP_DPRINTF("parser: get_length_in_samples(): %u\n", samples);
 
-	return (ModPlug_GetLength(self) + 500) / 1000 * get_sampling_rate();
+	return samples;
 }
 
 static spbool has_field(struct sppb_plugin_description *plugin, void *context, enum sppb_field_type type)
@@ -78,7 +318,7 @@ static spbool read_field(struct sppb_plugin_description *plugin, void *context,
 
 	switch (type) {
 	case SPPB_FIELD_TYPE_TITLE:
-		return copy_string(ModPlug_GetName(self), dest, length);
+		return copy_string(self->title, dest, length);
 
 	default:
 		return spfalse;
@@ -0,0 +1,706 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Cache of rendered songs.
+ *
+ * Rendering is deterministic for given settings, so the first complete
+ * play of a song is written to $MPSP_PCM_CACHE_DIR, and later plays
+ * are read from a memory mapping instead of rendered.
+ *
+ * The audio is split in blocks of PCM_CACHE_BLOCK_FRAMES frames, each
+ * compressed on its own, so seeking only decodes a single block. With
+ * zlib, every byte has the byte one frame earlier subtracted, which
+ * makes PCM compress well, before it is deflated. Blocks that don't
+ * shrink are stored as is.
+ *
+ * The file is written under a temporary name and renamed into place
+ * once complete, so readers never see a partial file. The modification
+ * time of a file is bumped whenever it's opened, and the oldest files
+ * are removed when the directory grows too large. Finishing and
+ * evicting is done on a worker thread, since scanning the directory
+ * would stall whichever thread renders. Removing a file
+ * being played is fine, since readers keep their mapping.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if MPSP_HAVE_ZIP
+#	include <zlib.h>
+#endif
+#include "pcmcache.h"
+
+
+/**
+ * Bump this whenever the layout of the file changes.
+**/
+#define PCM_CACHE_VERSION 1
+
+#define PCM_CACHE_MAGIC "MPSPPCM\0"
+
+/**
+ * Block methods.
+**/
+#define PCM_BLOCK_STORED 0
+#define PCM_BLOCK_DELTA_DEFLATE 1
+
+struct pcm_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_size;
+	uint32_t block_frames;
+	uint32_t num_blocks;
+	uint64_t frames;
+	uint64_t file_length;
+	uint64_t file_hash;
+	uint64_t settings_hash;
+	uint64_t index_offset;
+};
+
+struct pcm_block {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t method;
+};
+
+struct pcm_cache_reader {
+	unsigned char *map;
+	size_t map_size;
+	const struct pcm_cache_header *header;
+	const struct pcm_block *index;
+
+	/// The position, in frames.
+	uint64_t pos;
+
+	/// The decoded block, if any.
+	const unsigned char *block;
+	uint32_t block_index;
+	unsigned char *buf;
+};
+
+/**
+ * A file found when evicting.
+**/
+struct pcm_cache_file {
+	char *name;
+	struct timespec mtime;
+	off_t size;
+};
+
+struct pcm_cache_writer {
+	char *path;
+	char *tmp_path;
+	FILE *file;
+	spbool failed;
+
+	struct pcm_cache_header header;
+	uint64_t max_frames;
+
+	unsigned int num_blocks;
+	struct pcm_block *index;
+
+	/// The block being filled, and room to compress it.
+	unsigned char *block;
+	size_t block_fill;
+	unsigned char *packed;
+
+	/// The next writer waiting to be finished.
+	struct pcm_cache_writer *next;
+};
+
+
+static pthread_mutex_t finish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Signalled when a writer is queued, or the worker is to stop.
+static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
+
+/// The writers to finish, guarded by finish_lock.
+static struct pcm_cache_writer *finish_queue;
+
+static pthread_t finisher;
+static spbool finisher_started;
+static spbool finisher_stopping;
+
+
+/**
+ * Return the cache directory, creating it if needed, or NULL if disabled.
+**/
+static const char* getCacheDir(void)
+{
+	static const char *dir;
+	static spbool initialized;
+
+	// Benign race: all threads come to the same conclusion.
+	if (initialized) return dir;
+
+	const char *env = getenv("MPSP_PCM_CACHE_DIR");
+
+	if (env && *env) {
+		if (mkdir(env, 0755) && errno != EEXIST)
+			MPSP_EPRINTF("failed to create PCM cache directory %s: %s\n", env, strerror(errno));
+		else
+			dir = env;
+	}
+
+	initialized = sptrue;
+
+	return dir;
+}
+
+static uint64_t getBudget(void)
+{
+	static uint64_t budget;
+
+	if (!budget) {
+		const char *env = getenv("MPSP_PCM_CACHE_SIZE");
+
+		budget = env ? strtoull(env, NULL, 0) : PCM_CACHE_DEFAULT_SIZE;
+
+		if (!budget) budget = 1;
+	}
+
+	return budget;
+}
+
+/**
+ * Hash the settings that affect the rendered audio.
+**/
+static uint64_t hashSettings(const struct render_settings *settings)
+{
+	const uint32_t fields[] = {
+		settings->rate,
+		settings->channels,
+		settings->bits,
+		settings->float_output,
+		settings->resampling,
+		settings->flags,
+		settings->loop_count,
+		settings->volume,
+		settings->boost,
+	};
+
+	return hash_bytes(0, fields, sizeof(fields));
+}
+
+static spbool getPath(char *path, size_t size, const struct mod_fingerprint *fp, const struct render_settings *settings)
+{
+	const char *dir = getCacheDir();
+
+	if (!dir) return spfalse;
+
+	return snprintf(path, size, "%s/%016llx-%016llx-%016llx.pcm", dir,
+		(unsigned long long) fp->length, (unsigned long long) fp->hash,
+		(unsigned long long) hashSettings(settings)) < (int) size;
+}
+
+static size_t getBlockSize(const struct pcm_cache_header *header)
+{
+	return (size_t) header->block_frames * header->frame_size;
+}
+
+/**
+ * Return the number of frames in a block, the last one may be short.
+**/
+static size_t getBlockFrames(const struct pcm_cache_header *header, uint32_t block)
+{
+	uint64_t left = header->frames - (uint64_t) block * header->block_frames;
+
+	return left < header->block_frames ? left : header->block_frames;
+}
+
+/**
+ * Check the file, and find the block index.
+**/
+static spbool checkFile(struct pcm_cache_reader *r, const struct mod_fingerprint *fp, const struct render_settings *settings)
+{
+	const struct pcm_cache_header *h = r->header;
+
+	if (r->map_size < sizeof(*h)) return spfalse;
+
+	if (memcmp(h->magic, PCM_CACHE_MAGIC, sizeof(h->magic)) ||
+		h->version != PCM_CACHE_VERSION ||
+		h->frame_size != get_frame_size(settings) ||
+		!h->block_frames ||
+		h->file_length != fp->length ||
+		h->file_hash != fp->hash ||
+		h->settings_hash != hashSettings(settings) ||
+		h->num_blocks != (h->frames + h->block_frames - 1) / h->block_frames ||
+		h->index_offset > r->map_size ||
+		(r->map_size - h->index_offset) / sizeof(*r->index) < h->num_blocks)
+		return spfalse;
+
+	r->index = (const struct pcm_block*) (r->map + h->index_offset);
+
+	for (uint32_t i = 0; i < h->num_blocks; ++i) {
+		const struct pcm_block *b = &r->index[i];
+
+		if (b->offset > h->index_offset || b->size > h->index_offset - b->offset)
+			return spfalse;
+
+		if (b->method == PCM_BLOCK_STORED && b->size != getBlockFrames(h, i) * h->frame_size)
+			return spfalse;
+	}
+
+	return sptrue;
+}
+
+struct pcm_cache_reader* open_pcm_cache(const struct mod_fingerprint *fp, const struct render_settings *settings)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!getPath(path, sizeof(path), fp, settings)) return NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) return NULL;
+
+	struct pcm_cache_reader *r = calloc(1, sizeof(*r));
+
+	if (!r || fstat(fd, &st) || !st.st_size) goto error;
+
+	r->map_size = st.st_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto error;
+	}
+
+	// Used recently, as far as evictFiles() is concerned.
+	(void) futimens(fd, NULL);
+	close(fd);
+	fd = -1;
+
+	r->header = (const struct pcm_cache_header*) r->map;
+	r->block_index = UINT32_MAX;
+
+	if (!checkFile(r, fp, settings)) {
+		MPSP_EPRINTF("ignoring bad PCM cache file %s\n", path);
+		goto error;
+	}
+
+	r->buf = malloc(getBlockSize(r->header));
+
+	if (!r->buf) goto error;
+
+	MPSP_DPRINTF("pcmcache: playing %s\n", path);
+
+	return r;
+
+error:
+	if (fd >= 0) close(fd);
+	close_pcm_cache(r);
+
+	return NULL;
+}
+
+void close_pcm_cache(struct pcm_cache_reader *reader)
+{
+	if (!reader) return;
+
+	if (reader->map) munmap(reader->map, reader->map_size);
+
+	free(reader->buf);
+	free(reader);
+}
+
+/**
+ * Make the given block the current one.
+**/
+static spbool loadBlock(struct pcm_cache_reader *r, uint32_t block)
+{
+	const struct pcm_block *b = &r->index[block];
+	size_t size = getBlockFrames(r->header, block) * r->header->frame_size;
+
+	if (block == r->block_index) return sptrue;
+
+	r->block = NULL;
+	r->block_index = UINT32_MAX;
+
+	switch (b->method) {
+	case PCM_BLOCK_STORED:
+		r->block = r->map + b->offset;
+		break;
+
+#if MPSP_HAVE_ZIP
+	case PCM_BLOCK_DELTA_DEFLATE: {
+		uLongf n = size;
+
+		if (uncompress(r->buf, &n, r->map + b->offset, b->size) != Z_OK || n != size)
+			return spfalse;
+
+		for (size_t i = r->header->frame_size; i < size; ++i)
+			r->buf[i] += r->buf[i - r->header->frame_size];
+
+		r->block = r->buf;
+		break;
+	}
+#endif
+
+	default:
+		return spfalse;
+	}
+
+	r->block_index = block;
+
+	return sptrue;
+}
+
+size_t read_pcm_cache(struct pcm_cache_reader *reader, void *dest, size_t len)
+{
+	const struct pcm_cache_header *h = reader->header;
+	size_t frames = len / h->frame_size;
+	size_t done = 0;
+
+	while (done < frames && reader->pos < h->frames) {
+		uint32_t block = reader->pos / h->block_frames;
+		size_t offset = reader->pos % h->block_frames;
+		size_t n = getBlockFrames(h, block) - offset;
+
+		if (!loadBlock(reader, block)) {
+			MPSP_EPRINTF("failed to decode cached block %u\n", block);
+			break;
+		}
+
+		if (n > frames - done) n = frames - done;
+
+		memcpy((char*) dest + done * h->frame_size, reader->block + offset * h->frame_size, n * h->frame_size);
+		done += n;
+		reader->pos += n;
+	}
+
+	return done * h->frame_size;
+}
+
+void seek_pcm_cache(struct pcm_cache_reader *reader, uint64_t frame)
+{
+	reader->pos = frame < reader->header->frames ? frame : reader->header->frames;
+}
+
+uint64_t get_pcm_cache_frames(const struct pcm_cache_reader *reader)
+{
+	return reader->header->frames;
+}
+
+static void freeWriter(struct pcm_cache_writer *writer)
+{
+	free(writer->path);
+	free(writer->tmp_path);
+	free(writer->index);
+	free(writer->block);
+	free(writer->packed);
+	free(writer);
+}
+
+struct pcm_cache_writer* create_pcm_cache_writer(const struct mod_fingerprint *fp, const struct render_settings *settings)
+{
+	char path[PATH_MAX];
+
+	if (settings->cpu_budget || settings->loop_count < 0) return NULL;
+
+	if (!getPath(path, sizeof(path), fp, settings)) return NULL;
+
+	struct pcm_cache_writer *w = calloc(1, sizeof(*w));
+
+	if (!w) return NULL;
+
+	size_t block_size = (size_t) PCM_CACHE_BLOCK_FRAMES * get_frame_size(settings);
+
+	w->path = strdup(path);
+	w->tmp_path = malloc(strlen(path) + 32);
+	w->block = malloc(block_size);
+#if MPSP_HAVE_ZIP
+	w->packed = malloc(compressBound(block_size));
+#endif
+
+	if (!w->path || !w->tmp_path || !w->block) goto error;
+
+#if MPSP_HAVE_ZIP
+	if (!w->packed) goto error;
+#endif
+
+	sprintf(w->tmp_path, "%s.%ld.%p.tmp", path, (long) getpid(), (void*) w);
+
+	w->file = fopen(w->tmp_path, "wbe");
+
+	if (!w->file) {
+		MPSP_EPRINTF("failed to create %s: %s\n", w->tmp_path, strerror(errno));
+		goto error;
+	}
+
+	memcpy(w->header.magic, PCM_CACHE_MAGIC, sizeof(w->header.magic));
+	w->header.version = PCM_CACHE_VERSION;
+	w->header.frame_size = get_frame_size(settings);
+	w->header.block_frames = PCM_CACHE_BLOCK_FRAMES;
+	w->header.file_length = fp->length;
+	w->header.file_hash = fp->hash;
+	w->header.settings_hash = hashSettings(settings);
+	w->max_frames = (uint64_t) settings->rate * PCM_CACHE_MAX_SECONDS;
+
+	// The header is written again when complete.
+	if (fwrite(&w->header, sizeof(w->header), 1, w->file) != 1) goto error;
+
+	return w;
+
+error:
+	abort_pcm_cache(w);
+
+	return NULL;
+}
+
+/**
+ * Compress and write the current block.
+**/
+static void flushBlock(struct pcm_cache_writer *w)
+{
+	struct pcm_block b = { .offset = ftello(w->file), .size = w->block_fill, .method = PCM_BLOCK_STORED };
+	const unsigned char *data = w->block;
+
+	if (!w->block_fill || w->failed) return;
+
+#if MPSP_HAVE_ZIP
+	size_t frame_size = w->header.frame_size;
+	uLongf n = compressBound(w->block_fill);
+
+	for (size_t i = w->block_fill; i-- > frame_size;)
+		w->block[i] -= w->block[i - frame_size];
+
+	if (compress2(w->packed, &n, w->block, w->block_fill, 1) == Z_OK && n < w->block_fill) {
+		b.size = n;
+		b.method = PCM_BLOCK_DELTA_DEFLATE;
+		data = w->packed;
+	} else {
+		for (size_t i = frame_size; i < w->block_fill; ++i)
+			w->block[i] += w->block[i - frame_size];
+	}
+#endif
+
+	struct pcm_block *index = realloc(w->index, (w->num_blocks + 1) * sizeof(*index));
+
+	if (!index || fwrite(data, 1, b.size, w->file) != b.size) {
+		if (index) w->index = index;
+		w->failed = sptrue;
+		return;
+	}
+
+	w->index = index;
+	w->index[w->num_blocks++] = b;
+	w->block_fill = 0;
+}
+
+void write_pcm_cache(struct pcm_cache_writer *writer, const void *data, size_t len)
+{
+	size_t block_size = getBlockSize(&writer->header);
+	const char *p = data;
+
+	writer->header.frames += len / writer->header.frame_size;
+
+	if (writer->header.frames > writer->max_frames) writer->failed = sptrue;
+
+	while (len && !writer->failed) {
+		size_t n = block_size - writer->block_fill;
+
+		if (n > len) n = len;
+
+		memcpy(writer->block + writer->block_fill, p, n);
+		writer->block_fill += n;
+		p += n;
+		len -= n;
+
+		if (writer->block_fill == block_size) flushBlock(writer);
+	}
+}
+
+static int compareFiles(const void *a, const void *b)
+{
+	const struct pcm_cache_file *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec) return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * Remove the least recently used files until the cache is within budget.
+ *
+ * Other processes may be evicting at the same time, so files that
+ * disappear meanwhile are not errors.
+**/
+static void evictFiles(void)
+{
+	const char *dir = getCacheDir();
+	DIR *d = dir ? opendir(dir) : NULL;
+	struct pcm_cache_file *files = NULL;
+	size_t num_files = 0, capacity = 0;
+	uint64_t total = 0;
+	struct dirent *de;
+
+	if (!d) return;
+
+	while ((de = readdir(d))) {
+		struct stat st;
+		size_t len = strlen(de->d_name);
+
+		if (len < 4 || strcmp(de->d_name + len - 4, ".pcm")) continue;
+
+		if (fstatat(dirfd(d), de->d_name, &st, 0) || !S_ISREG(st.st_mode)) continue;
+
+		if (num_files == capacity) {
+			size_t n = capacity ? 2 * capacity : 64;
+			struct pcm_cache_file *p = realloc(files, n * sizeof(*p));
+
+			if (!p) goto exit;
+
+			files = p;
+			capacity = n;
+		}
+
+		files[num_files].name = strdup(de->d_name);
+
+		if (!files[num_files].name) goto exit;
+
+		files[num_files].mtime = st.st_mtim;
+		files[num_files].size = st.st_size;
+		total += st.st_size;
+		++num_files;
+	}
+
+	qsort(files, num_files, sizeof(*files), compareFiles);
+
+	for (size_t i = 0; i < num_files && total > getBudget(); ++i) {
+		MPSP_DPRINTF("pcmcache: evicting %s\n", files[i].name);
+
+		if (!unlinkat(dirfd(d), files[i].name, 0) || errno == ENOENT)
+			total -= files[i].size;
+	}
+
+exit:
+	for (size_t i = 0; i < num_files; ++i)
+		free(files[i].name);
+
+	free(files);
+	closedir(d);
+}
+
+/**
+ * Write the index and header of a complete rendering, and move it into
+ * place. The writer is freed.
+**/
+static spbool finishWriter(struct pcm_cache_writer *writer)
+{
+	flushBlock(writer);
+
+	writer->header.num_blocks = writer->num_blocks;
+	writer->header.index_offset = ftello(writer->file);
+
+	if (writer->failed || !writer->header.frames ||
+		fwrite(writer->index, sizeof(*writer->index), writer->num_blocks, writer->file) != writer->num_blocks ||
+		fseeko(writer->file, 0, SEEK_SET) ||
+		fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1 ||
+		fclose(writer->file)) {
+		abort_pcm_cache(writer);
+		return spfalse;
+	}
+
+	writer->file = NULL;
+
+	if (rename(writer->tmp_path, writer->path)) {
+		MPSP_EPRINTF("failed to rename %s: %s\n", writer->tmp_path, strerror(errno));
+		abort_pcm_cache(writer);
+		return spfalse;
+	}
+
+	MPSP_DPRINTF("pcmcache: wrote %s\n", writer->path);
+
+	freeWriter(writer);
+
+	return sptrue;
+}
+
+static void* finishWriters(void *arg)
+{
+	pthread_mutex_lock(&finish_lock);
+
+	for (;;) {
+		while (!finish_queue && !finisher_stopping)
+			pthread_cond_wait(&finish_cond, &finish_lock);
+
+		// Complete renderings are still written when stopping.
+		if (!finish_queue) break;
+
+		struct pcm_cache_writer *writer = finish_queue;
+
+		finish_queue = NULL;
+		pthread_mutex_unlock(&finish_lock);
+
+		while (writer) {
+			struct pcm_cache_writer *next = writer->next;
+
+			finishWriter(writer);
+			writer = next;
+		}
+
+		evictFiles();
+
+		pthread_mutex_lock(&finish_lock);
+	}
+
+	pthread_mutex_unlock(&finish_lock);
+
+	return NULL;
+}
+
+void finish_pcm_cache(struct pcm_cache_writer *writer)
+{
+	pthread_mutex_lock(&finish_lock);
+
+	if (!finisher_started && !finisher_stopping) {
+		finisher_started = !pthread_create(&finisher, NULL, finishWriters, NULL);
+
+		if (!finisher_started)
+			MPSP_EPRINTF("failed to start the cache writer thread\n");
+	}
+
+	if (finisher_started && !finisher_stopping) {
+		writer->next = finish_queue;
+		finish_queue = writer;
+		writer = NULL;
+		pthread_cond_signal(&finish_cond);
+	}
+
+	pthread_mutex_unlock(&finish_lock);
+
+	// Without the worker, it's done here.
+	if (writer && finishWriter(writer)) evictFiles();
+}
+
+/**
+ * Finish the queued writers, and stop the worker when the plugin is
+ * unloaded.
+**/
+__attribute__((destructor))
+static void stopFinishing(void)
+{
+	pthread_mutex_lock(&finish_lock);
+	finisher_stopping = sptrue;
+	pthread_cond_signal(&finish_cond);
+	pthread_mutex_unlock(&finish_lock);
+
+	if (finisher_started) pthread_join(finisher, NULL);
+}
+
+void abort_pcm_cache(struct pcm_cache_writer *writer)
+{
+	if (!writer) return;
+
+	if (writer->file) fclose(writer->file);
+	if (writer->tmp_path) unlink(writer->tmp_path);
+
+	freeWriter(writer);
+}
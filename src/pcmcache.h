@@ -0,0 +1,120 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Cache of rendered songs.
+ */
+#ifndef __MODPLUG_SPOTIFY_PCMCACHE_H__
+#define __MODPLUG_SPOTIFY_PCMCACHE_H__
+
+#include "common.h"
+#include "fingerprint.h"
+#include "settings.h"
+
+
+// --- Constants ---
+/**
+ * The number of frames in each independently decodable block.
+**/
+#define PCM_CACHE_BLOCK_FRAMES 16384
+
+/**
+ * The longest song we cache, in seconds.
+**/
+#define PCM_CACHE_MAX_SECONDS 3600
+
+/**
+ * The default size limit of the cache directory, in bytes.
+ *
+ * Can be overridden with the MPSP_PCM_CACHE_SIZE environment variable.
+**/
+#define PCM_CACHE_DEFAULT_SIZE (1024LL * 1024 * 1024)
+
+
+// --- Types ---
+/**
+ * A cached rendering being played.
+**/
+struct pcm_cache_reader;
+
+/**
+ * A rendering being written to the cache.
+**/
+struct pcm_cache_writer;
+
+
+// --- Functions ---
+/**
+ * Open the cached rendering of a song.
+ *
+ * The cache is only used if $MPSP_PCM_CACHE_DIR is set. Opening a file
+ * marks it as recently used, see finish_pcm_cache().
+ *
+ * @param fp the fingerprint of the song, see set_fingerprint_song().
+ * @param settings the settings the song is played with.
+ * @return NULL if the song isn't cached, a reader on success.
+**/
+extern struct pcm_cache_reader* open_pcm_cache(const struct mod_fingerprint *fp, const struct render_settings *settings);
+
+/**
+ * Close a reader returned by open_pcm_cache().
+**/
+extern void close_pcm_cache(struct pcm_cache_reader *reader);
+
+/**
+ * Read rendered audio.
+ *
+ * @param reader the reader.
+ * @param dest the buffer to fill.
+ * @param len the size of dest, in bytes.
+ * @return the number of bytes read, zero at the end of the song.
+**/
+extern size_t read_pcm_cache(struct pcm_cache_reader *reader, void *dest, size_t len);
+
+/**
+ * Move to the given frame.
+ *
+ * Only the block containing the frame is decoded, on the next read.
+**/
+extern void seek_pcm_cache(struct pcm_cache_reader *reader, uint64_t frame);
+
+/**
+ * Return the length of the song, in frames.
+**/
+extern uint64_t get_pcm_cache_frames(const struct pcm_cache_reader *reader);
+
+/**
+ * Start writing the rendering of a song to the cache.
+ *
+ * Adaptive quality doesn't render deterministically, so it isn't
+ * cached.
+ *
+ * @param fp the fingerprint of the song, see set_fingerprint_song().
+ * @param settings the settings the song is rendered with.
+ * @return NULL if disabled or on error, a writer otherwise.
+**/
+extern struct pcm_cache_writer* create_pcm_cache_writer(const struct mod_fingerprint *fp, const struct render_settings *settings);
+
+/**
+ * Append rendered audio, which must continue from the last call.
+ *
+ * Errors are remembered, and make finish_pcm_cache() fail.
+**/
+extern void write_pcm_cache(struct pcm_cache_writer *writer, const void *data, size_t len);
+
+/**
+ * Put a complete rendering into the cache, and free the writer.
+ *
+ * The file is finished on a worker thread, and errors are only logged.
+ * If the cache grows beyond its size limit, the least recently used
+ * files are removed.
+**/
+extern void finish_pcm_cache(struct pcm_cache_writer *writer);
+
+/**
+ * Throw away an incomplete rendering, and free the writer.
+ *
+ * @param writer the writer, may be NULL.
+**/
+extern void abort_pcm_cache(struct pcm_cache_writer *writer);
+
+#endif /* __MODPLUG_SPOTIFY_PCMCACHE_H__ */
@@ -2,79 +2,607 @@
  * Copyright © 2011 Tommie Gannert
  *
  * Module handling playback of the MOD files through libmodplug.
+ *
+ * Spans where nothing plays are skipped instead of mixed. When no voice
+ * is playing, the output is silent, and the rest of the pattern is
+ * empty, the frames up to the next order are filled with silence, and
+ * libmodplug is moved there with ModPlug_SeekOrder(). The seek index
+ * tells where the next order starts, and that it is entered with the
+ * current speed and tempo, which ModPlug_SeekOrder() keeps.
  */
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include "common.h"
+#include "convert.h"
+#include "fingerprint.h"
+#include "header.h"
+#include "input.h"
+#include "loudness.h"
+#include "metacache.h"
+#include "modcache.h"
+#include "pcmcache.h"
+#include "quality.h"
+#include "renderahead.h"
+#include "seekindex.h"
+#include "settings.h"
+#include "stats.h"
+
+
+
+/**
+ * The playback context.
+**/
+struct playback_context {
+	struct render_settings settings;
+	struct cached_module *module;
+	ModPlugFile *file;
+
+	struct mod_fingerprint fp;
+	spbool have_fp;
+
+	/// Set instead of module and file when playing a cached rendering.
+	struct pcm_cache_reader *cached;
+
+	/// Writes the rendering to the cache, until the first seek. Only
+	/// renderings that reach the end of the song are kept, so a play
+	/// stopped at a trimmed end isn't cached.
+	struct pcm_cache_writer *writer;
+
+	/// Built on the first seek, NULL if the format isn't understood.
+	struct seek_index *index;
+	spbool indexed;
+
+	/// Renders on a worker thread, NULL if disabled.
+	struct render_ahead *ahead;
+
+	/// The underruns of ahead already added to the statistics.
+	unsigned long underruns;
+
+	/// Only used if settings.cpu_budget is set.
+	struct quality_control quality;
+
+	/// The position of the renderer, and the silent frames before it.
+	uint64_t position;
+	uint64_t silent_frames;
+
+	/// The silent frames left to fill in before the next order, see
+	/// startSkip().
+	uint64_t skip_frames;
+
+	/// Set until the first seek.
+	spbool continuous;
+
+	/// The position of the host, and where the song ends if its
+	/// trailing silence is trimmed, or zero.
+	uint64_t decoded;
+	uint64_t end;
+
+	struct mod_stats stats;
+};
+
+/**
+ * Simple casting of the context argument present in most functions
+ * below to the correct type for us.
+**/
+#define self ((struct playback_context*) (context))
+
+
+/**
+ * Return the number of silent frames at the end of the buffer.
+**/
+static size_t countSilentFrames(const struct render_settings *settings, const void *buf, size_t len)
+{
+	size_t frame_size = get_frame_size(settings);
+	const unsigned char *start = buf;
+	const unsigned char *end = start + len / frame_size * frame_size;
+	const unsigned char *p = end;
+
+	// 8-bit output is unsigned.
+	unsigned char silence = settings->bits == 8 ? 0x80 : 0;
+
+	while (p > start && p[-1] == silence) --p;
+
+	return (end - p) / frame_size;
+}
+
+/**
+ * Return non-zero if the rest of the current pattern is empty, from the
+ * current row on.
+**/
+static spbool isEmptyAhead(ModPlugFile *file)
+{
+	unsigned int rows, channels = ModPlug_NumChannels(file);
+	int row = ModPlug_GetCurrentRow(file);
+	const ModPlugNote *note = ModPlug_GetPattern(file, ModPlug_GetCurrentPattern(file), &rows);
+
+	if (!note || row < 0 || (unsigned int) row >= rows) return spfalse;
+
+	// Effects may change the timing, or jump, so they count too.
+	for (const ModPlugNote *end = note + rows * channels, *p = note + row * channels; p < end; ++p) {
+		if (p->Note || p->Instrument || p->VolumeEffect || p->Effect || p->Volume || p->Parameter)
+			return spfalse;
+	}
+
+	return sptrue;
+}
+
+static void buildSeekIndex(struct playback_context *ctx)
+{
+	struct memory_input mem;
+	struct mod_header *header = read_mod_header(init_memory_input(&mem, ctx->module->data, ctx->module->len));
+
+	free_seek_index(ctx->index);
+	ctx->index = NULL;
+	ctx->indexed = sptrue;
+
+	if (!header) return;
+
+	ctx->index = build_seek_index(header, ctx->settings.rate);
+	free_mod_header(header);
+}
+
+/**
+ * Start skipping to the next order, if nothing plays until then.
+ *
+ * The seek index must agree with libmodplug on the current order, and
+ * on the speed and tempo the next order starts with, so the skip ends
+ * on the sample libmodplug would have reached it.
+**/
+static void startSkip(struct playback_context *ctx)
+{
+	if (!ctx->settings.idle_fast_path || !ctx->silent_frames || ModPlug_GetPlayingChannels(ctx->file))
+		return;
+
+	if (!isEmptyAhead(ctx->file)) return;
+
+	if (!ctx->indexed || (ctx->index && ctx->index->rate != ctx->settings.rate))
+		buildSeekIndex(ctx);
+
+	if (!ctx->index) return;
+
+	const struct seek_index *index = ctx->index;
+	unsigned int i = 0;
+
+	while (i < index->num_points && index->points[i].sample <= ctx->position) ++i;
+
+	// Past the end of the song, the index no longer applies.
+	if (!i || i == index->num_points) return;
+
+	const struct seek_point *cur = &index->points[i - 1];
+	const struct seek_point *next = &index->points[i];
+
+	if (cur->order != (unsigned int) ModPlug_GetCurrentOrder(ctx->file) || next->order <= cur->order ||
+		next->speed != (unsigned int) ModPlug_GetCurrentSpeed(ctx->file) ||
+		next->tempo != (unsigned int) ModPlug_GetCurrentTempo(ctx->file))
+		return;
+
+	MPSP_DPRINTF("playback: skipping %llu frames to order %u\n", (unsigned long long) (next->sample - ctx->position), next->order);
+
+	ModPlug_SeekOrder(ctx->file, next->order);
+	ctx->skip_frames = next->sample - ctx->position;
+}
+
+/**
+ * Fill buf with silence being skipped.
+ *
+ * @return the number of bytes filled in.
+**/
+static size_t fillSkipped(struct playback_context *ctx, void *buf, size_t len)
+{
+	size_t frame_size = get_frame_size(&ctx->settings);
+	uint64_t frames = len / frame_size;
+
+	if (frames > ctx->skip_frames) frames = ctx->skip_frames;
+
+	// 8-bit output is unsigned.
+	memset(buf, ctx->settings.bits == 8 ? 0x80 : 0, frames * frame_size);
+
+	ctx->skip_frames -= frames;
+	ctx->position += frames;
+	ctx->silent_frames += frames;
+	add_stats_idle(&ctx->stats, frames);
+
+	if (ctx->writer) write_pcm_cache(ctx->writer, buf, frames * frame_size);
+
+	return frames * frame_size;
+}
+
+/**
+ * Call ModPlug_Read(), and convert to the output format.
+ *
+ * @return the number of bytes rendered, zero at the end of the song.
+**/
+static size_t readModPlug(struct playback_context *ctx, void *buf, size_t len)
+{
+	begin_render(&ctx->settings);
+	uint64_t start = get_time_ns();
+	int n = ModPlug_Read(ctx->file, buf, len);
+	uint64_t render_ns = get_time_ns() - start;
+	add_stats_time(&ctx->stats, STATS_READ, start);
+	end_render();
+
+	if (n <= 0) return 0;
+
+	size_t frame_size = get_frame_size(&ctx->settings);
+	size_t frames = n / frame_size;
+
+	if (ctx->settings.cpu_budget &&
+		update_quality_control(&ctx->quality, render_ns, frames, ctx->settings.rate)) {
+		// The new resampler is applied by the next begin_render().
+		ctx->settings.resampling = ctx->quality.tier;
+		MPSP_DPRINTF("playback: quality %s\n", get_quality_tier_name(ctx->quality.tier));
+	}
+
+	if (ctx->settings.boost != 65536)
+		apply_gain(buf, n / (ctx->settings.bits / 8), ctx->settings.bits, ctx->settings.boost);
+
+	// libmodplug rendered full scale 32-bit integers.
+	if (ctx->settings.float_output)
+		convert_s32_to_float(buf, n / sizeof(float));
+
+	size_t silent = countSilentFrames(&ctx->settings, buf, n);
+
+	ctx->silent_frames = silent == frames ? ctx->silent_frames + frames : silent;
+	ctx->position += frames;
+
+	if (ctx->writer) write_pcm_cache(ctx->writer, buf, n);
+
+	return (size_t) n;
+}
+
+/**
+ * Remember the silence at the end of the song, for trimming.
+**/
+static void storeSilence(struct playback_context *ctx)
+{
+	unsigned int ms = ctx->silent_frames * 1000 / ctx->settings.rate;
+
+	if (!ctx->have_fp || !ms) return;
+
+	MPSP_DPRINTF("playback: %u ms of trailing silence\n", ms);
+
+	store_cached_silence(&ctx->fp, ms);
+}
+
+/**
+ * Render audio into buf, in the output format.
+ *
+ * @return the number of bytes rendered, zero at the end of the song.
+**/
+static size_t renderFrames(void *opaque, void *buf, size_t len)
+{
+	struct playback_context *ctx = opaque;
+	size_t done = 0;
+
+	do {
+		size_t n = len - done;
+
+		if (!ctx->skip_frames) startSkip(ctx);
+
+		if (ctx->skip_frames) {
+			size_t got = fillSkipped(ctx, (char*) buf + done, n);
+
+			done += got;
+
+			if (!got) break;
 
+			continue;
+		}
+
+		size_t got = readModPlug(ctx, (char*) buf + done, n);
+
+		done += got;
+
+		if (got < n) break;
+	} while (done < len);
+
+	if (!done) {
+		if (ctx->writer) finish_pcm_cache(ctx->writer);
+
+		ctx->writer = NULL;
+
+		if (ctx->continuous) storeSilence(ctx);
+
+		ctx->continuous = spfalse;
+	}
+
+	return done;
+}
+
+/**
+ * Start rendering ahead, if enabled by $MPSP_RENDER_AHEAD_MS.
+**/
+static void startRenderAhead(struct playback_context *ctx)
+{
+	const char *env = getenv("MPSP_RENDER_AHEAD_MS");
+	long ms = env ? strtol(env, NULL, 10) : 0;
+
+	if (ms <= 0) return;
+
+	size_t frame_size = get_frame_size(&ctx->settings);
+
+	ctx->ahead = start_render_ahead((uint64_t) ctx->settings.rate * ms / 1000 * frame_size, frame_size, renderFrames, ctx);
+
+	if (!ctx->ahead)
+		MPSP_EPRINTF("failed to start rendering ahead, rendering on demand\n");
+}
+
+/**
+ * Return the length of the song, with any trailing silence.
+**/
+static unsigned int getSongLength(struct playback_context *ctx)
+{
+	struct mod_length length;
+	uint64_t start = get_time_ns();
+
+	if (ctx->cached) return get_pcm_cache_frames(ctx->cached);
+
+	if (get_module_length(ctx->module, ctx->settings.rate, &length)) {
+		add_stats_time(&ctx->stats, STATS_GET_LENGTH, start);
+		return length.samples;
+	}
+
+	// Formats we can't walk are measured by libmodplug, which replays the song.
+	if (ctx->ahead) pause_render_ahead(ctx->ahead);
+
+	start = get_time_ns();
+	length.samples = (uint64_t) ModPlug_GetLength(ctx->file) * ctx->settings.rate / 1000;
+	add_stats_time(&ctx->stats, STATS_GET_LENGTH, start);
+
+	if (ctx->ahead) resume_render_ahead(ctx->ahead, spfalse);
+
+	return length.samples;
+}
+
+/**
+ * Find where the song ends without its trailing silence, if trimming.
+ *
+ * The silence is only known once the song has been played to the end.
+**/
+static void setTrimmedEnd(struct playback_context *ctx)
+{
+	struct mod_info info;
+
+	if (!ctx->settings.trim_silence || !ctx->have_fp) return;
+
+	if (!lookup_cached_info(&ctx->fp, &info) || !info.silence) return;
+
+	uint64_t length = getSongLength(ctx);
+	uint64_t silence = (uint64_t) info.silence * ctx->settings.rate / 1000;
+
+	if (length > silence) ctx->end = length - silence;
+}
+
+/**
+ * Set the gain that normalizes the song, if its loudness is known.
+**/
+static void setGain(struct playback_context *ctx)
+{
+	struct mod_info info;
+	struct mod_loudness loudness;
+	struct loudness_gain gain;
+
+	if (!ctx->settings.loudness_target || !ctx->have_fp) return;
+
+	if (!lookup_cached_info(&ctx->fp, &info) || !info.analyzed) return;
+
+	loudness.integrated = info.loudness / 100.0;
+	loudness.peak = info.peak / 100.0;
+	get_loudness_gain(ctx->settings.loudness_target, &loudness, &gain);
+	ctx->settings.volume = gain.volume;
+	ctx->settings.boost = gain.boost;
+
+	MPSP_DPRINTF("playback: volume %u, boost %.2f\n", gain.volume, gain.boost / 65536.0);
+}
 
 static void* create(struct sppb_plugin_description *plugin, struct sppb_byte_input *input, int song_index)
 {
-	MPSP_DPRINTF("playback: create(%s, %d)\n", path, song_index);
+	MPSP_DPRINTF("playback: create(%p, %d)\n", input, song_index);
+
+	if (song_index < 0) return NULL;
 
-	// We only support a single song.
-	if (song_index) return NULL;
+	struct playback_context *ctx = calloc(1, sizeof(*ctx));
 
-	return load_mod_plug(input);
+	if (!ctx) return NULL;
+
+	get_default_settings(&ctx->settings);
+	ctx->continuous = sptrue;
+	ctx->have_fp = get_fingerprint(input, &ctx->fp);
+	set_fingerprint_song(&ctx->fp, song_index);
+	setGain(ctx);
+
+	// A cached rendering needs neither the file nor libmodplug.
+	if (ctx->have_fp && (ctx->cached = open_pcm_cache(&ctx->fp, &ctx->settings))) {
+		setTrimmedEnd(ctx);
+		register_stats(&ctx->stats, "playback");
+		return ctx;
+	}
+
+	if (ctx->settings.cpu_budget)
+		init_quality_control(&ctx->quality, ctx->settings.resampling, ctx->settings.max_resampling, ctx->settings.cpu_budget);
+
+	ctx->module = acquire_module(input, song_index);
+
+	if (!ctx->module) goto error;
+
+	ctx->file = load_cached_module(ctx->module, &ctx->settings);
+
+	if (!ctx->file) goto error;
+
+	// Files are reused between contexts, so the volume is always set.
+	ModPlug_SetMasterVolume(ctx->file, ctx->settings.volume);
+
+	if (ctx->have_fp) ctx->writer = create_pcm_cache_writer(&ctx->fp, &ctx->settings);
+
+	setTrimmedEnd(ctx);
+	register_stats(&ctx->stats, "playback");
+	startRenderAhead(ctx);
+
+	return ctx;
+
+error:
+	if (ctx->module) release_module(ctx->module);
+	free(ctx);
+
+	return NULL;
 }
 
 static void destroy(struct sppb_plugin_description *plugin, void *context)
 {
 	MPSP_DPRINTF("playback: destroy(%p)\n", context);
 
-	ModPlug_Unload(self);
+	if (self->ahead) stop_render_ahead(self->ahead);
+	unregister_stats(&self->stats);
+	abort_pcm_cache(self->writer);
+	close_pcm_cache(self->cached);
+
+	if (self->module) {
+		unload_cached_module(self->module, self->file, &self->settings);
+		release_module(self->module);
+	}
+
+	free_seek_index(self->index);
+	free(self);
 }
 
 static spbool decode(struct sppb_plugin_description *plugin, void *context, spbyte *dest, size_t *destlen, spbool *final)
 {
-	int n = ModPlug_Read(self, dest, *destlen);
+	size_t n;
 
-	MPSP_DPRINTF("playback: decode(%p, %zu): %d\n", dest, *destlen, n);
+	if (self->cached) {
+		n = read_pcm_cache(self->cached, dest, *destlen);
+		if (!n) *final = sptrue;
+	} else if (self->ahead) {
+		struct render_ahead_stats ahead;
 
-	*destlen = (size_t) n;
-	if (!n) *final = sptrue;
+		n = read_render_ahead(self->ahead, dest, *destlen, final);
+		get_render_ahead_stats(self->ahead, &ahead);
+		add_stats_render_ahead(&self->stats, ahead.level, ahead.underruns - self->underruns);
+		self->underruns = ahead.underruns;
+	} else {
+		n = renderFrames(self, dest, *destlen);
+		if (!n) *final = sptrue;
+	}
+
+	size_t frame_size = get_frame_size(&self->settings);
+
+	if (self->end) {
+		uint64_t left = self->end > self->decoded ? (self->end - self->decoded) * frame_size : 0;
+
+		if (n >= left) {
+			n = left;
+			*final = sptrue;
+		}
+	}
+
+	self->decoded += n / frame_size;
+
+	add_stats_decode(&self->stats, *destlen, n);
+
+	MPSP_DPRINTF("playback: decode(%p, %zu): %zu\n", dest, *destlen, n);
+
+	*destlen = n;
 
 	return sptrue;
 }
 
+/**
+ * Render and throw away the given number of samples.
+**/
+static void skipSamples(struct playback_context *ctx, uint64_t samples)
+{
+	char buf[4096];
+	size_t frame_size = get_frame_size(&ctx->settings);
+
+	while (samples) {
+		size_t n = sizeof(buf) / frame_size;
+
+		if (n > samples) n = samples;
+
+		begin_render(&ctx->settings);
+		int got = ModPlug_Read(ctx->file, buf, n * frame_size);
+		end_render();
+
+		if (got <= 0) break;
+
+		samples -= got / frame_size;
+	}
+}
+
 static spbool seek(struct sppb_plugin_description *plugin, void *context, unsigned int sample)
 {
 	MPSP_DPRINTF("playback: seek(%u)\n", sample);
 
-	ModPlug_Seek(self, (sample / get_sampling_rate()) * 1000);
+	uint64_t start = get_time_ns();
+
+	self->decoded = sample;
+
+	if (self->cached) {
+		seek_pcm_cache(self->cached, sample);
+		add_stats_time(&self->stats, STATS_SEEK, start);
+
+		return sptrue;
+	}
+
+	if (self->ahead) pause_render_ahead(self->ahead);
+
+	// The rendering is no longer continuous.
+	abort_pcm_cache(self->writer);
+	self->writer = NULL;
+	self->continuous = spfalse;
+	self->position = sample;
+	self->silent_frames = 0;
+	self->skip_frames = 0;
+
+	if (!self->indexed || (self->index && self->index->rate != self->settings.rate))
+		buildSeekIndex(self);
+
+	if (self->index) {
+		struct seek_setup setup;
+		const struct seek_point *p = find_seek_point(self->index, sample,
+			ModPlug_GetCurrentSpeed(self->file), ModPlug_GetCurrentTempo(self->file), &setup);
+
+		// Seeking keeps the speed and tempo, so they are set up first.
+		if (setup.order >= 0) {
+			ModPlug_SeekOrder(self->file, setup.order);
+			if (setup.play) skipSamples(self, 1);
+		}
+
+		ModPlug_SeekOrder(self->file, p->order);
+		skipSamples(self, sample - p->sample);
+	} else {
+		ModPlug_Seek(self->file, (uint64_t) sample * 1000 / self->settings.rate);
+	}
+
+	if (self->ahead) resume_render_ahead(self->ahead, sptrue);
+
+	// Includes building the index, which the first seek pays for.
+	add_stats_time(&self->stats, STATS_SEEK, start);
 
 	return sptrue;
 }
 
 static size_t get_minimum_output_buffer_size(struct sppb_plugin_description *plugin, void *context)
 {
-	ModPlug_Settings settings;
-
-	ModPlug_GetSettings(&settings);
-
 	// This is just a ballpark figure, one tenth of a second.
-	return settings.mBits / 8 * settings.mChannels * settings.mFrequency / 10;
+	return get_frame_size(&self->settings) * self->settings.rate / 10;
 }
 
 static unsigned int get_length_in_samples(struct sppb_plugin_description *plugin, void *context)
 {
-	return (ModPlug_GetLength(self) + 500) / 1000 * get_sampling_rate();
+	if (self->end) return self->end;
+
+	return getSongLength(self);
 }
 
 static void get_audio_format(struct sppb_plugin_description *plugin, void *context, unsigned int *samplerate, enum sppb_sound_format *format, enum sppb_channel_format *channels)
 {
-	ModPlug_Settings settings;
+	*samplerate = self->settings.rate;
 
-	ModPlug_GetSettings(&settings);
-
-	*samplerate = settings.mFrequency;
-
-	switch (settings.mBits) {
-	case  8: *format = SPPB_SOUND_FORMAT_8BITS_PER_SAMPLE; break;
-	case 16: *format = SPPB_SOUND_FORMAT_16BITS_PER_SAMPLE; break;
-	default: *format = INT_MAX; break; // TODO(tommie): Report error.
-	}
+	*format = get_sound_format(&self->settings); // TODO(tommie): Report error.
 
-	switch (settings.mChannels) {
+	switch (self->settings.channels) {
 	case 1: *channels = SPPB_CHANNEL_FORMAT_MONO; break;
 	case 2: *channels = SPPB_CHANNEL_FORMAT_STEREO; break;
 	default: *channels = SPPB_CHANNEL_FORMAT_INVALID; break;
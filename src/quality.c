@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Resampling quality tiers, and adapting them to a CPU budget.
+ *
+ * The cost of rendering is measured per second of audio. A tier is
+ * assumed to cost up to twice as much as the one below it, so we only
+ * step up when the load is below half the budget.
+ */
+#include <string.h>
+#include "quality.h"
+
+
+/**
+ * The cost of a tier relative to the one below it, at most.
+**/
+#define QUALITY_STEP_COST 2
+
+static const char *TIER_NAMES[] = {
+	[MODPLUG_RESAMPLE_NEAREST] = "nearest",
+	[MODPLUG_RESAMPLE_LINEAR] = "linear",
+	[MODPLUG_RESAMPLE_SPLINE] = "spline",
+	[MODPLUG_RESAMPLE_FIR] = "fir",
+};
+
+
+spbool parse_quality_tier(const char *name, int *tier)
+{
+	for (size_t i = 0; i < sizeof(TIER_NAMES) / sizeof(*TIER_NAMES); ++i) {
+		if (!strcmp(name, TIER_NAMES[i])) {
+			*tier = i;
+			return sptrue;
+		}
+	}
+
+	return spfalse;
+}
+
+const char* get_quality_tier_name(int tier)
+{
+	if (tier < 0 || tier >= (int) (sizeof(TIER_NAMES) / sizeof(*TIER_NAMES)))
+		return NULL;
+
+	return TIER_NAMES[tier];
+}
+
+void init_quality_control(struct quality_control *qc, int tier, int max_tier, unsigned int budget)
+{
+	memset(qc, 0, sizeof(*qc));
+	qc->tier = tier < max_tier ? tier : max_tier;
+	qc->max_tier = max_tier;
+	qc->budget = budget;
+	qc->wait_windows = QUALITY_MIN_WAIT_WINDOWS;
+}
+
+spbool update_quality_control(struct quality_control *qc, uint64_t render_ns, size_t frames, unsigned int rate)
+{
+	qc->render_ns += render_ns;
+	qc->frames += frames;
+
+	if (!rate || qc->frames < (uint64_t) rate * QUALITY_WINDOW_MS / 1000)
+		return spfalse;
+
+	uint64_t audio_ns = qc->frames * 1000000000 / rate;
+	unsigned int load = qc->render_ns * 100 / audio_ns;
+
+	qc->render_ns = 0;
+	qc->frames = 0;
+
+	if (load > qc->budget) {
+		qc->good_windows = 0;
+
+		if (qc->tier == MODPLUG_RESAMPLE_NEAREST) return spfalse;
+
+		// Taking back a step up means we were too eager.
+		if (qc->stepped_up && qc->wait_windows < QUALITY_MAX_WAIT_WINDOWS)
+			qc->wait_windows *= 2;
+
+		--qc->tier;
+		qc->stepped_up = spfalse;
+
+		return sptrue;
+	}
+
+	if (qc->tier >= qc->max_tier || load * QUALITY_STEP_COST > qc->budget) {
+		qc->good_windows = 0;
+		return spfalse;
+	}
+
+	if (++qc->good_windows < qc->wait_windows) return spfalse;
+
+	++qc->tier;
+	qc->good_windows = 0;
+	qc->stepped_up = sptrue;
+
+	return sptrue;
+}
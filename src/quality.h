@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Resampling quality tiers, and adapting them to a CPU budget.
+ */
+#ifndef __MODPLUG_SPOTIFY_QUALITY_H__
+#define __MODPLUG_SPOTIFY_QUALITY_H__
+
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The default share of realtime decoding may use in adaptive mode,
+ * in percent.
+ *
+ * Can be overridden with the MPSP_CPU_BUDGET environment variable.
+**/
+#define QUALITY_DEFAULT_CPU_BUDGET 25
+
+/**
+ * The amount of audio each measurement covers, in milliseconds.
+**/
+#define QUALITY_WINDOW_MS 1000
+
+/**
+ * The number of windows within budget before stepping up, at first.
+ *
+ * Doubled every time a step up has to be taken back, up to
+ * QUALITY_MAX_WAIT_WINDOWS.
+**/
+#define QUALITY_MIN_WAIT_WINDOWS 4
+#define QUALITY_MAX_WAIT_WINDOWS 64
+
+
+// --- Types ---
+/**
+ * The state of adaptive quality for one playback context.
+ *
+ * Tiers are the MODPLUG_RESAMPLE_* values, cheapest first.
+**/
+struct quality_control {
+	int tier;
+	int max_tier;
+
+	/// Percent of realtime.
+	unsigned int budget;
+
+	/// The current window.
+	uint64_t render_ns;
+	uint64_t frames;
+
+	/// Windows within budget in a row, and how many we need.
+	unsigned int good_windows;
+	unsigned int wait_windows;
+
+	/// Non-zero if the last change was a step up.
+	spbool stepped_up;
+};
+
+
+// --- Functions ---
+/**
+ * Parse a tier name, as in $MPSP_QUALITY.
+ *
+ * @param name one of nearest, linear, spline and fir.
+ * @param tier set to the MODPLUG_RESAMPLE_* value.
+ * @return zero if the name is unknown, non-zero otherwise.
+**/
+extern spbool parse_quality_tier(const char *name, int *tier);
+
+/**
+ * Return the name of a tier.
+**/
+extern const char* get_quality_tier_name(int tier);
+
+/**
+ * Start adapting quality.
+ *
+ * @param qc the state to initialize.
+ * @param tier the tier to start at.
+ * @param max_tier the highest tier to step up to.
+ * @param budget the share of realtime decoding may use, in percent.
+**/
+extern void init_quality_control(struct quality_control *qc, int tier, int max_tier, unsigned int budget);
+
+/**
+ * Account for rendering, and pick the tier for what follows.
+ *
+ * Quality is stepped down as soon as a window goes over budget, and
+ * only stepped up after a number of windows with room to spare for a
+ * more expensive resampler. Changing the resampler doesn't reset any
+ * mixing state in libmodplug, so the switch is seamless.
+ *
+ * @param qc the adaptive state.
+ * @param render_ns the time spent rendering.
+ * @param frames the number of frames rendered.
+ * @param rate the sampling rate.
+ * @return non-zero if qc->tier changed.
+**/
+extern spbool update_quality_control(struct quality_control *qc, uint64_t render_ns, size_t frames, unsigned int rate);
+
+#endif /* __MODPLUG_SPOTIFY_QUALITY_H__ */
@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Rendering ahead of playback on a worker thread.
+ *
+ * The worker renders straight into a lock-free ring buffer, and the
+ * decoding thread copies out of it. The mutex is only used to sleep
+ * and wake up; the worker sleeps when the ring is full, and the reader
+ * wakes it up after reading if it flagged that it was waiting.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "renderahead.h"
+#include "ringbuf.h"
+
+
+/**
+ * The largest number of frames rendered at once.
+**/
+#define CHUNK_FRAMES 2048
+
+/**
+ * How long the worker sleeps on a full ring, if never woken.
+**/
+#define FULL_WAIT_NS 50000000
+
+
+struct render_ahead {
+	struct ring_buffer ring;
+	size_t frame_size;
+	render_func render;
+	void *opaque;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+
+	/// Wakes up the worker.
+	pthread_cond_t wake;
+
+	/// Signalled by the worker after each chunk.
+	pthread_cond_t rendered;
+
+	// Guarded by lock.
+	spbool stop;
+	spbool paused;
+	spbool busy;
+
+	// Atomic.
+	spbool waiting;
+	spbool eof;
+
+	// Only used by the reader.
+	unsigned long underruns;
+};
+
+
+static void waitFull(struct render_ahead *ahead)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += FULL_WAIT_NS;
+
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+
+	(void) pthread_cond_timedwait(&ahead->wake, &ahead->lock, &ts);
+}
+
+static void* renderLoop(void *arg)
+{
+	struct render_ahead *ahead = arg;
+
+	pthread_mutex_lock(&ahead->lock);
+
+	while (!ahead->stop) {
+		void *ptr;
+
+		if (ahead->paused || __atomic_load_n(&ahead->eof, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&ahead->wake, &ahead->lock);
+			continue;
+		}
+
+		// Pairs with the fence in wakeWorker().
+		__atomic_store_n(&ahead->waiting, sptrue, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		size_t len = get_ring_write_region(&ahead->ring, &ptr);
+
+		if (len > CHUNK_FRAMES * ahead->frame_size)
+			len = CHUNK_FRAMES * ahead->frame_size;
+
+		len -= len % ahead->frame_size;
+
+		if (!len) {
+			waitFull(ahead);
+			continue;
+		}
+
+		__atomic_store_n(&ahead->waiting, spfalse, __ATOMIC_RELAXED);
+		ahead->busy = sptrue;
+		pthread_mutex_unlock(&ahead->lock);
+
+		size_t n = ahead->render(ahead->opaque, ptr, len);
+
+		pthread_mutex_lock(&ahead->lock);
+		ahead->busy = spfalse;
+
+		if (n) commit_ring_write(&ahead->ring, n);
+		else __atomic_store_n(&ahead->eof, sptrue, __ATOMIC_RELEASE);
+
+		pthread_cond_broadcast(&ahead->rendered);
+	}
+
+	pthread_mutex_unlock(&ahead->lock);
+
+	return NULL;
+}
+
+/**
+ * Wake up the worker if it is waiting for room in the ring.
+**/
+static void wakeWorker(struct render_ahead *ahead)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&ahead->waiting, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&ahead->lock);
+	pthread_cond_signal(&ahead->wake);
+	pthread_mutex_unlock(&ahead->lock);
+}
+
+struct render_ahead* start_render_ahead(size_t size, size_t frame_size, render_func render, void *opaque)
+{
+	struct render_ahead *ahead = calloc(1, sizeof(*ahead));
+
+	if (!ahead) return NULL;
+
+	if (!init_ring_buffer(&ahead->ring, size)) {
+		free(ahead);
+		return NULL;
+	}
+
+	ahead->frame_size = frame_size;
+	ahead->render = render;
+	ahead->opaque = opaque;
+	pthread_mutex_init(&ahead->lock, NULL);
+	pthread_cond_init(&ahead->wake, NULL);
+	pthread_cond_init(&ahead->rendered, NULL);
+
+	if (pthread_create(&ahead->thread, NULL, renderLoop, ahead)) {
+		MPSP_EPRINTF("failed to start render thread: %s\n", strerror(errno));
+		pthread_cond_destroy(&ahead->rendered);
+		pthread_cond_destroy(&ahead->wake);
+		pthread_mutex_destroy(&ahead->lock);
+		free_ring_buffer(&ahead->ring);
+		free(ahead);
+		return NULL;
+	}
+
+	return ahead;
+}
+
+void stop_render_ahead(struct render_ahead *ahead)
+{
+	pthread_mutex_lock(&ahead->lock);
+	ahead->stop = sptrue;
+	pthread_cond_signal(&ahead->wake);
+	pthread_mutex_unlock(&ahead->lock);
+
+	pthread_join(ahead->thread, NULL);
+
+	MPSP_DPRINTF("render ahead: %lu underruns\n", ahead->underruns);
+
+	pthread_cond_destroy(&ahead->rendered);
+	pthread_cond_destroy(&ahead->wake);
+	pthread_mutex_destroy(&ahead->lock);
+	free_ring_buffer(&ahead->ring);
+	free(ahead);
+}
+
+size_t read_render_ahead(struct render_ahead *ahead, void *dest, size_t len, spbool *final)
+{
+	len -= len % ahead->frame_size;
+
+	size_t n = read_ring(&ahead->ring, dest, len);
+
+	if (n < len && !__atomic_load_n(&ahead->eof, __ATOMIC_ACQUIRE)) {
+		++ahead->underruns;
+
+		if (!n) {
+			pthread_mutex_lock(&ahead->lock);
+
+			while (!get_ring_level(&ahead->ring) && !__atomic_load_n(&ahead->eof, __ATOMIC_ACQUIRE) && !ahead->paused)
+				pthread_cond_wait(&ahead->rendered, &ahead->lock);
+
+			pthread_mutex_unlock(&ahead->lock);
+
+			n = read_ring(&ahead->ring, dest, len);
+		}
+	}
+
+	wakeWorker(ahead);
+
+	// The worker sets eof only after committing everything rendered.
+	if (!n && __atomic_load_n(&ahead->eof, __ATOMIC_ACQUIRE))
+		n = read_ring(&ahead->ring, dest, len);
+
+	*final = !n && __atomic_load_n(&ahead->eof, __ATOMIC_ACQUIRE);
+
+	return n;
+}
+
+void pause_render_ahead(struct render_ahead *ahead)
+{
+	pthread_mutex_lock(&ahead->lock);
+	ahead->paused = sptrue;
+
+	while (ahead->busy)
+		pthread_cond_wait(&ahead->rendered, &ahead->lock);
+
+	pthread_mutex_unlock(&ahead->lock);
+}
+
+void resume_render_ahead(struct render_ahead *ahead, spbool flush)
+{
+	pthread_mutex_lock(&ahead->lock);
+
+	if (flush) {
+		flush_ring(&ahead->ring);
+		__atomic_store_n(&ahead->eof, spfalse, __ATOMIC_RELEASE);
+	}
+
+	ahead->paused = spfalse;
+	pthread_cond_signal(&ahead->wake);
+	pthread_mutex_unlock(&ahead->lock);
+}
+
+void get_render_ahead_stats(struct render_ahead *ahead, struct render_ahead_stats *stats)
+{
+	stats->level = get_ring_level(&ahead->ring);
+	stats->size = ahead->ring.size;
+	stats->underruns = ahead->underruns;
+}
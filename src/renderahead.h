@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Rendering ahead of playback on a worker thread.
+ */
+#ifndef __MODPLUG_SPOTIFY_RENDERAHEAD_H__
+#define __MODPLUG_SPOTIFY_RENDERAHEAD_H__
+
+#include "common.h"
+
+
+// --- Types ---
+/**
+ * Render up to len bytes into buf.
+ *
+ * @return the number of bytes rendered, zero at the end of the song.
+**/
+typedef size_t (*render_func)(void *opaque, void *buf, size_t len);
+
+struct render_ahead;
+
+/**
+ * Statistics of a render ahead worker.
+**/
+struct render_ahead_stats {
+	/// The number of bytes buffered, and the buffer capacity.
+	size_t level;
+	size_t size;
+
+	/// The number of reads that found less data than asked for.
+	unsigned long underruns;
+};
+
+
+// --- Functions ---
+/**
+ * Start a worker thread rendering into a ring buffer.
+ *
+ * @param size the number of bytes to render ahead.
+ * @param frame_size the size of a sample frame, a power of two.
+ * @param render the function rendering audio.
+ * @param opaque passed to the render function.
+ * @return NULL on error, a worker to stop_render_ahead() on success.
+**/
+extern struct render_ahead* start_render_ahead(size_t size, size_t frame_size, render_func render, void *opaque);
+
+/**
+ * Stop the worker thread, and free all resources.
+**/
+extern void stop_render_ahead(struct render_ahead *ahead);
+
+/**
+ * Copy rendered audio out of the ring buffer.
+ *
+ * If nothing is buffered, this waits for the worker.
+ *
+ * @param ahead the worker to read from.
+ * @param dest the buffer to copy to.
+ * @param len the size of dest, in bytes.
+ * @param final set to non-zero at the end of the song.
+ * @return the number of bytes copied.
+**/
+extern size_t read_render_ahead(struct render_ahead *ahead, void *dest, size_t len, spbool *final);
+
+/**
+ * Wait for the worker to finish rendering, and keep it idle.
+ *
+ * Call this before touching the module being rendered.
+**/
+extern void pause_render_ahead(struct render_ahead *ahead);
+
+/**
+ * Let the worker continue after pause_render_ahead().
+ *
+ * @param ahead the worker.
+ * @param flush if non-zero, drop everything rendered so far.
+**/
+extern void resume_render_ahead(struct render_ahead *ahead, spbool flush);
+
+/**
+ * Return statistics of the worker.
+**/
+extern void get_render_ahead_stats(struct render_ahead *ahead, struct render_ahead_stats *stats);
+
+#endif /* __MODPLUG_SPOTIFY_RENDERAHEAD_H__ */
@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Lock-free single producer, single consumer ring buffer.
+ */
+#include <stdlib.h>
+#include "ringbuf.h"
+
+
+spbool init_ring_buffer(struct ring_buffer *ring, size_t size)
+{
+	size_t n = 1;
+
+	while (n < size) n <<= 1;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->data = malloc(n);
+	ring->size = n;
+
+	return ring->data != NULL;
+}
+
+void free_ring_buffer(struct ring_buffer *ring)
+{
+	free(ring->data);
+	ring->data = NULL;
+}
+
+size_t get_ring_write_region(struct ring_buffer *ring, void **ptr)
+{
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t space = ring->size - (ring->head - tail);
+	size_t offset = ring->head & (ring->size - 1);
+	size_t contiguous = ring->size - offset;
+
+	*ptr = ring->data + offset;
+
+	return space < contiguous ? space : contiguous;
+}
+
+void commit_ring_write(struct ring_buffer *ring, size_t len)
+{
+	__atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+size_t read_ring(struct ring_buffer *ring, void *dest, size_t len)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t level = head - ring->tail;
+	size_t offset = ring->tail & (ring->size - 1);
+
+	if (len > level) len = level;
+
+	size_t first = ring->size - offset;
+
+	if (first > len) first = len;
+
+	memcpy(dest, ring->data + offset, first);
+	memcpy((unsigned char*) dest + first, ring->data, len - first);
+
+	__atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_SEQ_CST);
+
+	return len;
+}
+
+size_t get_ring_level(struct ring_buffer *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+void flush_ring(struct ring_buffer *ring)
+{
+	__atomic_store_n(&ring->tail, ring->head, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Lock-free single producer, single consumer ring buffer.
+ */
+#ifndef __MODPLUG_SPOTIFY_RINGBUF_H__
+#define __MODPLUG_SPOTIFY_RINGBUF_H__
+
+#include "common.h"
+
+
+// --- Types ---
+/**
+ * A ring buffer of bytes.
+ *
+ * One thread may write and another may read at the same time. The
+ * positions count bytes ever written and read, and are only masked
+ * when accessing the data.
+**/
+struct ring_buffer {
+	unsigned char *data;
+
+	/// The capacity, a power of two.
+	size_t size;
+
+	/// Only modified by the producer.
+	size_t head;
+
+	/// Only modified by the consumer.
+	size_t tail;
+};
+
+
+// --- Functions ---
+/**
+ * Allocate the buffer of a ring.
+ *
+ * @param ring the ring to initialize.
+ * @param size the minimum capacity, rounded up to a power of two.
+ * @return zero on error, non-zero otherwise.
+**/
+extern spbool init_ring_buffer(struct ring_buffer *ring, size_t size);
+
+/**
+ * Free the buffer of a ring.
+**/
+extern void free_ring_buffer(struct ring_buffer *ring);
+
+/**
+ * Return the largest contiguous free region, for the producer.
+ *
+ * @param ring the ring to write to.
+ * @param ptr set to the start of the region.
+ * @return the size of the region, in bytes.
+**/
+extern size_t get_ring_write_region(struct ring_buffer *ring, void **ptr);
+
+/**
+ * Make bytes written to the region visible to the consumer.
+**/
+extern void commit_ring_write(struct ring_buffer *ring, size_t len);
+
+/**
+ * Copy bytes out of the ring, for the consumer.
+ *
+ * @return the number of bytes copied, at most len.
+**/
+extern size_t read_ring(struct ring_buffer *ring, void *dest, size_t len);
+
+/**
+ * Return the number of bytes available to the consumer.
+**/
+extern size_t get_ring_level(struct ring_buffer *ring);
+
+/**
+ * Drop all buffered bytes.
+ *
+ * The producer must not be writing at the same time.
+**/
+extern void flush_ring(struct ring_buffer *ring);
+
+#endif /* __MODPLUG_SPOTIFY_RINGBUF_H__ */
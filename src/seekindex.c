@@ -0,0 +1,210 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Seek index of a song.
+ *
+ * ModPlug_Seek() replays the song to find its length, and then guesses
+ * the position in the order list from the time. Instead, we walk the
+ * song once to find the sample offset of every order start, and seek
+ * with ModPlug_SeekOrder(). Seeking there keeps the current speed and
+ * tempo, so the points remember what they should be. There is no way
+ * to set them directly, but seeking to the start of the song resets
+ * them, and playing the first tick of an order that sets them on its
+ * first row sets them. The remainder up to the wanted sample is
+ * rendered and thrown away.
+ */
+#include <stdlib.h>
+#include "seekindex.h"
+
+
+/**
+ * Find the speed and tempo set on the first row of an order.
+ *
+ * The commands are applied on the first tick of the row, so if
+ * several channels set them, the last one wins.
+**/
+static void getFirstRowTiming(const struct mod_header *header, unsigned int order, unsigned int *speed, unsigned int *tempo)
+{
+	*speed = *tempo = 0;
+
+	if (order >= header->num_orders || header->orders[order] >= header->num_patterns)
+		return;
+
+	const struct mod_pattern *pat = &header->patterns[header->orders[order]];
+
+	// Events are sorted by row.
+	for (unsigned int i = pat->first_event; i < pat->first_event + pat->num_events && !header->events[i].row; ++i) {
+		const struct mod_event *e = &header->events[i];
+
+		switch (e->command) {
+		case MOD_CMD_SPEED: if (e->param) *speed = e->param; break;
+		case MOD_CMD_TEMPO: *tempo = e->param; break;
+		}
+	}
+}
+
+static void addPoint(void *opaque, const struct mod_position *pos)
+{
+	struct seek_index *index = opaque;
+
+	if (pos->row || !index->points) return;
+
+	// The start of the song is always the first point.
+	if (!pos->order) {
+		index->points[0].speed = pos->speed;
+		index->points[0].tempo = pos->tempo;
+		return;
+	}
+
+	// A pattern loop back to row zero is still the same entry.
+	if (index->points[index->num_points - 1].order == pos->order) return;
+
+	struct seek_point *p = &index->points[index->num_points++];
+
+	p->sample = pos->sample;
+	p->order = pos->order;
+	p->speed = pos->speed;
+	p->tempo = pos->tempo;
+}
+
+struct seek_index* build_seek_index(const struct mod_header *header, unsigned int rate)
+{
+	struct seek_index *index = calloc(1, sizeof(*index));
+
+	if (!index) return NULL;
+
+	// Each order is entered at row zero at most once.
+	index->points = malloc((header->num_orders + 1) * sizeof(*index->points));
+
+	if (!index->points) goto error;
+
+	index->rate = rate;
+	index->num_points = 1;
+	index->points[0].sample = 0;
+	index->points[0].order = 0;
+
+	if (!walk_mod_song(header, rate, addPoint, index, NULL))
+		goto error;
+
+	for (unsigned int i = 0; i < index->num_points; ++i) {
+		struct seek_point *p = &index->points[i];
+
+		getFirstRowTiming(header, p->order, &p->set_speed, &p->set_tempo);
+	}
+
+	return index;
+
+error:
+	free_seek_index(index);
+
+	return NULL;
+}
+
+void free_seek_index(struct seek_index *index)
+{
+	if (!index) return;
+
+	free(index->points);
+	free(index);
+}
+
+/**
+ * Return whether playing from a point with the given speed and tempo
+ * gives the same result as playing there from the start of the song.
+**/
+static spbool isReachable(const struct seek_point *p, unsigned int speed, unsigned int tempo)
+{
+	return (p->set_speed || p->speed == speed) && (p->set_tempo || p->tempo == tempo);
+}
+
+/**
+ * Find a way to give the player the speed and tempo of a point.
+**/
+static spbool findSetup(const struct seek_index *index, const struct seek_point *p, unsigned int speed, unsigned int tempo, struct seek_setup *setup)
+{
+	const struct seek_point *start = &index->points[0];
+
+	setup->order = -1;
+	setup->play = spfalse;
+
+	// Seeking to the start of the song resets the player anyway.
+	if (p == start || isReachable(p, speed, tempo))
+		return sptrue;
+
+	setup->order = 0;
+
+	if (isReachable(p, start->speed, start->tempo))
+		return sptrue;
+
+	setup->play = sptrue;
+
+	for (unsigned int i = 0; i < index->num_points; ++i) {
+		const struct seek_point *q = &index->points[i];
+		// Seeking to the start resets the player before the tick.
+		unsigned int base_speed = q == start ? start->speed : speed;
+		unsigned int base_tempo = q == start ? start->tempo : tempo;
+
+		if (!q->set_speed && !q->set_tempo) continue;
+
+		if (isReachable(p, q->set_speed ? q->set_speed : base_speed, q->set_tempo ? q->set_tempo : base_tempo)) {
+			setup->order = q->order;
+			return sptrue;
+		}
+	}
+
+	return spfalse;
+}
+
+const struct seek_point* find_seek_point(const struct seek_index *index, uint64_t sample, unsigned int speed, unsigned int tempo, struct seek_setup *setup)
+{
+	unsigned int lo = 1, hi = index->num_points;
+
+	// Find the first point after the sample.
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (index->points[mid].sample <= sample) lo = mid + 1;
+		else hi = mid;
+	}
+
+	while (--lo) {
+		const struct seek_point *p = &index->points[lo];
+
+		if (findSetup(index, p, speed, tempo, setup))
+			return p;
+	}
+
+	findSetup(index, &index->points[0], speed, tempo, setup);
+
+	return &index->points[0];
+}
+
+unsigned int split_seek_index(const struct seek_index *index, uint64_t length, unsigned int count, uint64_t *starts)
+{
+	unsigned int n = 0, lo = 0;
+
+	if (!count) return 0;
+
+	starts[n++] = 0;
+
+	for (unsigned int k = 1; k < count; ++k) {
+		uint64_t target = length * k / count;
+
+		// Find the first point after the target. The first point is at
+		// zero, so there is always one before it.
+		while (lo < index->num_points && index->points[lo].sample <= target)
+			++lo;
+
+		unsigned int best = lo - 1;
+
+		if (lo < index->num_points && index->points[lo].sample - target < target - index->points[lo - 1].sample)
+			best = lo;
+
+		uint64_t sample = index->points[best].sample;
+
+		if (sample > starts[n - 1] && sample < length)
+			starts[n++] = sample;
+	}
+
+	return n;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Seek index of a song.
+ */
+#ifndef __MODPLUG_SPOTIFY_SEEKINDEX_H__
+#define __MODPLUG_SPOTIFY_SEEKINDEX_H__
+
+#include "common.h"
+#include "header.h"
+
+
+// --- Types ---
+/**
+ * A point where libmodplug can seek to exactly.
+ *
+ * This is the start of an order, together with the player state
+ * libmodplug doesn't reset when seeking there.
+**/
+struct seek_point {
+	uint64_t sample;
+	unsigned int order;
+	unsigned int speed;
+	unsigned int tempo;
+	/// The speed and tempo set on the first row, or zero if not set.
+	unsigned int set_speed;
+	unsigned int set_tempo;
+};
+
+/**
+ * How to give the player the speed and tempo of a seek point before
+ * seeking to it.
+**/
+struct seek_setup {
+	/// The order to seek to first, or -1 if nothing needs to be done.
+	/// Seeking to order zero resets the player.
+	int order;
+	/// Whether to play one tick after that, to let the first row of
+	/// the order set the speed and tempo.
+	spbool play;
+};
+
+/**
+ * The seek points of a song, in order of playback.
+**/
+struct seek_index {
+	unsigned int rate;
+	unsigned int num_points;
+	struct seek_point *points;
+};
+
+
+// --- Functions ---
+/**
+ * Build a seek index from a parsed header.
+ *
+ * @param header the song to index.
+ * @param rate the sampling rate to count samples in.
+ * @return NULL on error, an index to free_seek_index() on success.
+**/
+extern struct seek_index* build_seek_index(const struct mod_header *header, unsigned int rate);
+
+/**
+ * Free an index returned by build_seek_index().
+ *
+ * @param index the index to free, may be NULL.
+**/
+extern void free_seek_index(struct seek_index *index);
+
+/**
+ * Find the last seek point at or before the given sample.
+ *
+ * Points are skipped only if there is no way to give the player their
+ * speed and tempo: not the current ones, not those at the start of the
+ * song, and not those set by the first row of any order.
+ *
+ * @param index the index to search.
+ * @param sample the sample to seek to.
+ * @param speed the current speed of the player.
+ * @param tempo the current tempo of the player.
+ * @param setup set to what to do before seeking to the point.
+ * @return the seek point, never NULL.
+**/
+extern const struct seek_point* find_seek_point(const struct seek_index *index, uint64_t sample, unsigned int speed, unsigned int tempo, struct seek_setup *setup);
+
+/**
+ * Split a song into segments that start at seek points.
+ *
+ * The segments are about equally long, and the first starts at zero.
+ * Fewer segments are returned if there aren't enough seek points.
+ *
+ * @param index the seek points of the song.
+ * @param length the song length, in samples.
+ * @param count the number of segments wanted.
+ * @param starts set to the first sample of each segment, must have
+ *        room for count entries.
+ * @return the number of segments.
+**/
+extern unsigned int split_seek_index(const struct seek_index *index, uint64_t length, unsigned int count, uint64_t *starts);
+
+#endif /* __MODPLUG_SPOTIFY_SEEKINDEX_H__ */
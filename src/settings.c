@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Render settings of libmodplug.
+ */
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "settings.h"
+
+
+/**
+ * The size of the empty module loaded to change the mixing format: the
+ * MOD header, and a pattern of 64 rows of four channels.
+**/
+#define FORMAT_MOD_SIZE (1084 + 64 * 4 * 4)
+
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Signalled when the last shared load ends, see begin_shared_load().
+static pthread_cond_t loads_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t defaults_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Set up by the plugin entry point.
+static struct render_settings default_settings;
+
+/// The settings last given to libmodplug, guarded by render_lock.
+static struct render_settings applied_settings;
+static spbool applied;
+
+/// The format libmodplug mixes in, guarded by render_lock.
+static struct render_settings loaded_settings;
+static spbool loaded;
+
+/// The number of loads running without render_lock.
+static unsigned int shared_loads;
+
+/// The last rate found by getDeviceRate(), guarded by defaults_lock.
+static unsigned int device_rate;
+static uint64_t device_rate_time;
+
+
+/**
+ * Read the rate of an open ALSA playback stream.
+ *
+ * @return the rate, or zero if there is no open stream.
+**/
+static unsigned int readDeviceRate(void)
+{
+	unsigned int rate = 0;
+	glob_t g;
+
+	if (glob("/proc/asound/card*/pcm*p/sub*/hw_params", 0, NULL, &g)) return 0;
+
+	for (size_t i = 0; !rate && i < g.gl_pathc; ++i) {
+		FILE *file = fopen(g.gl_pathv[i], "re");
+		char line[128];
+
+		if (!file) continue;
+
+		// Closed streams only have the word "closed".
+		while (!rate && fgets(line, sizeof(line), file)) {
+			if (sscanf(line, "rate: %u", &rate) != 1) rate = 0;
+		}
+
+		(void) fclose(file);
+	}
+
+	globfree(&g);
+
+	return rate;
+}
+
+/**
+ * Return the rate of the playback device, or zero if unknown.
+ *
+ * Must be called with defaults_lock held.
+**/
+static unsigned int getDeviceRate(void)
+{
+	uint64_t now = get_time_ns();
+
+	if (!device_rate_time || now - device_rate_time >= SETTINGS_DEVICE_RATE_TTL * 1000000000ULL) {
+		unsigned int rate = readDeviceRate();
+
+		if (rate != device_rate)
+			MPSP_DPRINTF("settings: device rate is %u Hz\n", rate);
+
+		device_rate = rate >= SETTINGS_MIN_RATE && rate <= SETTINGS_MAX_RATE ? rate : 0;
+		device_rate_time = now;
+	}
+
+	return device_rate;
+}
+
+void get_default_settings(struct render_settings *settings)
+{
+	pthread_mutex_lock(&defaults_lock);
+	*settings = default_settings;
+
+	if (settings->device_rate) {
+		unsigned int rate = getDeviceRate();
+
+		if (rate) settings->rate = rate;
+	}
+
+	pthread_mutex_unlock(&defaults_lock);
+}
+
+void set_default_settings(const struct render_settings *settings)
+{
+	pthread_mutex_lock(&defaults_lock);
+	default_settings = *settings;
+	pthread_mutex_unlock(&defaults_lock);
+}
+
+/**
+ * Return non-zero if libmodplug already uses the settings.
+ *
+ * Only the fields given to libmodplug are compared, so contexts that
+ * differ in anything else don't reconfigure it when taking turns.
+**/
+static spbool isApplied(const struct render_settings *settings)
+{
+	return applied &&
+		settings->rate == applied_settings.rate &&
+		settings->bits == applied_settings.bits &&
+		settings->channels == applied_settings.channels &&
+		settings->resampling == applied_settings.resampling &&
+		settings->flags == applied_settings.flags &&
+		settings->loop_count == applied_settings.loop_count;
+}
+
+/**
+ * Return non-zero if libmodplug mixes at the rate, bits and channels of
+ * the settings.
+**/
+static spbool isLoadedFormat(const struct render_settings *settings)
+{
+	return loaded &&
+		settings->rate == loaded_settings.rate &&
+		settings->bits == loaded_settings.bits &&
+		settings->channels == loaded_settings.channels;
+}
+
+/**
+ * Make libmodplug mix in the format of the applied settings.
+ *
+ * Only ModPlug_Load() sets up the rate, bits and channels, so an empty
+ * four channel MOD, with one pattern and no samples, is loaded and
+ * thrown away. This is much cheaper than loading a real song again.
+**/
+static void loadFormat(void)
+{
+	static unsigned char mod[FORMAT_MOD_SIZE];
+
+	if (!mod[950]) {
+		// One order, of pattern zero.
+		mod[950] = 1;
+		mod[951] = 127;
+		memcpy(mod + 1080, "M.K.", 4);
+	}
+
+	ModPlugFile *file = ModPlug_Load(mod, sizeof(mod));
+
+	// The format is set up even if loading fails.
+	if (file) ModPlug_Unload(file);
+
+	loaded_settings = applied_settings;
+	loaded = sptrue;
+}
+
+void begin_render(const struct render_settings *settings)
+{
+	pthread_mutex_lock(&render_lock);
+
+	// Shared loads write the settings in use to libmodplug again.
+	while (shared_loads && (!isApplied(settings) || !isLoadedFormat(settings)))
+		pthread_cond_wait(&loads_cond, &render_lock);
+
+	if (!isApplied(settings)) {
+		ModPlug_Settings mps;
+
+		ModPlug_GetSettings(&mps);
+
+		mps.mFrequency = settings->rate;
+		mps.mBits = settings->bits;
+		mps.mChannels = settings->channels;
+		mps.mResamplingMode = settings->resampling;
+		mps.mFlags = settings->flags;
+		mps.mLoopCount = settings->loop_count;
+
+		ModPlug_SetSettings(&mps);
+
+		applied_settings = *settings;
+		applied = sptrue;
+	}
+
+	if (!isLoadedFormat(settings)) loadFormat();
+}
+
+void end_render(void)
+{
+	pthread_mutex_unlock(&render_lock);
+}
+
+spbool begin_shared_load(const struct render_settings *settings)
+{
+	pthread_mutex_lock(&render_lock);
+
+	// The module keeps the loop count, and everything else is global.
+	spbool shared = isLoadedFormat(settings) && applied && applied_settings.loop_count == settings->loop_count;
+
+	if (shared) ++shared_loads;
+
+	pthread_mutex_unlock(&render_lock);
+
+	return shared;
+}
+
+void end_shared_load(void)
+{
+	pthread_mutex_lock(&render_lock);
+
+	if (!--shared_loads) pthread_cond_broadcast(&loads_cond);
+
+	pthread_mutex_unlock(&render_lock);
+}
+
+size_t get_frame_size(const struct render_settings *settings)
+{
+	return settings->bits / 8 * settings->channels;
+}
+
+enum sppb_sound_format get_sound_format(const struct render_settings *settings)
+{
+	if (settings->float_output)
+		return settings->bits == 32 ? SPPB_SOUND_FORMAT_IEEE_FLOAT : INT_MAX;
+
+	switch (settings->bits) {
+	case  8: return SPPB_SOUND_FORMAT_8BITS_PER_SAMPLE;
+	case 16: return SPPB_SOUND_FORMAT_16BITS_PER_SAMPLE;
+	default: return INT_MAX;
+	}
+}
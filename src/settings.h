@@ -0,0 +1,160 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Render settings of libmodplug.
+ */
+#ifndef __MODPLUG_SPOTIFY_SETTINGS_H__
+#define __MODPLUG_SPOTIFY_SETTINGS_H__
+
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The range of output sampling rates, in Hz.
+**/
+#define SETTINGS_MIN_RATE 8000
+#define SETTINGS_MAX_RATE 96000
+
+/**
+ * The number of seconds the rate of the playback device is remembered.
+**/
+#define SETTINGS_DEVICE_RATE_TTL 10
+
+
+// --- Types ---
+/**
+ * The settings used to load and render a module.
+ *
+ * Each context has its own copy.
+**/
+struct render_settings {
+	unsigned int rate;
+	unsigned int channels;
+
+	/// If set, the rate follows the playback device when known, see
+	/// get_default_settings().
+	spbool device_rate;
+
+	/// The bits per sample libmodplug renders, 8, 16 or 32.
+	unsigned int bits;
+
+	/// If set, the 32-bit output is converted to IEEE floats.
+	spbool float_output;
+
+	/// One of the MODPLUG_RESAMPLE_* values.
+	int resampling;
+
+	/// If non-zero, resampling is adapted to keep decoding within this
+	/// share of realtime, in percent, see quality.h.
+	unsigned int cpu_budget;
+
+	/// The highest resampling quality when adapting.
+	int max_resampling;
+
+	/// A combination of the MODPLUG_ENABLE_* flags.
+	int flags;
+
+	/// The number of times to loop, or -1 for forever.
+	int loop_count;
+
+	/// If set, spans where nothing plays are filled with silence
+	/// instead of mixed, see playback.c.
+	spbool idle_fast_path;
+
+	/// If set, known silence at the end of songs is not played, and not
+	/// counted in their length.
+	spbool trim_silence;
+
+	/// If set, the loudness of parsed songs that haven't been measured
+	/// is measured on a worker thread, see loudness.h.
+	spbool analyze;
+
+	/// If set, songs parsed on their own, rather than in a scan, are
+	/// loaded on a worker thread, so playback can start without
+	/// waiting for ModPlug_Load().
+	spbool preload;
+
+	/// The loudness songs are normalized to, in LUFS, or zero to play
+	/// them as they are.
+	double loudness_target;
+
+	/// The master volume of libmodplug, at most 512.
+	unsigned int volume;
+
+	/// The gain applied after rendering, in 1/65536ths, for songs that
+	/// are normalized above the master volume.
+	unsigned int boost;
+};
+
+
+// --- Functions ---
+/**
+ * Return the settings new contexts start out with.
+ *
+ * If the rate follows the playback device, it is the rate of the first
+ * open ALSA playback stream, which is the rate the sound server mixes
+ * at. The host would resample anything else to it. If no stream is
+ * open, or on other systems, the default rate is kept.
+**/
+extern void get_default_settings(struct render_settings *settings);
+
+/**
+ * Change the settings new contexts start out with.
+**/
+extern void set_default_settings(const struct render_settings *settings);
+
+/**
+ * Take exclusive use of libmodplug, and apply the settings.
+ *
+ * libmodplug keeps its settings and mixing buffers in global variables,
+ * so all calls that load or render a module must be made between
+ * begin_render() and end_render(). The settings are only applied if
+ * they differ from the ones used last.
+ *
+ * Resampling and flags take effect right away, but libmodplug only
+ * sets up the rate, bits and channels in ModPlug_Load(). If those
+ * change, a built-in empty module is loaded to apply them.
+ *
+ * @param settings the settings to use.
+**/
+extern void begin_render(const struct render_settings *settings);
+
+/**
+ * Release libmodplug after begin_render().
+**/
+extern void end_render(void);
+
+/**
+ * Take shared use of libmodplug for loading a module, if possible.
+ *
+ * ModPlug_Load() writes the current settings to libmodplug's globals
+ * again, and reads the module into memory of its own, so it can run
+ * alongside rendering while the settings stay the same. This is only
+ * possible if the format and loop count of the settings are in use
+ * already. Contexts that need other settings wait in begin_render()
+ * until end_shared_load().
+ *
+ * @param settings the settings to load with.
+ * @return non-zero if ModPlug_Load() may be called until
+ *         end_shared_load(), zero if begin_render() is needed instead.
+**/
+extern spbool begin_shared_load(const struct render_settings *settings);
+
+/**
+ * End a load started by begin_shared_load().
+**/
+extern void end_shared_load(void);
+
+/**
+ * Return the size of a sample frame, in bytes.
+**/
+extern size_t get_frame_size(const struct render_settings *settings);
+
+/**
+ * Return the sound format of the output, or INT_MAX if not supported
+ * by Spotify.
+**/
+extern enum sppb_sound_format get_sound_format(const struct render_settings *settings);
+
+#endif /* __MODPLUG_SPOTIFY_SETTINGS_H__ */
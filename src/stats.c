@@ -0,0 +1,296 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Runtime statistics of the plugin.
+ *
+ * Every update goes to the process statistics, and to the context
+ * statistics if there is a context. Updates are a handful of relaxed
+ * atomic additions, so they are always enabled. Dumping happens on a
+ * separate thread, only if asked for.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+
+
+static const char *TIMER_NAMES[STATS_NUM_TIMERS] = {
+	[STATS_LOAD] = "load",
+	[STATS_READ] = "read",
+	[STATS_SEEK] = "seek",
+	[STATS_GET_LENGTH] = "get_length",
+};
+
+static struct mod_stats global_stats;
+static uint64_t module_memory;
+static uint64_t peak_module_memory;
+static struct stats_histogram module_load_sizes;
+static struct stats_histogram module_load_peaks;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mod_stats *registry;
+static unsigned int last_id;
+
+static const char *stats_path;
+static sem_t dump_sem;
+
+
+static void addSample(struct stats_histogram *h, uint64_t value)
+{
+	unsigned int bucket = value ? 63 - __builtin_clzll(value) : 0;
+
+	if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void add_stats_time(struct mod_stats *stats, enum stats_timer timer, uint64_t start)
+{
+	uint64_t elapsed = get_time_ns() - start;
+
+	addSample(&global_stats.timers[timer], elapsed);
+	if (stats) addSample(&stats->timers[timer], elapsed);
+}
+
+void add_stats_input(struct mod_stats *stats, size_t len)
+{
+	__atomic_add_fetch(&global_stats.input_bytes, len, __ATOMIC_RELAXED);
+	if (stats) __atomic_add_fetch(&stats->input_bytes, len, __ATOMIC_RELAXED);
+}
+
+void add_stats_decode(struct mod_stats *stats, size_t size, size_t decoded)
+{
+	addSample(&global_stats.decode_sizes, size);
+	__atomic_add_fetch(&global_stats.decoded_bytes, decoded, __ATOMIC_RELAXED);
+
+	if (stats) {
+		addSample(&stats->decode_sizes, size);
+		__atomic_add_fetch(&stats->decoded_bytes, decoded, __ATOMIC_RELAXED);
+	}
+}
+
+void add_stats_idle(struct mod_stats *stats, uint64_t frames)
+{
+	__atomic_add_fetch(&global_stats.idle_frames, frames, __ATOMIC_RELAXED);
+	if (stats) __atomic_add_fetch(&stats->idle_frames, frames, __ATOMIC_RELAXED);
+}
+
+void add_stats_render_ahead(struct mod_stats *stats, size_t level, unsigned long underruns)
+{
+	addSample(&global_stats.ahead_levels, level);
+	__atomic_add_fetch(&global_stats.ahead_underruns, underruns, __ATOMIC_RELAXED);
+
+	if (stats) {
+		addSample(&stats->ahead_levels, level);
+		__atomic_add_fetch(&stats->ahead_underruns, underruns, __ATOMIC_RELAXED);
+	}
+}
+
+void add_stats_module_memory(long delta)
+{
+	uint64_t mem = __atomic_add_fetch(&module_memory, delta, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&peak_module_memory, __ATOMIC_RELAXED);
+
+	while (mem > peak && !__atomic_compare_exchange_n(&peak_module_memory, &peak, mem, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void add_stats_module_load(size_t peak, size_t loaded)
+{
+	addSample(&module_load_peaks, peak);
+	addSample(&module_load_sizes, loaded);
+}
+
+void register_stats(struct mod_stats *stats, const char *kind)
+{
+	stats->kind = kind;
+
+	pthread_mutex_lock(&registry_lock);
+	stats->id = ++last_id;
+	stats->prev = NULL;
+	stats->next = registry;
+	if (registry) registry->prev = stats;
+	registry = stats;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void unregister_stats(struct mod_stats *stats)
+{
+	pthread_mutex_lock(&registry_lock);
+	if (stats->prev) stats->prev->next = stats->next;
+	else registry = stats->next;
+	if (stats->next) stats->next->prev = stats->prev;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Return an upper bound of the given percentile of a histogram.
+**/
+static uint64_t getPercentile(const uint64_t *buckets, uint64_t count, uint64_t max, unsigned int p)
+{
+	uint64_t rank = (count * p + 99) / 100, seen = 0;
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; ++i) {
+		seen += buckets[i];
+
+		if (seen >= rank && seen) {
+			uint64_t bound = ((uint64_t) 2 << i) - 1;
+
+			return bound < max ? bound : max;
+		}
+	}
+
+	return 0;
+}
+
+static void dumpHistogram(FILE *file, const char *name, const struct stats_histogram *h)
+{
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t count = 0;
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	int last = -1;
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; ++i) {
+		buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+		if (buckets[i]) last = i;
+	}
+
+	fprintf(file, ",\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+		name,
+		(unsigned long long) count,
+		(unsigned long long) __atomic_load_n(&h->sum, __ATOMIC_RELAXED),
+		(unsigned long long) max,
+		(unsigned long long) getPercentile(buckets, count, max, 50),
+		(unsigned long long) getPercentile(buckets, count, max, 90),
+		(unsigned long long) getPercentile(buckets, count, max, 99));
+
+	for (int i = 0; i <= last; ++i)
+		fprintf(file, "%s%llu", i ? "," : "", (unsigned long long) buckets[i]);
+
+	fprintf(file, "]}");
+}
+
+static void dumpStats(FILE *file, const struct mod_stats *stats)
+{
+	fprintf(file, "\"input_bytes\":%llu,\"decoded_bytes\":%llu,\"idle_frames\":%llu,\"ahead_underruns\":%llu",
+		(unsigned long long) __atomic_load_n(&stats->input_bytes, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&stats->decoded_bytes, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&stats->idle_frames, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&stats->ahead_underruns, __ATOMIC_RELAXED));
+
+	for (unsigned int i = 0; i < STATS_NUM_TIMERS; ++i)
+		dumpHistogram(file, TIMER_NAMES[i], &stats->timers[i]);
+
+	dumpHistogram(file, "decode_size", &stats->decode_sizes);
+	dumpHistogram(file, "ahead_level", &stats->ahead_levels);
+}
+
+void dump_stats(FILE *file)
+{
+	fprintf(file, "{\"time\":%lld,\"pid\":%d,\"module_memory\":%llu,\"peak_module_memory\":%llu,",
+		(long long) time(NULL),
+		(int) getpid(),
+		(unsigned long long) __atomic_load_n(&module_memory, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&peak_module_memory, __ATOMIC_RELAXED));
+	dumpStats(file, &global_stats);
+	dumpHistogram(file, "module_load_size", &module_load_sizes);
+	dumpHistogram(file, "module_load_peak", &module_load_peaks);
+	fprintf(file, ",\"contexts\":[");
+
+	pthread_mutex_lock(&registry_lock);
+
+	for (const struct mod_stats *stats = registry; stats; stats = stats->next) {
+		fprintf(file, "%s{\"id\":%u,\"kind\":\"%s\",", stats == registry ? "" : ",", stats->id, stats->kind);
+		dumpStats(file, stats);
+		fprintf(file, "}");
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	fprintf(file, "]}\n");
+}
+
+static void onSignal(int sig)
+{
+	(void) sem_post(&dump_sem);
+}
+
+static void* dumpLoop(void *arg)
+{
+	const char *env = getenv("MPSP_STATS_INTERVAL");
+	long interval = env ? strtol(env, NULL, 10) : STATS_DEFAULT_INTERVAL;
+
+	for (;;) {
+		int ret;
+
+		if (interval > 0) {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += interval;
+			ret = sem_timedwait(&dump_sem, &ts);
+		} else {
+			ret = sem_wait(&dump_sem);
+		}
+
+		if (ret && errno == EINTR) continue;
+
+		FILE *file = fopen(stats_path, "ae");
+
+		if (!file) {
+			MPSP_EPRINTF("failed to open stats file %s: %s\n", stats_path, strerror(errno));
+			continue;
+		}
+
+		dump_stats(file);
+		(void) fclose(file);
+	}
+
+	return NULL;
+}
+
+void setup_stats(void)
+{
+	static spbool started;
+	struct sigaction sa;
+	pthread_t thread;
+
+	stats_path = getenv("MPSP_STATS_FILE");
+
+	if (!stats_path || !*stats_path || started) return;
+
+	started = sptrue;
+
+	if (sem_init(&dump_sem, 0, 0)) return;
+
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, dumpLoop, NULL)) {
+		MPSP_EPRINTF("failed to start stats thread\n");
+		pthread_attr_destroy(&attr);
+		return;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	// Don't take the signal from a host that uses it.
+	if (!sigaction(SIGUSR1, NULL, &sa) && sa.sa_handler == SIG_DFL) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = onSignal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		(void) sigaction(SIGUSR1, &sa, NULL);
+	}
+}
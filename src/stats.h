@@ -0,0 +1,163 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Runtime statistics of the plugin.
+ */
+#ifndef __MODPLUG_SPOTIFY_STATS_H__
+#define __MODPLUG_SPOTIFY_STATS_H__
+
+#include "common.h"
+
+
+// --- Constants ---
+/**
+ * The number of buckets in a histogram. Bucket i counts values in
+ * [2^i, 2^(i+1)), except bucket 0 that also counts zero.
+**/
+#define STATS_BUCKETS 40
+
+/**
+ * The default number of seconds between dumps to $MPSP_STATS_FILE.
+**/
+#define STATS_DEFAULT_INTERVAL 60
+
+
+// --- Types ---
+/**
+ * The libmodplug calls that are timed.
+**/
+enum stats_timer {
+	STATS_LOAD,
+	STATS_READ,
+	STATS_SEEK,
+	STATS_GET_LENGTH,
+
+	STATS_NUM_TIMERS,
+};
+
+/**
+ * A distribution of values, with power of two buckets.
+ *
+ * Updated with relaxed atomics, so a dump may be slightly inconsistent.
+**/
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/**
+ * Statistics of a context, or of the whole process.
+**/
+struct mod_stats {
+	/// Time spent in libmodplug, in nanoseconds.
+	struct stats_histogram timers[STATS_NUM_TIMERS];
+
+	/// The buffer sizes passed to decode(), in bytes.
+	struct stats_histogram decode_sizes;
+
+	uint64_t input_bytes;
+	uint64_t decoded_bytes;
+
+	/// Frames filled with silence instead of mixed, see playback.c.
+	uint64_t idle_frames;
+
+	/// The bytes buffered ahead of each decode(), and the decode()
+	/// calls that found less than asked for, see renderahead.h.
+	struct stats_histogram ahead_levels;
+	uint64_t ahead_underruns;
+
+	// Private to the registry.
+	const char *kind;
+	unsigned int id;
+	struct mod_stats *prev;
+	struct mod_stats *next;
+};
+
+
+// --- Functions ---
+/**
+ * Start dumping statistics, if $MPSP_STATS_FILE is set.
+ *
+ * A line of JSON is appended to the file every $MPSP_STATS_INTERVAL
+ * seconds (zero to disable), and when the process gets SIGUSR1, unless
+ * the host handles that signal.
+**/
+extern void setup_stats(void);
+
+/**
+ * Make the statistics of a context part of the dumps.
+ *
+ * @param stats zero-initialized statistics to register.
+ * @param kind the kind of context, like "playback".
+**/
+extern void register_stats(struct mod_stats *stats, const char *kind);
+
+/**
+ * Remove statistics added with register_stats().
+**/
+extern void unregister_stats(struct mod_stats *stats);
+
+/**
+ * Record the time of a libmodplug call.
+ *
+ * @param stats the context statistics, or NULL to only update the
+ *              process statistics.
+ * @param timer the call made.
+ * @param start when the call started, from get_time_ns().
+**/
+extern void add_stats_time(struct mod_stats *stats, enum stats_timer timer, uint64_t start);
+
+/**
+ * Record bytes read from a byte input.
+**/
+extern void add_stats_input(struct mod_stats *stats, size_t len);
+
+/**
+ * Record a call to decode().
+ *
+ * @param stats the context statistics, may be NULL.
+ * @param size the size of the buffer.
+ * @param decoded the number of bytes decoded.
+**/
+extern void add_stats_decode(struct mod_stats *stats, size_t size, size_t decoded);
+
+/**
+ * Record frames skipped by the idle fast path.
+ *
+ * @param stats the context statistics, may be NULL.
+ * @param frames the number of frames.
+**/
+extern void add_stats_idle(struct mod_stats *stats, uint64_t frames);
+
+/**
+ * Record the state of a render ahead buffer, after a decode().
+ *
+ * @param stats the context statistics, may be NULL.
+ * @param level the number of bytes buffered.
+ * @param underruns the number of new underruns.
+**/
+extern void add_stats_render_ahead(struct mod_stats *stats, size_t level, unsigned long underruns);
+
+/**
+ * Adjust the estimated memory used by modules.
+ *
+ * @param delta the number of bytes allocated, negative if freed.
+**/
+extern void add_stats_module_memory(long delta);
+
+/**
+ * Record the memory used to load a module into libmodplug.
+ *
+ * @param peak the bytes in use while loading, the file included.
+ * @param loaded the bytes kept by the loaded module.
+**/
+extern void add_stats_module_load(size_t peak, size_t loaded);
+
+/**
+ * Write all statistics as a line of JSON.
+**/
+extern void dump_stats(FILE *file);
+
+#endif /* __MODPLUG_SPOTIFY_STATS_H__ */
@@ -0,0 +1,351 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Recording of the calls made by the host.
+ *
+ * Each parser and playback function is wrapped by one that times the
+ * call and appends a fixed size record to the trace file. Contexts are
+ * wrapped too, to give them a small identifier.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fingerprint.h"
+#include "input.h"
+#include "trace.h"
+
+
+/**
+ * The size of the stdio buffer of the trace file.
+**/
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * A context of the plugin, seen by the host.
+**/
+struct traced_context {
+	void *inner;
+	uint32_t id;
+};
+
+/**
+ * Simple casting of the context argument present in most functions
+ * below to the correct type for us.
+**/
+#define self ((struct traced_context*) (context))
+
+
+static struct sppb_parser_plugin parser;
+static struct sppb_playback_plugin playback;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static uint64_t trace_start;
+static uint32_t last_context_id;
+
+static const char *CALL_NAMES[TRACE_NUM_CALLS] = {
+	[TRACE_PARSER_CREATE] = "parser_create",
+	[TRACE_PARSER_DESTROY] = "parser_destroy",
+	[TRACE_GET_SONG_COUNT] = "get_song_count",
+	[TRACE_GET_CHANNEL_FORMAT] = "get_channel_format",
+	[TRACE_GET_SAMPLE_RATE] = "get_sample_rate",
+	[TRACE_PARSER_GET_LENGTH] = "parser_get_length_in_samples",
+	[TRACE_HAS_FIELD] = "has_field",
+	[TRACE_READ_FIELD] = "read_field",
+	[TRACE_PLAYBACK_CREATE] = "playback_create",
+	[TRACE_PLAYBACK_DESTROY] = "playback_destroy",
+	[TRACE_DECODE] = "decode",
+	[TRACE_SEEK] = "seek",
+	[TRACE_GET_MINIMUM_BUFFER_SIZE] = "get_minimum_output_buffer_size",
+	[TRACE_PLAYBACK_GET_LENGTH] = "playback_get_length_in_samples",
+	[TRACE_GET_AUDIO_FORMAT] = "get_audio_format",
+};
+
+
+/**
+ * Fill in the timing of a record, and append it to the trace.
+**/
+static void writeRecord(struct trace_record *r, uint64_t start)
+{
+	uint64_t duration = get_time_ns() - start;
+
+	r->time = start - trace_start;
+	r->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+
+	pthread_mutex_lock(&trace_lock);
+	(void) fwrite(r, sizeof(*r), 1, trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void flushTrace(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	(void) fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Create a context, recording which file it is for.
+**/
+static struct traced_context* createContext(struct sppb_plugin_description *plugin, enum trace_call call, void* (*create)(struct sppb_plugin_description*, struct sppb_byte_input*, int), struct sppb_byte_input *input, int song_index)
+{
+	struct trace_record r = { .call = call, .arg = song_index };
+	struct mod_fingerprint fp;
+	struct traced_context *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx) return NULL;
+
+	ctx->id = __atomic_add_fetch(&last_context_id, 1, __ATOMIC_RELAXED);
+	r.context = ctx->id;
+
+	// Lets the replayer find the file. Not part of the timed call.
+	if (get_fingerprint(input, &fp)) {
+		r.size = fp.length;
+		r.value = fp.hash;
+		(void) input->seek(input, 0, SPPB_START);
+	}
+
+	uint64_t start = get_time_ns();
+
+	ctx->inner = create(plugin, input, song_index);
+	r.result = ctx->inner != NULL;
+	writeRecord(&r, start);
+
+	if (!ctx->inner) {
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static void* parserCreate(struct sppb_plugin_description *plugin, struct sppb_byte_input *input, int song_index)
+{
+	return createContext(plugin, TRACE_PARSER_CREATE, parser.create, input, song_index);
+}
+
+static void parserDestroy(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_PARSER_DESTROY, .context = self->id };
+	uint64_t start = get_time_ns();
+
+	parser.destroy(plugin, self->inner);
+	writeRecord(&r, start);
+	flushTrace();
+	free(self);
+}
+
+static unsigned int getSongCount(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_GET_SONG_COUNT, .context = self->id };
+	uint64_t start = get_time_ns();
+	unsigned int ret = parser.get_song_count(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static enum sppb_channel_format getChannelFormat(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_GET_CHANNEL_FORMAT, .context = self->id };
+	uint64_t start = get_time_ns();
+	enum sppb_channel_format ret = parser.get_channel_format(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static unsigned int getSampleRate(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_GET_SAMPLE_RATE, .context = self->id };
+	uint64_t start = get_time_ns();
+	unsigned int ret = parser.get_sample_rate(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static unsigned int parserGetLength(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_PARSER_GET_LENGTH, .context = self->id };
+	uint64_t start = get_time_ns();
+	unsigned int ret = parser.get_length_in_samples(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static spbool hasField(struct sppb_plugin_description *plugin, void *context, enum sppb_field_type type)
+{
+	struct trace_record r = { .call = TRACE_HAS_FIELD, .context = self->id, .arg = type };
+	uint64_t start = get_time_ns();
+	spbool ret = parser.has_field(plugin, self->inner, type);
+
+	r.result = ret != spfalse;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static spbool readField(struct sppb_plugin_description *plugin, void *context, enum sppb_field_type type, char *dest, size_t *length)
+{
+	struct trace_record r = { .call = TRACE_READ_FIELD, .context = self->id, .arg = type, .size = *length };
+	uint64_t start = get_time_ns();
+	spbool ret = parser.read_field(plugin, self->inner, type, dest, length);
+
+	r.result = ret != spfalse;
+	r.flags = dest ? 0 : TRACE_FLAG_NO_BUFFER;
+	r.value = *length;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static void* playbackCreate(struct sppb_plugin_description *plugin, struct sppb_byte_input *input, int song_index)
+{
+	return createContext(plugin, TRACE_PLAYBACK_CREATE, playback.create, input, song_index);
+}
+
+static void playbackDestroy(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_PLAYBACK_DESTROY, .context = self->id };
+	uint64_t start = get_time_ns();
+
+	playback.destroy(plugin, self->inner);
+	writeRecord(&r, start);
+	flushTrace();
+	free(self);
+}
+
+static spbool decode(struct sppb_plugin_description *plugin, void *context, spbyte *dest, size_t *destlen, spbool *final)
+{
+	struct trace_record r = { .call = TRACE_DECODE, .context = self->id, .size = *destlen };
+	uint64_t start = get_time_ns();
+	spbool ret = playback.decode(plugin, self->inner, dest, destlen, final);
+
+	r.result = (ret != spfalse) | (*final != spfalse) << 1;
+	r.value = *destlen;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static spbool seek(struct sppb_plugin_description *plugin, void *context, unsigned int sample)
+{
+	struct trace_record r = { .call = TRACE_SEEK, .context = self->id, .arg = sample };
+	uint64_t start = get_time_ns();
+	spbool ret = playback.seek(plugin, self->inner, sample);
+
+	r.result = ret != spfalse;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static size_t getMinimumOutputBufferSize(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_GET_MINIMUM_BUFFER_SIZE, .context = self->id };
+	uint64_t start = get_time_ns();
+	size_t ret = playback.get_minimum_output_buffer_size(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static unsigned int playbackGetLength(struct sppb_plugin_description *plugin, void *context)
+{
+	struct trace_record r = { .call = TRACE_PLAYBACK_GET_LENGTH, .context = self->id };
+	uint64_t start = get_time_ns();
+	unsigned int ret = playback.get_length_in_samples(plugin, self->inner);
+
+	r.value = ret;
+	writeRecord(&r, start);
+
+	return ret;
+}
+
+static void getAudioFormat(struct sppb_plugin_description *plugin, void *context, unsigned int *samplerate, enum sppb_sound_format *format, enum sppb_channel_format *channels)
+{
+	struct trace_record r = { .call = TRACE_GET_AUDIO_FORMAT, .context = self->id };
+	uint64_t start = get_time_ns();
+
+	playback.get_audio_format(plugin, self->inner, samplerate, format, channels);
+
+	r.arg = *format;
+	r.size = *channels;
+	r.value = *samplerate;
+	writeRecord(&r, start);
+}
+
+void setup_trace(struct sppb_plugin_description *plugin)
+{
+	const char *path = getenv("MPSP_TRACE_FILE");
+	struct trace_header header;
+
+	if (!path || !*path) return;
+
+	trace_file = fopen(path, "wbe");
+
+	if (!trace_file) {
+		MPSP_EPRINTF("failed to open trace file %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	(void) setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(struct trace_record);
+	header.start_time = time(NULL);
+
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+		MPSP_EPRINTF("failed to write trace file %s\n", path);
+		(void) fclose(trace_file);
+		trace_file = NULL;
+		return;
+	}
+
+	trace_start = get_time_ns();
+
+	parser = plugin->parser;
+	playback = plugin->playback;
+
+	plugin->parser.create = parserCreate;
+	plugin->parser.destroy = parserDestroy;
+	plugin->parser.get_song_count = getSongCount;
+	plugin->parser.get_channel_format = getChannelFormat;
+	plugin->parser.get_sample_rate = getSampleRate;
+	plugin->parser.get_length_in_samples = parserGetLength;
+	plugin->parser.has_field = hasField;
+	plugin->parser.read_field = readField;
+
+	plugin->playback.create = playbackCreate;
+	plugin->playback.destroy = playbackDestroy;
+	plugin->playback.decode = decode;
+	plugin->playback.seek = seek;
+	plugin->playback.get_minimum_output_buffer_size = getMinimumOutputBufferSize;
+	plugin->playback.get_length_in_samples = playbackGetLength;
+	plugin->playback.get_audio_format = getAudioFormat;
+
+	MPSP_DPRINTF("tracing to %s\n", path);
+}
+
+const char* get_trace_call_name(enum trace_call call)
+{
+	if (call >= TRACE_NUM_CALLS) return "unknown";
+
+	return CALL_NAMES[call];
+}
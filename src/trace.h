@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Recording of the calls made by the host.
+ */
+#ifndef __MODPLUG_SPOTIFY_TRACE_H__
+#define __MODPLUG_SPOTIFY_TRACE_H__
+
+#include "common.h"
+
+
+// --- Constants ---
+#define TRACE_MAGIC "MPSPTRCE"
+#define TRACE_VERSION 1
+
+/**
+ * Set in trace_record.flags if read_field() was called without a buffer.
+**/
+#define TRACE_FLAG_NO_BUFFER 1
+
+
+// --- Types ---
+/**
+ * The plugin functions that are traced.
+**/
+enum trace_call {
+	TRACE_PARSER_CREATE,
+	TRACE_PARSER_DESTROY,
+	TRACE_GET_SONG_COUNT,
+	TRACE_GET_CHANNEL_FORMAT,
+	TRACE_GET_SAMPLE_RATE,
+	TRACE_PARSER_GET_LENGTH,
+	TRACE_HAS_FIELD,
+	TRACE_READ_FIELD,
+
+	TRACE_PLAYBACK_CREATE,
+	TRACE_PLAYBACK_DESTROY,
+	TRACE_DECODE,
+	TRACE_SEEK,
+	TRACE_GET_MINIMUM_BUFFER_SIZE,
+	TRACE_PLAYBACK_GET_LENGTH,
+	TRACE_GET_AUDIO_FORMAT,
+
+	TRACE_NUM_CALLS,
+};
+
+/**
+ * The header at the start of a trace file.
+**/
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+
+	/// The wall clock time the trace started, in seconds since the epoch.
+	uint64_t start_time;
+};
+
+/**
+ * A single call, in native byte order.
+ *
+ * The meaning of arg, size and value depends on the call:
+ *
+ *   create:            song index, input length, fingerprint hash.
+ *   decode:            -, buffer size, bytes decoded.
+ *   seek:              sample, -, -.
+ *   has_field:         field type, -, -.
+ *   read_field:        field type, buffer size, string length.
+ *   get_audio_format:  sound format, channel format, sample rate.
+ *
+ * Functions returning a number store it in value. Functions returning
+ * a boolean store it in bit 0 of result, and decode() stores final in
+ * bit 1.
+**/
+struct trace_record {
+	/// When the call started, in nanoseconds since the trace started.
+	uint64_t time;
+
+	/// The duration of the call, in nanoseconds.
+	uint32_t duration;
+
+	/// Identifies the context, unique within the trace.
+	uint32_t context;
+
+	uint8_t call;
+	uint8_t result;
+	uint16_t flags;
+	uint32_t arg;
+	uint64_t size;
+	uint64_t value;
+};
+
+
+// --- Functions ---
+/**
+ * Enable tracing, if $MPSP_TRACE_FILE is set.
+ *
+ * The parser and playback functions of the plugin are replaced by
+ * wrappers recording each call to the trace file. The file is written
+ * through a buffer, flushed whenever a context is destroyed.
+ *
+ * @param plugin the plugin description to modify.
+**/
+extern void setup_trace(struct sppb_plugin_description *plugin);
+
+/**
+ * Return a name for a traced call.
+**/
+extern const char* get_trace_call_name(enum trace_call call);
+
+#endif /* __MODPLUG_SPOTIFY_TRACE_H__ */
@@ -0,0 +1,451 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Reading modules out of ZIP archives.
+ *
+ * Only what is needed for MDZ style archives and module packs is
+ * supported: stored and deflated members, no encryption and no ZIP64.
+ * Everything is read through the byte input, and a member is inflated
+ * straight into a buffer of its final size.
+ *
+ * The central directory, with the classified format of each member, is
+ * kept in a small LRU cache, so opening another song of the same
+ * archive only reads that member.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <zlib.h>
+#include "input.h"
+#include "stats.h"
+#include "zip.h"
+
+
+#define ZIP_LOCAL_SIGNATURE 0x04034B50
+#define ZIP_CENTRAL_SIGNATURE 0x02014B50
+#define ZIP_END_SIGNATURE 0x06054B50
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+
+/**
+ * The end record is followed by a comment of at most this size.
+**/
+#define ZIP_MAX_COMMENT_SIZE 65535
+
+/**
+ * The largest central directory we read, in bytes.
+**/
+#define ZIP_MAX_DIRECTORY_SIZE (4 * 1024 * 1024)
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+#define ZIP_FLAG_ENCRYPTED 1
+
+/**
+ * The size of the blocks of compressed data read from the input.
+**/
+#define ZIP_READ_BLOCK_SIZE (64 * 1024)
+
+/**
+ * The number of central directories kept in memory.
+**/
+#define ZIP_DIRECTORY_CACHE_SIZE 8
+
+/**
+ * Extensions of the formats libmodplug loads.
+**/
+static const char *MODULE_EXTENSIONS[] = {
+	"mod", "s3m", "xm", "it", "669", "amf", "ams", "dbm", "dmf", "dsm",
+	"far", "mdl", "med", "mtm", "okt", "ptm", "stm", "ult", "umx", "mt2",
+	"psm",
+};
+
+
+static pthread_mutex_t directory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Recently used directories, most recently used first.
+static struct zip_directory *directories[ZIP_DIRECTORY_CACHE_SIZE];
+
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned long le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+static spbool hasModuleExtension(const unsigned char *name, size_t len)
+{
+	size_t dot = len;
+
+	while (dot && name[dot - 1] != '.' && name[dot - 1] != '/') --dot;
+
+	if (!dot || name[dot - 1] != '.' || len - dot > 3) return spfalse;
+
+	for (size_t i = 0; i < sizeof(MODULE_EXTENSIONS) / sizeof(*MODULE_EXTENSIONS); ++i) {
+		if (strlen(MODULE_EXTENSIONS[i]) == len - dot && !strncasecmp((const char*) name + dot, MODULE_EXTENSIONS[i], len - dot))
+			return sptrue;
+	}
+
+	return spfalse;
+}
+
+/**
+ * Return the offset of the data of a member, after its local header.
+**/
+static long getDataOffset(struct sppb_byte_input *input, const struct zip_member *member)
+{
+	unsigned char buf[ZIP_LOCAL_HEADER_SIZE];
+
+	if (member->offset > LONG_MAX - ZIP_LOCAL_HEADER_SIZE ||
+		read_input_at(input, member->offset, buf, sizeof(buf)) != sizeof(buf) ||
+		le32(buf) != ZIP_LOCAL_SIGNATURE)
+		return -1;
+
+	return member->offset + sizeof(buf) + le16(buf + 26) + le16(buf + 28);
+}
+
+/**
+ * Decompress the first len bytes of a member into dest.
+ *
+ * @return the number of bytes decompressed, or -1 on error.
+**/
+static long inflateMember(struct sppb_byte_input *input, const struct zip_member *member, void *dest, size_t len)
+{
+	long offset = getDataOffset(input, member);
+
+	if (offset < 0) return -1;
+
+	if (len > member->size) len = member->size;
+
+	if (member->method == ZIP_METHOD_STORED) {
+		if (len > member->compressed_size) return -1;
+
+		return read_input_at(input, offset, dest, len);
+	}
+
+	// Sniffing only needs the first few kilobytes.
+	size_t block_size = len < ZIP_READ_BLOCK_SIZE / 16 ? ZIP_READ_BLOCK_SIZE / 16 : ZIP_READ_BLOCK_SIZE;
+	unsigned char *in = malloc(block_size);
+	uint32_t left = member->compressed_size;
+	z_stream zs;
+	int ret = Z_OK;
+
+	if (!in) return -1;
+
+	memset(&zs, 0, sizeof(zs));
+
+	// Raw deflate data, without a zlib header.
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		free(in);
+		return -1;
+	}
+
+	if (input->seek(input, offset, SPPB_START) != offset) {
+		ret = Z_ERRNO;
+		goto exit;
+	}
+
+	zs.next_out = dest;
+	zs.avail_out = len;
+
+	while (zs.avail_out && ret == Z_OK) {
+		if (!zs.avail_in) {
+			if (!left) {
+				ret = Z_DATA_ERROR;
+				break;
+			}
+
+			sppb_ssize n = input->read(input, in, left < block_size ? left : block_size);
+
+			if (n <= 0) {
+				ret = Z_ERRNO;
+				break;
+			}
+
+			add_stats_input(NULL, n);
+			left -= n;
+			zs.next_in = in;
+			zs.avail_in = n;
+		}
+
+		ret = inflate(&zs, Z_NO_FLUSH);
+	}
+
+exit:
+	(void) inflateEnd(&zs);
+	free(in);
+
+	if (ret != Z_OK && ret != Z_STREAM_END) return -1;
+
+	return len - zs.avail_out;
+}
+
+/**
+ * Find the end of central directory record.
+ *
+ * @param input the archive.
+ * @param length the size of the archive.
+ * @param end set to the end record.
+ * @return zero if not found, non-zero otherwise.
+**/
+static spbool findEnd(struct sppb_byte_input *input, sppb_offset length, unsigned char *end)
+{
+	long size = length < ZIP_END_SIZE + ZIP_MAX_COMMENT_SIZE ? length : ZIP_END_SIZE + ZIP_MAX_COMMENT_SIZE;
+
+	if (size < ZIP_END_SIZE) return spfalse;
+
+	unsigned char *buf = malloc(size);
+
+	if (!buf) return spfalse;
+
+	spbool found = spfalse;
+
+	if (read_input_at(input, length - size, buf, size) == size) {
+		// The record is usually last, so search backwards.
+		for (long i = size - ZIP_END_SIZE; i >= 0; --i) {
+			if (le32(buf + i) == ZIP_END_SIGNATURE && i + ZIP_END_SIZE + le16(buf + i + 20) <= size) {
+				memcpy(end, buf + i, ZIP_END_SIZE);
+				found = sptrue;
+				break;
+			}
+		}
+	}
+
+	free(buf);
+
+	return found;
+}
+
+/**
+ * Parse the central directory into dir.
+**/
+static spbool parseDirectory(struct zip_directory *dir, const unsigned char *p, size_t size, unsigned int entries)
+{
+	const unsigned char *end = p + size;
+
+	dir->members = calloc(entries ? entries : 1, sizeof(*dir->members));
+
+	if (!dir->members) return spfalse;
+
+	for (unsigned int i = 0; i < entries; ++i) {
+		if (end - p < ZIP_CENTRAL_HEADER_SIZE || le32(p) != ZIP_CENTRAL_SIGNATURE)
+			return spfalse;
+
+		unsigned int name_len = le16(p + 28);
+		size_t entry_size = ZIP_CENTRAL_HEADER_SIZE + name_len + le16(p + 30) + le16(p + 32);
+
+		if (end - p < (long) entry_size) return spfalse;
+
+		struct zip_member *m = &dir->members[dir->num_members];
+
+		m->method = le16(p + 10);
+		m->crc = le32(p + 16);
+		m->compressed_size = le32(p + 20);
+		m->size = le32(p + 24);
+		m->offset = le32(p + 42);
+		m->known_extension = hasModuleExtension(p + ZIP_CENTRAL_HEADER_SIZE, name_len);
+
+		// Skip directories, encrypted files and what we can't inflate.
+		if ((le16(p + 8) & ZIP_FLAG_ENCRYPTED) ||
+			(m->method != ZIP_METHOD_STORED && m->method != ZIP_METHOD_DEFLATED) ||
+			!m->size || m->size > ZIP_MAX_MEMBER_SIZE ||
+			(name_len && p[ZIP_CENTRAL_HEADER_SIZE + name_len - 1] == '/')) {
+			p += entry_size;
+			continue;
+		}
+
+		++dir->num_members;
+		p += entry_size;
+	}
+
+	return sptrue;
+}
+
+/**
+ * Pick the members that are songs.
+ *
+ * Those are the members with a recognized signature or extension, in
+ * directory order. If there are none, the largest member is assumed to
+ * be the only song.
+**/
+static spbool findSongs(struct zip_directory *dir)
+{
+	unsigned int largest = 0;
+
+	dir->songs = calloc(dir->num_members ? dir->num_members : 1, sizeof(*dir->songs));
+
+	if (!dir->songs) return spfalse;
+
+	for (unsigned int i = 0; i < dir->num_members; ++i) {
+		const struct zip_member *m = &dir->members[i];
+
+		if (m->cls == MOD_CLASS_MODULE || m->cls == MOD_CLASS_PACKED || m->known_extension)
+			dir->songs[dir->num_songs++] = i;
+
+		if (m->size > dir->members[largest].size) largest = i;
+	}
+
+	if (!dir->num_songs && dir->num_members)
+		dir->songs[dir->num_songs++] = largest;
+
+	return sptrue;
+}
+
+static void freeDirectory(struct zip_directory *dir)
+{
+	if (!dir) return;
+
+	free(dir->songs);
+	free(dir->members);
+	free(dir);
+}
+
+static struct zip_directory* readDirectory(struct sppb_byte_input *input)
+{
+	unsigned char end[ZIP_END_SIZE];
+	unsigned char *buf = NULL;
+
+	if (!input->get_length || !input->seek) return NULL;
+
+	sppb_offset length = input->get_length(input);
+
+	if (length <= 0 || !findEnd(input, length, end)) return NULL;
+
+	unsigned int entries = le16(end + 10);
+	unsigned long size = le32(end + 12);
+	unsigned long offset = le32(end + 16);
+
+	if (size > ZIP_MAX_DIRECTORY_SIZE || offset + size > (unsigned long) length) {
+		MPSP_EPRINTF("bad ZIP central directory\n");
+		return NULL;
+	}
+
+	struct zip_directory *dir = calloc(1, sizeof(*dir));
+
+	if (!dir) return NULL;
+
+	buf = malloc(size ? size : 1);
+
+	if (!buf ||
+		read_input_at(input, offset, buf, size) != (long) size ||
+		!parseDirectory(dir, buf, size, entries)) {
+		MPSP_EPRINTF("failed to read ZIP central directory\n");
+		goto error;
+	}
+
+	free(buf);
+	buf = NULL;
+
+	for (unsigned int i = 0; i < dir->num_members; ++i) {
+		struct zip_member *m = &dir->members[i];
+		unsigned char probe[CLASSIFY_HEAD_SIZE];
+		long n = inflateMember(input, m, probe, sizeof(probe));
+
+		m->format = MOD_FORMAT_UNKNOWN;
+		m->cls = n > 0 ? classify_data(probe, n, NULL, 0, &m->format) : MOD_CLASS_REJECTED;
+	}
+
+	if (!findSongs(dir)) goto error;
+
+	MPSP_DPRINTF("zip: %u members, %u songs\n", dir->num_members, dir->num_songs);
+
+	return dir;
+
+error:
+	free(buf);
+	freeDirectory(dir);
+
+	return NULL;
+}
+
+/**
+ * Drop a reference to a directory.
+ *
+ * Must be called with the lock held.
+**/
+static void releaseDirectory(struct zip_directory *dir)
+{
+	if (!--dir->refs) freeDirectory(dir);
+}
+
+struct zip_directory* acquire_zip_directory(struct sppb_byte_input *input, const struct mod_fingerprint *fp)
+{
+	pthread_mutex_lock(&directory_lock);
+
+	for (unsigned int i = 0; i < ZIP_DIRECTORY_CACHE_SIZE && directories[i]; ++i) {
+		struct zip_directory *dir = directories[i];
+
+		if (dir->fp.length == fp->length && dir->fp.hash == fp->hash) {
+			++dir->refs;
+
+			// Move to the front.
+			memmove(directories + 1, directories, i * sizeof(*directories));
+			directories[0] = dir;
+
+			pthread_mutex_unlock(&directory_lock);
+
+			return dir;
+		}
+	}
+
+	pthread_mutex_unlock(&directory_lock);
+
+	struct zip_directory *dir = readDirectory(input);
+
+	if (!dir) return NULL;
+
+	dir->fp = *fp;
+
+	// One for the caller, and one for the cache.
+	dir->refs = 2;
+
+	pthread_mutex_lock(&directory_lock);
+
+	if (directories[ZIP_DIRECTORY_CACHE_SIZE - 1])
+		releaseDirectory(directories[ZIP_DIRECTORY_CACHE_SIZE - 1]);
+
+	memmove(directories + 1, directories, (ZIP_DIRECTORY_CACHE_SIZE - 1) * sizeof(*directories));
+	directories[0] = dir;
+
+	pthread_mutex_unlock(&directory_lock);
+
+	return dir;
+}
+
+void release_zip_directory(struct zip_directory *dir)
+{
+	pthread_mutex_lock(&directory_lock);
+	releaseDirectory(dir);
+	pthread_mutex_unlock(&directory_lock);
+}
+
+const struct zip_member* get_zip_song(const struct zip_directory *dir, unsigned int song_index)
+{
+	if (song_index >= dir->num_songs) return NULL;
+
+	return &dir->members[dir->songs[song_index]];
+}
+
+void* read_zip_member(struct sppb_byte_input *input, const struct zip_member *member)
+{
+	void *data = malloc(member->size);
+
+	if (!data) return NULL;
+
+	if (inflateMember(input, member, data, member->size) != member->size ||
+		crc32(crc32(0, NULL, 0), data, member->size) != member->crc) {
+		MPSP_EPRINTF("failed to decompress ZIP member\n");
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
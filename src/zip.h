@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Reading modules out of ZIP archives.
+ */
+#ifndef __MODPLUG_SPOTIFY_ZIP_H__
+#define __MODPLUG_SPOTIFY_ZIP_H__
+
+#include "common.h"
+#include "fingerprint.h"
+#include "classify.h"
+
+
+// --- Constants ---
+/**
+ * The largest member we inflate, in bytes.
+**/
+#define ZIP_MAX_MEMBER_SIZE (256 * 1024 * 1024)
+
+
+// --- Types ---
+/**
+ * A file in an archive, from the central directory.
+**/
+struct zip_member {
+	/// The offset of the local header.
+	uint64_t offset;
+
+	uint32_t compressed_size;
+	uint32_t size;
+	uint32_t crc;
+
+	/// The compression method, stored or deflated.
+	uint16_t method;
+
+	/// Classified from the first bytes of the member.
+	enum mod_class cls;
+	enum mod_format format;
+
+	/// Non-zero if the file extension is one libmodplug knows.
+	spbool known_extension;
+};
+
+/**
+ * The members of an archive that we can decompress.
+**/
+struct zip_directory {
+	/// The fingerprint of the archive.
+	struct mod_fingerprint fp;
+
+	unsigned int num_members;
+	struct zip_member *members;
+
+	/// Indices of the members that are songs, in directory order.
+	unsigned int num_songs;
+	unsigned int *songs;
+
+	// Private to the cache.
+	unsigned int refs;
+};
+
+
+// --- Functions ---
+/**
+ * Return the central directory of an archive, reading it if needed.
+ *
+ * Encrypted members, and members using compression methods other than
+ * stored and deflated, are left out. The format of each member is
+ * sniffed by decompressing its first few bytes.
+ *
+ * @param input the archive. Must support get_length() and seek().
+ * @param fp the fingerprint of the archive, the cache key.
+ * @return NULL on error, a reference to release_zip_directory() on success.
+**/
+extern struct zip_directory* acquire_zip_directory(struct sppb_byte_input *input, const struct mod_fingerprint *fp);
+
+/**
+ * Release a reference returned by acquire_zip_directory().
+**/
+extern void release_zip_directory(struct zip_directory *dir);
+
+/**
+ * Return the member holding a song.
+ *
+ * Songs are the members with a recognized signature or extension. If
+ * there are none, the largest member is the only song.
+ *
+ * @return NULL if there is no such song.
+**/
+extern const struct zip_member* get_zip_song(const struct zip_directory *dir, unsigned int song_index);
+
+/**
+ * Decompress a member into a newly allocated buffer of its exact size.
+ *
+ * The compressed data is streamed from the input, so the only large
+ * allocation is the returned buffer.
+ *
+ * @param input the archive.
+ * @param member the member to read.
+ * @return NULL on error, a buffer of member->size bytes to free() on success.
+**/
+extern void* read_zip_member(struct sppb_byte_input *input, const struct zip_member *member);
+
+#endif /* __MODPLUG_SPOTIFY_ZIP_H__ */
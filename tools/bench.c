@@ -0,0 +1,354 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Benchmark of a built plugin over a corpus of module files.
+ *
+ * The plugin is loaded the way Spotify loads it, and driven through the
+ * parser and playback interfaces. Results are written as one JSON
+ * object per line: one per file, and a summary at the end. Two builds
+ * can be compared by running both over the same corpus, and two
+ * settings by running with different MPSP_* variables, like
+ * MPSP_OUTPUT_RATE=48000 against the default 44100 Hz.
+ *
+ * Usage: mpsp-bench [-d seconds] [-n seeks] plugin.splugin path...
+ */
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "fileinput.h"
+
+
+/**
+ * The size of each decode() call, in bytes.
+**/
+#define DECODE_BUFFER_SIZE 16384
+
+/**
+ * The default maximum length of audio to decode per file, in seconds.
+**/
+#define DEFAULT_DECODE_SECONDS 60
+
+/**
+ * The default number of seeks per file.
+**/
+#define DEFAULT_SEEKS 32
+
+/**
+ * Results of benchmarking a single file.
+**/
+struct file_result {
+	double load_ms;
+	double parse_ms;
+	double decode_ms;
+	double audio_seconds;
+	unsigned int num_seeks;
+};
+
+/**
+ * Totals over all files.
+**/
+struct totals {
+	unsigned int files;
+	unsigned int failed;
+	double load_ms;
+	double parse_ms;
+	double decode_ms;
+	double audio_seconds;
+
+	unsigned int num_seeks;
+	unsigned int seeks_capacity;
+	double *seeks;
+};
+
+
+static struct sppb_plugin_description *plugin;
+static double decode_seconds = DEFAULT_DECODE_SECONDS;
+static unsigned int num_seeks = DEFAULT_SEEKS;
+static struct totals totals;
+
+
+static double getTimeMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long getPeakRssKiB(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru)) return -1;
+
+	return ru.ru_maxrss;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Return the given percentile of a sorted array.
+**/
+static double getPercentile(const double *values, unsigned int n, double p)
+{
+	if (!n) return 0;
+
+	unsigned int i = (unsigned int) (p / 100 * (n - 1) + 0.5);
+
+	return values[i];
+}
+
+static void addSeek(double ms)
+{
+	if (totals.num_seeks == totals.seeks_capacity) {
+		unsigned int capacity = totals.seeks_capacity ? totals.seeks_capacity * 2 : 1024;
+		double *seeks = realloc(totals.seeks, capacity * sizeof(*seeks));
+
+		if (!seeks) return;
+
+		totals.seeks = seeks;
+		totals.seeks_capacity = capacity;
+	}
+
+	totals.seeks[totals.num_seeks++] = ms;
+}
+
+/**
+ * Print a string as a JSON string literal.
+**/
+static void printJsonString(const char *s)
+{
+	putchar('"');
+
+	for (; *s; ++s) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') printf("\\%c", c);
+		else if (c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+	}
+
+	putchar('"');
+}
+
+static void printSeekStats(const double *seeks, unsigned int n)
+{
+	printf("\"seeks\":%u,\"seek_p50_ms\":%.3f,\"seek_p90_ms\":%.3f,\"seek_p99_ms\":%.3f,\"seek_max_ms\":%.3f",
+		n,
+		getPercentile(seeks, n, 50),
+		getPercentile(seeks, n, 90),
+		getPercentile(seeks, n, 99),
+		n ? seeks[n - 1] : 0);
+}
+
+/**
+ * Parse the file, and time it.
+**/
+static spbool benchParse(struct file_input *fin, struct file_result *result)
+{
+	char title[256];
+	size_t len = sizeof(title);
+	double start = getTimeMs();
+
+	fin->pos = 0;
+
+	void *ctx = plugin->parser.create(plugin, &fin->input, 0);
+
+	if (!ctx) return spfalse;
+
+	(void) plugin->parser.get_length_in_samples(plugin, ctx);
+	(void) plugin->parser.get_sample_rate(plugin, ctx);
+	(void) plugin->parser.get_channel_format(plugin, ctx);
+	(void) plugin->parser.read_field(plugin, ctx, SPPB_FIELD_TYPE_TITLE, title, &len);
+	plugin->parser.destroy(plugin, ctx);
+
+	result->parse_ms = getTimeMs() - start;
+
+	return sptrue;
+}
+
+/**
+ * Load, decode and seek in the file, and time it.
+**/
+static spbool benchPlayback(struct file_input *fin, struct file_result *result, double *seeks)
+{
+	static char buf[DECODE_BUFFER_SIZE];
+	unsigned int rate, length;
+	enum sppb_sound_format format;
+	enum sppb_channel_format channels;
+	double start = getTimeMs();
+
+	fin->pos = 0;
+
+	void *ctx = plugin->playback.create(plugin, &fin->input, 0);
+
+	if (!ctx) return spfalse;
+
+	result->load_ms = getTimeMs() - start;
+
+	plugin->playback.get_audio_format(plugin, ctx, &rate, &format, &channels);
+	length = plugin->playback.get_length_in_samples(plugin, ctx);
+
+	size_t frame_size = (channels == SPPB_CHANNEL_FORMAT_MONO ? 1 : 2) *
+		(format == SPPB_SOUND_FORMAT_IEEE_FLOAT ? 4 : format / 8);
+	uint64_t frames = 0, max_frames = (uint64_t) (decode_seconds * rate);
+	spbool final = spfalse;
+
+	start = getTimeMs();
+
+	while (!final && frames < max_frames) {
+		size_t len = sizeof(buf);
+
+		if (!plugin->playback.decode(plugin, ctx, (spbyte*) buf, &len, &final))
+			break;
+
+		frames += len / frame_size;
+	}
+
+	result->decode_ms = getTimeMs() - start;
+	result->audio_seconds = rate ? (double) frames / rate : 0;
+
+	// A fixed seed, so two builds seek to the same positions.
+	unsigned int seed = length;
+
+	for (unsigned int i = 0; length && i < num_seeks; ++i) {
+		size_t len = sizeof(buf);
+
+		seed = seed * 1103515245 + 12345;
+
+		unsigned int sample = (uint64_t) (seed >> 8) * length >> 24;
+
+		start = getTimeMs();
+		plugin->playback.seek(plugin, ctx, sample);
+
+		// Include the first decode, since some of the work may be deferred.
+		(void) plugin->playback.decode(plugin, ctx, (spbyte*) buf, &len, &final);
+		seeks[result->num_seeks++] = getTimeMs() - start;
+	}
+
+	plugin->playback.destroy(plugin, ctx);
+
+	return sptrue;
+}
+
+static void benchFile(void *opaque, const char *path)
+{
+	struct file_input fin;
+	struct file_result result;
+	double seeks[num_seeks ? num_seeks : 1];
+
+	memset(&result, 0, sizeof(result));
+
+	if (!open_file_input(&fin, path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	++totals.files;
+
+	if (!benchParse(&fin, &result) || !benchPlayback(&fin, &result, seeks)) {
+		++totals.failed;
+		printf("{\"file\":");
+		printJsonString(path);
+		printf(",\"error\":true}\n");
+		close_file_input(&fin);
+		return;
+	}
+
+	close_file_input(&fin);
+
+	totals.load_ms += result.load_ms;
+	totals.parse_ms += result.parse_ms;
+	totals.decode_ms += result.decode_ms;
+	totals.audio_seconds += result.audio_seconds;
+
+	for (unsigned int i = 0; i < result.num_seeks; ++i)
+		addSeek(seeks[i]);
+
+	qsort(seeks, result.num_seeks, sizeof(*seeks), compareDoubles);
+
+	printf("{\"file\":");
+	printJsonString(path);
+	printf(",\"load_ms\":%.3f,\"parse_ms\":%.3f,\"decode_ms\":%.3f,\"audio_s\":%.3f,\"realtime\":%.1f,",
+		result.load_ms,
+		result.parse_ms,
+		result.decode_ms,
+		result.audio_seconds,
+		result.decode_ms > 0 ? result.audio_seconds * 1e3 / result.decode_ms : 0);
+	printSeekStats(seeks, result.num_seeks);
+	printf(",\"peak_rss_kib\":%ld}\n", getPeakRssKiB());
+	fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-n seeks] plugin.splugin path...\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch (opt) {
+		case 'd': decode_seconds = atof(optarg); break;
+		case 'n': num_seeks = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 2) usage(argv[0]);
+
+	double start = getTimeMs();
+	void *lib = dlopen(argv[optind], RTLD_NOW | RTLD_LOCAL);
+
+	if (!lib) {
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+
+	struct sppb_plugin_description* (*create)(void) = (struct sppb_plugin_description* (*)(void)) dlsym(lib, "CreateSpotifyPlaybackPlugin");
+
+	if (!create || !(plugin = create())) {
+		fprintf(stderr, "%s: not a playback plugin\n", argv[optind]);
+		return 1;
+	}
+
+	double plugin_ms = getTimeMs() - start;
+
+	for (int i = optind + 1; i < argc; ++i)
+		walk_files(argv[i], benchFile, NULL);
+
+	qsort(totals.seeks, totals.num_seeks, sizeof(*totals.seeks), compareDoubles);
+
+	printf("{\"summary\":true,\"plugin\":");
+	printJsonString(argv[optind]);
+	printf(",\"plugin_load_ms\":%.3f,\"files\":%u,\"failed\":%u,\"load_ms\":%.3f,\"parse_ms\":%.3f,\"decode_ms\":%.3f,\"audio_s\":%.3f,\"realtime\":%.1f,",
+		plugin_ms,
+		totals.files,
+		totals.failed,
+		totals.load_ms,
+		totals.parse_ms,
+		totals.decode_ms,
+		totals.audio_seconds,
+		totals.decode_ms > 0 ? totals.audio_seconds * 1e3 / totals.decode_ms : 0);
+	printSeekStats(totals.seeks, totals.num_seeks);
+	printf(",\"peak_rss_kib\":%ld}\n", getPeakRssKiB());
+
+	free(totals.seeks);
+
+	return totals.failed ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Byte inputs reading from files, for the tools.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fileinput.h"
+
+
+static sppb_offset getFileLength(struct sppb_byte_input *input)
+{
+	struct stat sb;
+
+	if (fstat(((struct file_input*) input)->fd, &sb)) return -1;
+
+	return sb.st_size;
+}
+
+static sppb_ssize readFile(struct sppb_byte_input *input, void *buf, size_t size)
+{
+	struct file_input *fin = (struct file_input*) input;
+	ssize_t n = pread(fin->fd, buf, size, fin->pos);
+
+	if (n > 0) fin->pos += n;
+
+	return n;
+}
+
+static sppb_offset seekFile(struct sppb_byte_input *input, sppb_offset offset, enum sppb_whence whence)
+{
+	struct file_input *fin = (struct file_input*) input;
+	sppb_offset pos;
+
+	switch (whence) {
+	case SPPB_START: pos = offset; break;
+	case SPPB_CURRENT: pos = fin->pos + offset; break;
+	case SPPB_END: pos = getFileLength(input) + offset; break;
+	default: return -1;
+	}
+
+	if (pos < 0) return -1;
+
+	return fin->pos = pos;
+}
+
+spbool open_file_input(struct file_input *fin, const char *path)
+{
+	memset(fin, 0, sizeof(*fin));
+	fin->input.get_length = getFileLength;
+	fin->input.read = readFile;
+	fin->input.seek = seekFile;
+	fin->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	return fin->fd >= 0;
+}
+
+void close_file_input(struct file_input *fin)
+{
+	if (fin->fd >= 0) (void) close(fin->fd);
+
+	fin->fd = -1;
+}
+
+void walk_files(const char *path, file_callback callback, void *opaque)
+{
+	struct stat sb;
+	struct dirent **names;
+
+	if (stat(path, &sb)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		callback(opaque, path);
+		return;
+	}
+
+	int n = scandir(path, &names, NULL, alphasort);
+
+	if (n < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (names[i]->d_name[0] != '.') {
+			char child[strlen(path) + strlen(names[i]->d_name) + 2];
+
+			sprintf(child, "%s/%s", path, names[i]->d_name);
+			walk_files(child, callback, opaque);
+		}
+
+		free(names[i]);
+	}
+
+	free(names);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Byte inputs reading from files, for the tools.
+ */
+#ifndef __MODPLUG_SPOTIFY_FILEINPUT_H__
+#define __MODPLUG_SPOTIFY_FILEINPUT_H__
+
+#include "local_file_plugin_api.h"
+
+
+// --- Types ---
+/**
+ * A byte input reading from a file descriptor.
+**/
+struct file_input {
+	struct sppb_byte_input input;
+	int fd;
+	sppb_offset pos;
+};
+
+/**
+ * Called for each file found by walk_files().
+**/
+typedef void (*file_callback)(void *opaque, const char *path);
+
+
+// --- Functions ---
+/**
+ * Open a file as a byte input.
+ *
+ * @return zero on error, with errno set, non-zero otherwise.
+**/
+extern spbool open_file_input(struct file_input *fin, const char *path);
+
+/**
+ * Close a file opened with open_file_input().
+**/
+extern void close_file_input(struct file_input *fin);
+
+/**
+ * Call the callback for a file, or for all files under a directory.
+ *
+ * Directories are walked recursively, in name order, skipping hidden
+ * files. Errors are printed to stderr.
+**/
+extern void walk_files(const char *path, file_callback callback, void *opaque);
+
+#endif /* __MODPLUG_SPOTIFY_FILEINPUT_H__ */
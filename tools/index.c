@@ -0,0 +1,571 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Indexer of module libraries, through the parser plugin.
+ *
+ * The tree is walked up front, and the files are split into one
+ * contiguous run per worker thread, so files of a folder are usually
+ * read by the same thread. A worker that runs out steals from the end
+ * of the run of another. Each worker reads one file at a time, and the
+ * total size of the files being read is kept within a budget, so a few
+ * huge archives can't all be in memory at once.
+ *
+ * The index is written as one JSON object per song. Files whose size
+ * and modification time are the same as in the previous index are not
+ * read again, but copied from it.
+ *
+ * Usage: mpsp-index [-j jobs] [-m megabytes] -o index.jsonl path...
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "classify.h"
+#include "fileinput.h"
+#include "fingerprint.h"
+#include "header.h"
+
+
+/**
+ * The default memory budget for files being read, in megabytes.
+**/
+#define DEFAULT_MEMORY_MB 256
+
+/**
+ * The longest title read from the parser.
+**/
+#define MAX_TITLE_LENGTH 255
+
+/**
+ * A file to index.
+**/
+struct task {
+	char *path;
+	uint64_t size;
+	int64_t mtime;
+};
+
+/**
+ * The files of a worker, taken from the front by the owner and from the
+ * back by thieves.
+**/
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct task *tasks;
+	size_t head;
+	size_t tail;
+};
+
+/**
+ * The lines of a file in the previous index.
+**/
+struct old_entry {
+	char *path;
+	uint64_t size;
+	int64_t mtime;
+	const char *lines;
+	size_t len;
+};
+
+
+static struct sppb_plugin_description *plugin;
+static unsigned int num_workers;
+static struct worker *workers;
+
+static struct task *tasks;
+static size_t num_tasks;
+static size_t tasks_capacity;
+
+static struct old_entry *old_entries;
+static size_t old_capacity;
+
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memory_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t memory_budget = (uint64_t) DEFAULT_MEMORY_MB << 20;
+static uint64_t memory_used;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *output;
+static unsigned long num_indexed;
+static unsigned long num_unchanged;
+static unsigned long num_failed;
+static unsigned long num_songs;
+
+
+static double getTimeMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Print a string as a JSON string literal.
+**/
+static void printJsonString(FILE *file, const char *s)
+{
+	putc('"', file);
+
+	for (; *s; ++s) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+		else if (c < 0x20) fprintf(file, "\\u%04x", c);
+		else putc(c, file);
+	}
+
+	putc('"', file);
+}
+
+/**
+ * Parse a string printed by printJsonString().
+ *
+ * @param p the opening quote.
+ * @param end set to after the closing quote.
+ * @return NULL on error, a newly allocated string otherwise.
+**/
+static char* parseJsonString(const char *p, const char **end)
+{
+	if (*p++ != '"') return NULL;
+
+	char *s = malloc(strlen(p) + 1), *q = s;
+
+	if (!s) return NULL;
+
+	while (*p && *p != '"') {
+		if (*p != '\\') {
+			*q++ = *p++;
+		} else if (p[1] == 'u') {
+			unsigned int c;
+
+			if (sscanf(p + 2, "%4x", &c) != 1) break;
+
+			*q++ = c;
+			p += 6;
+		} else if (p[1]) {
+			*q++ = p[1];
+			p += 2;
+		} else {
+			break;
+		}
+	}
+
+	if (*p != '"') {
+		free(s);
+		return NULL;
+	}
+
+	*q = 0;
+	*end = p + 1;
+
+	return s;
+}
+
+static uint64_t hashPath(const char *path)
+{
+	return hash_bytes(0, path, strlen(path));
+}
+
+/**
+ * Return the slot of a path in the previous index.
+**/
+static struct old_entry* findOldEntry(const char *path)
+{
+	if (!old_capacity) return NULL;
+
+	for (size_t i = hashPath(path) & (old_capacity - 1);; i = (i + 1) & (old_capacity - 1)) {
+		if (!old_entries[i].path || !strcmp(old_entries[i].path, path))
+			return &old_entries[i];
+	}
+}
+
+/**
+ * Read the previous index, if there is one.
+ *
+ * The lines of a file are written together, so they are kept as a
+ * single run. The data is kept for the lifetime of the process.
+**/
+static void readOldIndex(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (!file) return;
+
+	size_t len = 0, capacity = 0, lines = 0;
+	char *data = NULL;
+	char *line = NULL;
+	ssize_t n;
+
+	while ((n = getline(&line, &capacity, file)) > 0) {
+		char *tmp = realloc(data, len + n + 1);
+
+		if (!tmp) break;
+
+		data = tmp;
+		memcpy(data + len, line, n);
+		len += n;
+		++lines;
+	}
+
+	free(line);
+	(void) fclose(file);
+
+	if (!data) return;
+
+	data[len] = 0;
+
+	for (old_capacity = 16; old_capacity < 2 * lines; old_capacity *= 2) {}
+
+	old_entries = calloc(old_capacity, sizeof(*old_entries));
+
+	if (!old_entries) {
+		old_capacity = 0;
+		return;
+	}
+
+	struct old_entry *last = NULL;
+
+	for (char *p = data; *p;) {
+		char *eol = strchr(p, '\n');
+		const char *rest;
+		char *name = strncmp(p, "{\"path\":", 8) ? NULL : parseJsonString(p + 8, &rest);
+		unsigned long long size;
+		long long mtime;
+
+		if (!eol) break;
+
+		if (name && sscanf(rest, ",\"size\":%llu,\"mtime\":%lld", &size, &mtime) == 2) {
+			if (last && !strcmp(last->path, name) && last->lines + last->len == p) {
+				last->len = eol + 1 - last->lines;
+				free(name);
+			} else {
+				last = findOldEntry(name);
+				free(last->path);
+				last->path = name;
+				last->size = size;
+				last->mtime = mtime;
+				last->lines = p;
+				last->len = eol + 1 - p;
+			}
+		} else {
+			free(name);
+		}
+
+		p = eol + 1;
+	}
+}
+
+static void addFile(void *opaque, const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) || !S_ISREG(sb.st_mode)) return;
+
+	int64_t mtime = (int64_t) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	struct old_entry *old = findOldEntry(path);
+
+	// Unchanged files are copied from the previous index.
+	if (old && old->path && old->size == (uint64_t) sb.st_size && old->mtime == mtime) {
+		fwrite(old->lines, 1, old->len, output);
+		++num_unchanged;
+		return;
+	}
+
+	if (num_tasks == tasks_capacity) {
+		size_t capacity = tasks_capacity ? tasks_capacity * 2 : 1024;
+		struct task *tmp = realloc(tasks, capacity * sizeof(*tmp));
+
+		if (!tmp) return;
+
+		tasks = tmp;
+		tasks_capacity = capacity;
+	}
+
+	struct task *task = &tasks[num_tasks];
+
+	if (!(task->path = strdup(path))) return;
+
+	task->size = sb.st_size;
+	task->mtime = mtime;
+	++num_tasks;
+}
+
+/**
+ * Take a task, from our own run, or from the end of another's.
+**/
+static struct task* takeTask(struct worker *self)
+{
+	struct task *task = NULL;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->head < self->tail) task = &self->tasks[self->head++];
+	pthread_mutex_unlock(&self->lock);
+
+	for (unsigned int i = 1; !task && i < num_workers; ++i) {
+		struct worker *victim = &workers[(self - workers + i) % num_workers];
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail) task = &victim->tasks[--victim->tail];
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return task;
+}
+
+/**
+ * Wait until a file fits in the memory budget.
+ *
+ * A file larger than the budget is read when nothing else is.
+**/
+static void acquireMemory(uint64_t size)
+{
+	pthread_mutex_lock(&memory_lock);
+
+	while (memory_used && memory_used + size > memory_budget)
+		pthread_cond_wait(&memory_cond, &memory_lock);
+
+	memory_used += size;
+	pthread_mutex_unlock(&memory_lock);
+}
+
+static void releaseMemory(uint64_t size)
+{
+	pthread_mutex_lock(&memory_lock);
+	memory_used -= size;
+	pthread_cond_broadcast(&memory_cond);
+	pthread_mutex_unlock(&memory_lock);
+}
+
+static void printFileStart(FILE *file, const struct task *task)
+{
+	fprintf(file, "{\"path\":");
+	printJsonString(file, task->path);
+	fprintf(file, ",\"size\":%llu,\"mtime\":%lld",
+		(unsigned long long) task->size,
+		(long long) task->mtime);
+}
+
+/**
+ * Print the line of a song.
+**/
+static void printSong(FILE *file, const struct task *task, void *ctx, unsigned int song, unsigned int songs, const struct mod_fingerprint *file_fp, enum mod_format format, unsigned int channels)
+{
+	char title[MAX_TITLE_LENGTH + 1];
+	size_t title_length = MAX_TITLE_LENGTH;
+	struct mod_fingerprint fp = *file_fp;
+	const char *format_name = get_mod_format_name(format);
+
+	if (!plugin->parser.read_field(plugin, ctx, SPPB_FIELD_TYPE_TITLE, title, &title_length))
+		title_length = 0;
+
+	title[title_length] = 0;
+	set_fingerprint_song(&fp, song);
+
+	printFileStart(file, task);
+	fprintf(file, ",\"song\":%u,\"songs\":%u,\"title\":", song, songs);
+	printJsonString(file, title);
+	fprintf(file, ",\"format\":");
+	if (format_name) printJsonString(file, format_name);
+	else fprintf(file, "null");
+	if (channels) fprintf(file, ",\"channels\":%u", channels);
+	else fprintf(file, ",\"channels\":null");
+	fprintf(file, ",\"rate\":%u,\"samples\":%u,\"fingerprint\":\"%016llx-%016llx\"}\n",
+		plugin->parser.get_sample_rate(plugin, ctx),
+		plugin->parser.get_length_in_samples(plugin, ctx),
+		(unsigned long long) fp.length,
+		(unsigned long long) fp.hash);
+}
+
+/**
+ * Index all songs of a file.
+ *
+ * The parser doesn't tell the module format or channel count, so those
+ * are read from the header here.
+ *
+ * @param file the stream to print to.
+ * @return the number of songs indexed, zero on error.
+**/
+static unsigned int indexFile(FILE *file, const struct task *task)
+{
+	struct file_input fin;
+	struct mod_fingerprint fp;
+	enum mod_format format;
+	unsigned int channels = 0, songs = 0;
+
+	if (!open_file_input(&fin, task->path)) {
+		fprintf(stderr, "%s: %s\n", task->path, strerror(errno));
+		return 0;
+	}
+
+	if (!get_fingerprint(&fin.input, &fp)) goto exit;
+
+	if (classify_input(&fin.input, &format) == MOD_CLASS_REJECTED) goto exit;
+
+	if (format >= MOD_FORMAT_MOD && format <= MOD_FORMAT_IT) {
+		struct mod_header *header = read_mod_header(&fin.input);
+
+		if (header) channels = header->channels;
+
+		free_mod_header(header);
+	}
+
+	for (unsigned int song = 0; !song || song < songs; ++song) {
+		fin.pos = 0;
+
+		void *ctx = plugin->parser.create(plugin, &fin.input, song);
+
+		if (!ctx) {
+			if (!song) goto exit;
+
+			continue;
+		}
+
+		if (!song && !(songs = plugin->parser.get_song_count(plugin, ctx))) songs = 1;
+
+		printSong(file, task, ctx, song, songs, &fp, format, channels);
+		plugin->parser.destroy(plugin, ctx);
+	}
+
+exit:
+	close_file_input(&fin);
+
+	return songs;
+}
+
+static void* workerMain(void *arg)
+{
+	struct worker *self = arg;
+	struct task *task;
+
+	while ((task = takeTask(self))) {
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *file = open_memstream(&buf, &len);
+
+		if (!file) continue;
+
+		acquireMemory(task->size);
+
+		unsigned int songs = indexFile(file, task);
+
+		releaseMemory(task->size);
+
+		// Failures are indexed too, so they aren't retried until changed.
+		if (!songs) {
+			printFileStart(file, task);
+			fprintf(file, ",\"error\":true}\n");
+		}
+
+		(void) fclose(file);
+
+		pthread_mutex_lock(&output_lock);
+		fwrite(buf, 1, len, output);
+		if (songs) ++num_indexed;
+		else ++num_failed;
+		num_songs += songs;
+		pthread_mutex_unlock(&output_lock);
+
+		free(buf);
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-j jobs] [-m megabytes] -o index.jsonl path...\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *index_path = NULL;
+	int opt;
+
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "j:m:o:")) != -1) {
+		switch (opt) {
+		case 'j': num_workers = atoi(optarg); break;
+		case 'm': memory_budget = (uint64_t) atol(optarg) << 20; break;
+		case 'o': index_path = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 1 || !index_path) usage(argv[0]);
+
+	if (!num_workers) num_workers = 1;
+
+	// Files are rarely parsed twice, so don't keep them around.
+	setenv("MPSP_MODULE_CACHE_SIZE", "1", 0);
+
+	double start = getTimeMs();
+
+	if (!(plugin = CreateSpotifyPlaybackPlugin())) {
+		fprintf(stderr, "failed to create the plugin\n");
+		return 1;
+	}
+
+	char tmp_path[strlen(index_path) + 5];
+
+	sprintf(tmp_path, "%s.tmp", index_path);
+	readOldIndex(index_path);
+
+	if (!(output = fopen(tmp_path, "wb"))) {
+		fprintf(stderr, "%s: %s\n", tmp_path, strerror(errno));
+		return 1;
+	}
+
+	for (int i = optind; i < argc; ++i)
+		walk_files(argv[i], addFile, NULL);
+
+	if (num_workers > num_tasks) num_workers = num_tasks ? num_tasks : 1;
+
+	if (!(workers = calloc(num_workers, sizeof(*workers)))) return 1;
+
+	for (unsigned int i = 0; i < num_workers; ++i) {
+		struct worker *w = &workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->tasks = tasks;
+		w->head = num_tasks * i / num_workers;
+		w->tail = num_tasks * (i + 1) / num_workers;
+
+		if (pthread_create(&w->thread, NULL, workerMain, w)) {
+			fprintf(stderr, "failed to start worker thread\n");
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; i < num_workers; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	if (fclose(output) || rename(tmp_path, index_path)) {
+		fprintf(stderr, "%s: %s\n", index_path, strerror(errno));
+		return 1;
+	}
+
+	double ms = getTimeMs() - start;
+	unsigned long files = num_indexed + num_failed + num_unchanged;
+
+	printf("{\"summary\":true,\"files\":%lu,\"indexed\":%lu,\"unchanged\":%lu,\"failed\":%lu,\"songs\":%lu,\"workers\":%u,\"elapsed_ms\":%.3f,\"files_per_s\":%.1f}\n",
+		files,
+		num_indexed,
+		num_unchanged,
+		num_failed,
+		num_songs,
+		num_workers,
+		ms,
+		ms > 0 ? files * 1e3 / ms : 0);
+
+	return 0;
+}
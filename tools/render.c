@@ -0,0 +1,512 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Renders a song on all cores, for bulk pre-rendering and analysis.
+ *
+ * libmodplug keeps its mixer state in global variables, so a process
+ * can only render one song at a time. The song is instead split into
+ * segments at order starts, found by walking the song without mixing,
+ * and each segment is rendered by a separate process through the
+ * plugin, which is linked in. A segment starts playing a few seconds early, so notes
+ * started before it have the right volume and position, and overlaps
+ * the next segment by a short crossfade, which hides anything that
+ * still differs where they are stitched together.
+ *
+ * The result is approximate: seeking doesn't restore everything the
+ * channels and the global volume were at, so a segment can sound
+ * different from a sequential rendering until its notes are replaced.
+ * With -v, the song is also rendered sequentially, and any difference
+ * is reported and fails the run. The plugin's PCM cache is disabled,
+ * so nothing rendered here ends up in it.
+ *
+ * Usage: mpsp-render [-j jobs] [-p preroll] [-x crossfade] [-s song] [-v] file output.raw
+ *
+ * The output is raw PCM in the plugin's output format. A JSON object
+ * with timings, and the differences if verifying, is written to stdout.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "fileinput.h"
+#include "header.h"
+#include "input.h"
+#include "modcache.h"
+#include "seekindex.h"
+
+
+/**
+ * The size of each decode() call, in bytes.
+**/
+#define DECODE_BUFFER_SIZE 16384
+
+/**
+ * The default time each segment starts early, in seconds.
+**/
+#define DEFAULT_PREROLL_SECONDS 5
+
+/**
+ * The default crossfade between segments, in milliseconds.
+**/
+#define DEFAULT_CROSSFADE_MS 10
+
+/**
+ * The maximum number of segments.
+**/
+#define MAX_SEGMENTS 256
+
+/**
+ * A part of the song, rendered by a child process.
+**/
+struct segment {
+	/// Samples to render, and to keep, including the crossfade.
+	uint64_t preroll_start;
+	uint64_t start;
+	uint64_t end;
+
+	FILE *file;
+	pid_t pid;
+};
+
+/**
+ * The output format of the plugin.
+**/
+struct audio_format {
+	unsigned int rate;
+	enum sppb_sound_format format;
+	unsigned int channels;
+	size_t frame_size;
+};
+
+
+static struct sppb_plugin_description *plugin;
+static unsigned int jobs;
+static double preroll_seconds = DEFAULT_PREROLL_SECONDS;
+static unsigned int crossfade_ms = DEFAULT_CROSSFADE_MS;
+static int song_index;
+static spbool verify;
+
+
+static double getTimeMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Find the output format and length of the song.
+**/
+static spbool probeSong(const char *path, struct audio_format *af, uint64_t *length)
+{
+	struct file_input fin;
+
+	if (!open_file_input(&fin, path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return spfalse;
+	}
+
+	void *ctx = plugin->playback.create(plugin, &fin.input, song_index);
+
+	if (!ctx) {
+		fprintf(stderr, "%s: can't play song %d\n", path, song_index);
+		close_file_input(&fin);
+		return spfalse;
+	}
+
+	enum sppb_channel_format channels;
+
+	plugin->playback.get_audio_format(plugin, ctx, &af->rate, &af->format, &channels);
+	*length = plugin->playback.get_length_in_samples(plugin, ctx);
+	plugin->playback.destroy(plugin, ctx);
+	close_file_input(&fin);
+
+	af->channels = channels == SPPB_CHANNEL_FORMAT_MONO ? 1 : 2;
+	af->frame_size = af->channels * (af->format == SPPB_SOUND_FORMAT_IEEE_FLOAT ? 4 : af->format / 8);
+
+	return sptrue;
+}
+
+/**
+ * Split the song at order starts, or evenly if that isn't possible.
+**/
+static unsigned int planSegments(const char *path, unsigned int rate, uint64_t length, struct segment *segments)
+{
+	uint64_t starts[MAX_SEGMENTS];
+	unsigned int count = jobs < MAX_SEGMENTS ? jobs : MAX_SEGMENTS;
+	unsigned int n = 0;
+	struct file_input fin;
+
+	if (open_file_input(&fin, path)) {
+		struct cached_module *module = acquire_module(&fin.input, song_index);
+
+		if (module) {
+			struct memory_input mem;
+			struct mod_header *header = read_mod_header(init_memory_input(&mem, module->data, module->len));
+			struct seek_index *index = header ? build_seek_index(header, rate) : NULL;
+
+			if (index) n = split_seek_index(index, length, count, starts);
+
+			free_seek_index(index);
+			free_mod_header(header);
+			release_module(module);
+		}
+
+		close_file_input(&fin);
+	}
+
+	// A song with a single long order can't be split at order starts.
+	if (n < 2) {
+		for (n = 0; n < count; ++n)
+			starts[n] = length * n / count;
+	}
+
+	uint64_t preroll = (uint64_t) (preroll_seconds * rate);
+	uint64_t crossfade = (uint64_t) rate * crossfade_ms / 1000;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		segments[i].start = starts[i];
+		segments[i].preroll_start = starts[i] > preroll ? starts[i] - preroll : 0;
+		segments[i].end = i + 1 < n ? starts[i + 1] + crossfade : UINT64_MAX;
+	}
+
+	return n;
+}
+
+/**
+ * Render a segment into its file. Runs in the child process.
+**/
+static spbool renderSegment(const char *path, const struct segment *seg, size_t frame_size)
+{
+	static char buf[DECODE_BUFFER_SIZE];
+	struct file_input fin;
+
+	if (!open_file_input(&fin, path)) return spfalse;
+
+	void *ctx = plugin->playback.create(plugin, &fin.input, song_index);
+
+	if (!ctx) return spfalse;
+
+	if (seg->preroll_start) plugin->playback.seek(plugin, ctx, seg->preroll_start);
+
+	uint64_t frame = seg->preroll_start;
+	spbool final = spfalse;
+
+	while (!final && frame < seg->end) {
+		size_t len = sizeof(buf) / frame_size * frame_size;
+
+		if (!plugin->playback.decode(plugin, ctx, (spbyte*) buf, &len, &final))
+			return spfalse;
+
+		uint64_t n = len / frame_size;
+		uint64_t first = frame < seg->start ? seg->start - frame : 0;
+		uint64_t last = frame + n > seg->end ? seg->end - frame : n;
+
+		if (first < last && fwrite(buf + first * frame_size, frame_size, last - first, seg->file) != last - first)
+			return spfalse;
+
+		frame += n;
+	}
+
+	plugin->playback.destroy(plugin, ctx);
+	close_file_input(&fin);
+
+	return fflush(seg->file) == 0;
+}
+
+/**
+ * Return a sample as a float, whatever the format.
+**/
+static float getSample(const struct audio_format *af, const unsigned char *p)
+{
+	switch (af->format) {
+	case SPPB_SOUND_FORMAT_8BITS_PER_SAMPLE: return (*p - 128) / 128.0f;
+	case SPPB_SOUND_FORMAT_16BITS_PER_SAMPLE: return *(const int16_t*) p / 32768.0f;
+	default: return *(const float*) p;
+	}
+}
+
+static void setSample(const struct audio_format *af, unsigned char *p, float f)
+{
+	switch (af->format) {
+	case SPPB_SOUND_FORMAT_8BITS_PER_SAMPLE:
+		f = f * 128 + 128.5f;
+		*p = f < 0 ? 0 : f > 255 ? 255 : (unsigned char) f;
+		break;
+
+	case SPPB_SOUND_FORMAT_16BITS_PER_SAMPLE:
+		f = f * 32768 + (f < 0 ? -0.5f : 0.5f);
+		*(int16_t*) p = f < -32768 ? -32768 : f > 32767 ? 32767 : (int16_t) f;
+		break;
+
+	default:
+		*(float*) p = f;
+		break;
+	}
+}
+
+/**
+ * Fade from the end of one segment into the start of the next, in place.
+**/
+static void crossfade(const struct audio_format *af, const unsigned char *from, unsigned char *to, size_t frames)
+{
+	size_t bytes_per_sample = af->frame_size / af->channels;
+
+	for (size_t i = 0; i < frames; ++i) {
+		float w = (i + 0.5f) / frames;
+
+		for (unsigned int c = 0; c < af->channels; ++c) {
+			size_t offset = i * af->frame_size + c * bytes_per_sample;
+
+			setSample(af, to + offset, getSample(af, from + offset) * (1 - w) + getSample(af, to + offset) * w);
+		}
+	}
+}
+
+/**
+ * Write the segments to the output, crossfading where they overlap.
+**/
+static spbool stitchSegments(struct segment *segments, unsigned int n, const struct audio_format *af, FILE *out, uint64_t *frames)
+{
+	size_t overlap = (size_t) af->rate * crossfade_ms / 1000 * af->frame_size;
+	unsigned char *tail = malloc(overlap ? overlap : 1);
+	unsigned char *head = malloc(overlap ? overlap : 1);
+	char buf[DECODE_BUFFER_SIZE];
+	size_t tail_len = 0;
+	spbool ret = spfalse;
+
+	*frames = 0;
+
+	if (!tail || !head) goto exit;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		FILE *f = segments[i].file;
+
+		if (fseeko(f, 0, SEEK_END)) goto exit;
+
+		off_t size = ftello(f) / af->frame_size * af->frame_size;
+		off_t keep = size;
+
+		rewind(f);
+
+		// The start of this segment fades in over the end of the last one.
+		if (tail_len) {
+			size_t len = (off_t) tail_len < size ? tail_len : (size_t) size;
+
+			if (fread(head, 1, len, f) != len) goto exit;
+
+			crossfade(af, tail, head, len / af->frame_size);
+
+			if (fwrite(head, 1, len, out) != len) goto exit;
+
+			keep -= len;
+		}
+
+		// The end of this segment is kept for the next one.
+		size_t next_tail = i + 1 < n && (off_t) overlap < keep ? overlap : 0;
+
+		for (off_t left = keep - next_tail; left > 0;) {
+			size_t len = left < (off_t) sizeof(buf) ? (size_t) left : sizeof(buf) / af->frame_size * af->frame_size;
+
+			if (fread(buf, 1, len, f) != len || fwrite(buf, 1, len, out) != len)
+				goto exit;
+
+			left -= len;
+		}
+
+		if (next_tail && fread(tail, 1, next_tail, f) != next_tail) goto exit;
+
+		tail_len = next_tail;
+		*frames += (size - (off_t) next_tail) / af->frame_size;
+	}
+
+	ret = fflush(out) == 0;
+
+exit:
+	free(tail);
+	free(head);
+
+	return ret;
+}
+
+/**
+ * Compare the output with a sequential rendering.
+ *
+ * Frames only in one of them count as differing.
+ *
+ * @param diff set to the number of frames that differ.
+ * @param max_error set to the largest difference of a sample.
+**/
+static spbool compareOutput(const struct audio_format *af, FILE *out, FILE *ref, uint64_t *diff, float *max_error)
+{
+	static unsigned char a[DECODE_BUFFER_SIZE], b[DECODE_BUFFER_SIZE];
+	size_t bytes_per_sample = af->frame_size / af->channels;
+	size_t len = sizeof(a) / af->frame_size;
+
+	*diff = 0;
+	*max_error = 0;
+
+	rewind(out);
+	rewind(ref);
+
+	for (;;) {
+		size_t na = fread(a, af->frame_size, len, out);
+		size_t nb = fread(b, af->frame_size, len, ref);
+		size_t n = na < nb ? na : nb;
+
+		for (size_t i = 0; i < n; ++i) {
+			const unsigned char *pa = a + i * af->frame_size, *pb = b + i * af->frame_size;
+
+			if (!memcmp(pa, pb, af->frame_size)) continue;
+
+			++*diff;
+
+			for (unsigned int c = 0; c < af->channels; ++c) {
+				float e = getSample(af, pa + c * bytes_per_sample) - getSample(af, pb + c * bytes_per_sample);
+
+				if (e < 0) e = -e;
+				if (e > *max_error) *max_error = e;
+			}
+		}
+
+		*diff += (na > nb ? na : nb) - n;
+
+		if (na < len || nb < len) break;
+	}
+
+	return !ferror(out) && !ferror(ref);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-j jobs] [-p preroll] [-x crossfade] [-s song] [-v] file output.raw\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct segment segments[MAX_SEGMENTS];
+	struct segment sequential = { .end = UINT64_MAX };
+	struct audio_format af;
+	uint64_t length, frames, diff = 0;
+	float max_error = 0;
+	int opt;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "j:p:x:s:v")) != -1) {
+		switch (opt) {
+		case 'j': jobs = atoi(optarg); break;
+		case 'p': preroll_seconds = atof(optarg); break;
+		case 'x': crossfade_ms = atoi(optarg); break;
+		case 's': song_index = atoi(optarg); break;
+		case 'v': verify = sptrue; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2) usage(argv[0]);
+
+	if (!jobs) jobs = 1;
+
+	const char *path = argv[optind];
+
+	// The output is approximate, and helper threads don't survive fork().
+	unsetenv("MPSP_PCM_CACHE_DIR");
+	unsetenv("MPSP_RENDER_AHEAD_MS");
+	unsetenv("MPSP_STATS_FILE");
+	unsetenv("MPSP_TRACE_FILE");
+
+	double start = getTimeMs();
+
+	if (!(plugin = CreateSpotifyPlaybackPlugin())) {
+		fprintf(stderr, "failed to create the plugin\n");
+		return 1;
+	}
+
+	if (!probeSong(path, &af, &length)) return 1;
+
+	unsigned int n = planSegments(path, af.rate, length, segments);
+	FILE *out = fopen(argv[optind + 1], verify ? "w+b" : "wb");
+
+	if (!out) {
+		fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+		return 1;
+	}
+
+	// The sequential rendering is started last, so it doesn't delay the
+	// segments.
+	for (unsigned int i = 0; i < n + verify; ++i) {
+		struct segment *seg = i < n ? &segments[i] : &sequential;
+
+		if (!(seg->file = tmpfile())) {
+			fprintf(stderr, "failed to create a temporary file: %s\n", strerror(errno));
+			return 1;
+		}
+
+		fflush(NULL);
+		seg->pid = fork();
+
+		if (seg->pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if (!seg->pid) _exit(renderSegment(path, seg, af.frame_size) ? 0 : 1);
+	}
+
+	spbool ok = sptrue;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		int status;
+
+		if (waitpid(segments[i].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: rendering segment %u failed\n", path, i);
+			ok = spfalse;
+		}
+	}
+
+	if (ok && !stitchSegments(segments, n, &af, out, &frames)) {
+		fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+		ok = spfalse;
+	}
+
+	double ms = getTimeMs() - start;
+
+	if (verify) {
+		int status;
+
+		if (waitpid(sequential.pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: rendering sequentially failed\n", path);
+			ok = spfalse;
+		} else if (ok && !compareOutput(&af, out, sequential.file, &diff, &max_error)) {
+			fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+			ok = spfalse;
+		}
+	}
+
+	if (fclose(out)) ok = spfalse;
+
+	if (!ok) return 1;
+
+	printf("{\"file\":\"%s\",\"segments\":%u,\"frames\":%llu,\"render_ms\":%.3f,\"realtime\":%.1f",
+		path, n, (unsigned long long) frames, ms,
+		ms > 0 ? frames * 1e3 / af.rate / ms : 0);
+
+	if (verify)
+		printf(",\"differing_frames\":%llu,\"max_error\":%.6f", (unsigned long long) diff, max_error);
+
+	printf("}\n");
+
+	if (diff) {
+		fprintf(stderr, "%s: %llu frames differ from a sequential rendering\n", path, (unsigned long long) diff);
+		return 1;
+	}
+
+	return 0;
+}
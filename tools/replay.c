@@ -0,0 +1,371 @@
+/*
+ * Copyright © 2011 Tommie Gannert
+ *
+ * Replays a trace recorded with MPSP_TRACE_FILE against the plugin.
+ *
+ * The files the host used are found in the given corpus by their
+ * fingerprints, and every call is made again with the same arguments.
+ * One JSON object per call type is written, with the latency
+ * distribution both as recorded and as replayed.
+ *
+ * The plugin is linked in, rather than loaded, so this replays against
+ * the code it was built with.
+ *
+ * Usage: mpsp-replay [-p] trace path...
+ *
+ * With -p, calls are paced to their recorded times instead of being
+ * made back to back.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fileinput.h"
+#include "fingerprint.h"
+#include "trace.h"
+
+
+/**
+ * A file in the corpus.
+**/
+struct corpus_file {
+	struct mod_fingerprint fp;
+	char *path;
+};
+
+/**
+ * A context created while replaying.
+**/
+struct replay_context {
+	struct file_input fin;
+	void *ctx;
+	spbool playback;
+};
+
+/**
+ * Latencies of one call type, in nanoseconds.
+**/
+struct latencies {
+	unsigned int count;
+	unsigned int capacity;
+	uint32_t *recorded;
+	uint32_t *replayed;
+};
+
+
+static struct sppb_plugin_description *plugin;
+
+static unsigned int num_files;
+static struct corpus_file *files;
+
+static unsigned int num_contexts;
+static struct replay_context **contexts;
+
+static struct latencies latencies[TRACE_NUM_CALLS];
+
+static unsigned int skipped_calls;
+static unsigned int missing_files;
+
+
+static void addFile(void *opaque, const char *path)
+{
+	struct file_input fin;
+	struct mod_fingerprint fp;
+
+	if (!open_file_input(&fin, path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	spbool ok = get_fingerprint(&fin.input, &fp);
+
+	close_file_input(&fin);
+
+	if (!ok) return;
+
+	struct corpus_file *p = realloc(files, (num_files + 1) * sizeof(*files));
+
+	if (!p) return;
+
+	files = p;
+	files[num_files].fp = fp;
+	files[num_files].path = strdup(path);
+	++num_files;
+}
+
+static const char* findFile(uint64_t length, uint64_t hash)
+{
+	for (unsigned int i = 0; i < num_files; ++i) {
+		if (files[i].fp.length == length && files[i].fp.hash == hash)
+			return files[i].path;
+	}
+
+	return NULL;
+}
+
+static void addLatency(enum trace_call call, uint32_t recorded, uint64_t replayed)
+{
+	struct latencies *l = &latencies[call];
+
+	if (l->count == l->capacity) {
+		unsigned int capacity = l->capacity ? l->capacity * 2 : 256;
+		uint32_t *a = realloc(l->recorded, capacity * sizeof(*a));
+
+		if (!a) return;
+
+		l->recorded = a;
+		a = realloc(l->replayed, capacity * sizeof(*a));
+
+		if (!a) return;
+
+		l->replayed = a;
+		l->capacity = capacity;
+	}
+
+	l->recorded[l->count] = recorded;
+	l->replayed[l->count] = replayed > UINT32_MAX ? UINT32_MAX : replayed;
+	++l->count;
+}
+
+static uint64_t getTimeNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec = t / 1000000000,
+		.tv_nsec = t % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static struct replay_context* getContext(uint32_t id)
+{
+	return id < num_contexts ? contexts[id] : NULL;
+}
+
+/**
+ * Create a context for the file a create record refers to.
+**/
+static void createContext(const struct trace_record *r)
+{
+	const char *path = findFile(r->size, r->value);
+
+	if (!path) {
+		++missing_files;
+		return;
+	}
+
+	if (r->context >= num_contexts) {
+		unsigned int n = r->context + 1;
+		struct replay_context **p = realloc(contexts, n * sizeof(*contexts));
+
+		if (!p) return;
+
+		memset(p + num_contexts, 0, (n - num_contexts) * sizeof(*p));
+		contexts = p;
+		num_contexts = n;
+	}
+
+	struct replay_context *rc = calloc(1, sizeof(*rc));
+
+	if (!rc) return;
+
+	if (!open_file_input(&rc->fin, path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(rc);
+		return;
+	}
+
+	uint64_t start = getTimeNs();
+
+	rc->playback = r->call == TRACE_PLAYBACK_CREATE;
+	rc->ctx = rc->playback ?
+		plugin->playback.create(plugin, &rc->fin.input, r->arg) :
+		plugin->parser.create(plugin, &rc->fin.input, r->arg);
+
+	addLatency(r->call, r->duration, getTimeNs() - start);
+
+	if (!rc->ctx) {
+		close_file_input(&rc->fin);
+		free(rc);
+		return;
+	}
+
+	contexts[r->context] = rc;
+}
+
+static void destroyContext(uint32_t id)
+{
+	struct replay_context *rc = contexts[id];
+
+	if (rc->playback) plugin->playback.destroy(plugin, rc->ctx);
+	else plugin->parser.destroy(plugin, rc->ctx);
+
+	close_file_input(&rc->fin);
+	free(rc);
+	contexts[id] = NULL;
+}
+
+/**
+ * Make the call of a record again.
+**/
+static void replayRecord(const struct trace_record *r)
+{
+	static char *buf;
+	static size_t buf_size;
+	struct replay_context *rc;
+
+	if (r->call == TRACE_PARSER_CREATE || r->call == TRACE_PLAYBACK_CREATE) {
+		createContext(r);
+		return;
+	}
+
+	if (r->call >= TRACE_NUM_CALLS || !(rc = getContext(r->context))) {
+		++skipped_calls;
+		return;
+	}
+
+	if ((r->call == TRACE_DECODE || r->call == TRACE_READ_FIELD) && r->size > buf_size) {
+		char *p = realloc(buf, r->size);
+
+		if (!p) {
+			++skipped_calls;
+			return;
+		}
+
+		buf = p;
+		buf_size = r->size;
+	}
+
+	size_t len = r->size;
+	spbool final = spfalse;
+	unsigned int rate;
+	enum sppb_sound_format format;
+	enum sppb_channel_format channels;
+	uint64_t start = getTimeNs();
+
+	switch ((enum trace_call) r->call) {
+	case TRACE_PARSER_DESTROY:
+	case TRACE_PLAYBACK_DESTROY: destroyContext(r->context); break;
+	case TRACE_GET_SONG_COUNT: (void) plugin->parser.get_song_count(plugin, rc->ctx); break;
+	case TRACE_GET_CHANNEL_FORMAT: (void) plugin->parser.get_channel_format(plugin, rc->ctx); break;
+	case TRACE_GET_SAMPLE_RATE: (void) plugin->parser.get_sample_rate(plugin, rc->ctx); break;
+	case TRACE_PARSER_GET_LENGTH: (void) plugin->parser.get_length_in_samples(plugin, rc->ctx); break;
+	case TRACE_HAS_FIELD: (void) plugin->parser.has_field(plugin, rc->ctx, r->arg); break;
+
+	case TRACE_READ_FIELD:
+		(void) plugin->parser.read_field(plugin, rc->ctx, r->arg, (r->flags & TRACE_FLAG_NO_BUFFER) ? NULL : buf, &len);
+		break;
+
+	case TRACE_DECODE: (void) plugin->playback.decode(plugin, rc->ctx, (spbyte*) buf, &len, &final); break;
+	case TRACE_SEEK: (void) plugin->playback.seek(plugin, rc->ctx, r->arg); break;
+	case TRACE_GET_MINIMUM_BUFFER_SIZE: (void) plugin->playback.get_minimum_output_buffer_size(plugin, rc->ctx); break;
+	case TRACE_PLAYBACK_GET_LENGTH: (void) plugin->playback.get_length_in_samples(plugin, rc->ctx); break;
+	case TRACE_GET_AUDIO_FORMAT: plugin->playback.get_audio_format(plugin, rc->ctx, &rate, &format, &channels); break;
+	default: break;
+	}
+
+	addLatency(r->call, r->duration, getTimeNs() - start);
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void printDistribution(const char *prefix, uint32_t *values, unsigned int n)
+{
+	qsort(values, n, sizeof(*values), compareLatencies);
+
+	printf(",\"%s_p50_us\":%.1f,\"%s_p90_us\":%.1f,\"%s_p99_us\":%.1f,\"%s_max_us\":%.1f",
+		prefix, values[(n - 1) / 2] / 1e3,
+		prefix, values[(unsigned int) ((n - 1) * 0.9 + 0.5)] / 1e3,
+		prefix, values[(unsigned int) ((n - 1) * 0.99 + 0.5)] / 1e3,
+		prefix, values[n - 1] / 1e3);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-p] trace path...\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	spbool paced = spfalse;
+	struct trace_header header;
+	struct trace_record r;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p")) != -1) {
+		switch (opt) {
+		case 'p': paced = sptrue; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 2) usage(argv[0]);
+
+	FILE *trace = fopen(argv[optind], "rb");
+
+	if (!trace) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, trace) != 1 ||
+		memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+		header.version != TRACE_VERSION ||
+		header.record_size != sizeof(r)) {
+		fprintf(stderr, "%s: not a trace file, or the wrong version\n", argv[optind]);
+		return 1;
+	}
+
+	for (int i = optind + 1; i < argc; ++i)
+		walk_files(argv[i], addFile, NULL);
+
+	if (!(plugin = CreateSpotifyPlaybackPlugin())) {
+		fprintf(stderr, "failed to create the plugin\n");
+		return 1;
+	}
+
+	uint64_t start = getTimeNs();
+
+	while (fread(&r, sizeof(r), 1, trace) == 1) {
+		if (paced) sleepUntil(start + r.time);
+
+		replayRecord(&r);
+	}
+
+	for (unsigned int i = 0; i < num_contexts; ++i) {
+		if (contexts[i]) destroyContext(i);
+	}
+
+	for (unsigned int call = 0; call < TRACE_NUM_CALLS; ++call) {
+		struct latencies *l = &latencies[call];
+
+		if (!l->count) continue;
+
+		printf("{\"call\":\"%s\",\"count\":%u", get_trace_call_name(call), l->count);
+		printDistribution("recorded", l->recorded, l->count);
+		printDistribution("replayed", l->replayed, l->count);
+		printf("}\n");
+	}
+
+	printf("{\"summary\":true,\"files\":%u,\"missing_files\":%u,\"skipped_calls\":%u}\n",
+		num_files, missing_files, skipped_calls);
+
+	return 0;
+}